@@ -0,0 +1,77 @@
+/*
+ * acache.c implements the link metadata cache as defined in acache.h
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "acache.h"
+
+typedef struct {
+	ino_t ino;           /* 0 if the slot is empty */
+	unsigned int gen;
+	int64_t size;
+	time_t when;         /* looked up */
+} acache_entry_t;
+
+static struct {
+	pthread_mutex_t lock;
+	acache_entry_t slot[ACACHE_SLOTS];
+	uint64_t hits;
+	uint64_t misses;
+} acache = { PTHREAD_MUTEX_INITIALIZER };
+
+
+void acache_put(ino_t ino, int64_t size, unsigned int gen)
+{
+	acache_entry_t *e = &acache.slot[ino % ACACHE_SLOTS];
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&acache.lock);
+	e->ino = ino;
+	e->when = now;
+	e->gen = gen;
+	e->size = size;
+	pthread_mutex_unlock(&acache.lock);
+}
+
+int acache_get(ino_t ino, unsigned int gen, int64_t *size)
+{
+	acache_entry_t *e = &acache.slot[ino % ACACHE_SLOTS];
+	time_t now = time(NULL);
+	int found;
+
+	pthread_mutex_lock(&acache.lock);
+	found = e->ino == ino && e->gen == gen && now - e->when <= ACACHE_TTL;
+	if (found) {
+		*size = e->size;
+		acache.hits++;
+	} else {
+		acache.misses++;
+	}
+	pthread_mutex_unlock(&acache.lock);
+	return found;
+}
+
+void acache_stats(uint64_t *hits, uint64_t *misses)
+{
+	pthread_mutex_lock(&acache.lock);
+	*hits = acache.hits;
+	*misses = acache.misses;
+	pthread_mutex_unlock(&acache.lock);
+}
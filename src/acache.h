@@ -0,0 +1,57 @@
+/*
+ * acache.h defines api for caching the link metadata of files by inode
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ACACHE_H
+#define ACACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * What getattr needs of a file beyond lstat: its size if it is a child,
+ * SQL_LINK_PARENT or SQL_LINK_NONE otherwise, as sql_get_links reports
+ * it.  readdir fills it for a whole directory at once, so the getattr
+ * that follows for every entry doesn't look each up on its own.  Entries
+ * hold the sql_generation() they were looked up at and are only good
+ * while it hasn't changed, and for ACACHE_TTL seconds at most, as the
+ * generation doesn't see what dln does when the link table isn't cached.
+ * The table is a fixed number of slots indexed by inode, a newer entry
+ * replaces whatever had its slot.
+ */
+#define ACACHE_SLOTS 16384
+#define ACACHE_TTL 1
+
+
+/*
+ * Remember size for the file with inode ino, as of generation gen
+ */
+void acache_put(ino_t ino, int64_t size, unsigned int gen);
+
+/*
+ * Returns 1 and sets size if ino was remembered at generation gen, 0
+ * otherwise
+ */
+int acache_get(ino_t ino, unsigned int gen, int64_t *size);
+
+/*
+ * Returns the lookups answered from the cache and those that were not
+ */
+void acache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif /* ACACHE_H */
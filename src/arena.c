@@ -0,0 +1,214 @@
+/*
+ * arena.c implements the stream buffer lists as defined in arena.h
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "arena.h"
+
+/*
+ * Every buffer is preceded by its size, so it can be found by size once
+ * it is back in the pool
+ */
+typedef struct arena_block {
+	size_t size;
+	struct arena_block *next;   /* of the same size, most recently freed first */
+	struct arena_block *prev;
+	struct arena_block *newer;  /* of any size, by when they were freed */
+	struct arena_block *older;
+	size_t pad;                 /* keeps the buffer after it 16-byte aligned */
+} arena_block_t;
+
+/*
+ * The buffers of one size in the pool
+ */
+typedef struct {
+	size_t size;                /* 0 if the list is unused */
+	arena_block_t *free;
+} arena_list_t;
+
+static struct {
+	pthread_mutex_t lock;
+	arena_list_t lists[ARENA_SIZES];
+	arena_block_t *newest;
+	arena_block_t *oldest;
+	int count;
+	size_t bytes;
+	size_t limit;
+	uint64_t hits;
+	uint64_t misses;
+} arena = { PTHREAD_MUTEX_INITIALIZER };
+
+
+/*
+ * Returns the list of the buffers of size, taking an unused one for it if
+ * add is set, NULL if there is none, with the lock held
+ */
+static arena_list_t *arena_list(size_t size, int add)
+{
+	arena_list_t *l, *unused = NULL;
+
+	for (l = arena.lists; l < arena.lists + ARENA_SIZES; l++) {
+		if (l->size == size) {
+			return l;
+		}
+		if (!l->size && !unused) {
+			unused = l;
+		}
+	}
+	if (!add || !unused) {
+		return NULL;
+	}
+	unused->size = size;
+	return unused;
+}
+
+/*
+ * Take b out of the pool, with the lock held
+ */
+static void arena_unlink(arena_block_t *b)
+{
+	arena_list_t *l = arena_list(b->size, 0);
+
+	if (b->prev) {
+		b->prev->next = b->next;
+	} else {
+		l->free = b->next;
+	}
+	if (b->next) {
+		b->next->prev = b->prev;
+	}
+	if (!l->free) {
+		l->size = 0;
+	}
+
+	if (b->newer) {
+		b->newer->older = b->older;
+	} else {
+		arena.newest = b->older;
+	}
+	if (b->older) {
+		b->older->newer = b->newer;
+	} else {
+		arena.oldest = b->newer;
+	}
+	arena.count--;
+	arena.bytes -= b->size;
+}
+
+/*
+ * Drop the oldest buffers until the pool is within its limits, with the
+ * lock held
+ */
+static void arena_trim()
+{
+	arena_block_t *b;
+
+	while (arena.oldest && (arena.count > ARENA_SLOTS || arena.bytes > arena.limit)) {
+		b = arena.oldest;
+		arena_unlink(b);
+		free(b);
+	}
+}
+
+void arena_init(size_t limit)
+{
+	pthread_mutex_lock(&arena.lock);
+	arena.limit = limit;
+	arena_trim();
+	pthread_mutex_unlock(&arena.lock);
+}
+
+void arena_destroy()
+{
+	arena_init(0);
+}
+
+void *arena_alloc(size_t size)
+{
+	arena_list_t *l;
+	arena_block_t *b;
+
+	pthread_mutex_lock(&arena.lock);
+	l = size ? arena_list(size, 0) : NULL;
+	if (l) {
+		b = l->free;
+		arena_unlink(b);
+		arena.hits++;
+		pthread_mutex_unlock(&arena.lock);
+		return b + 1;
+	}
+	arena.misses++;
+	pthread_mutex_unlock(&arena.lock);
+
+	b = malloc(sizeof(arena_block_t) + size);
+	if (!b) {
+		return NULL;
+	}
+	b->size = size;
+	return b + 1;
+}
+
+void arena_free(void *ptr)
+{
+	arena_list_t *l = NULL;
+	arena_block_t *b;
+
+	if (!ptr) {
+		return;
+	}
+	b = (arena_block_t *) ptr - 1;
+
+	pthread_mutex_lock(&arena.lock);
+	if (b->size && b->size <= arena.limit) {
+		l = arena_list(b->size, 1);
+	}
+	if (!l) {
+		pthread_mutex_unlock(&arena.lock);
+		free(b);
+		return;
+	}
+	b->prev = NULL;
+	b->next = l->free;
+	if (l->free) {
+		l->free->prev = b;
+	}
+	l->free = b;
+
+	b->newer = NULL;
+	b->older = arena.newest;
+	if (arena.newest) {
+		arena.newest->newer = b;
+	} else {
+		arena.oldest = b;
+	}
+	arena.newest = b;
+	arena.count++;
+	arena.bytes += b->size;
+	arena_trim();
+	pthread_mutex_unlock(&arena.lock);
+}
+
+void arena_stats(uint64_t *hits, uint64_t *misses)
+{
+	pthread_mutex_lock(&arena.lock);
+	*hits = arena.hits;
+	*misses = arena.misses;
+	pthread_mutex_unlock(&arena.lock);
+}
@@ -0,0 +1,65 @@
+/*
+ * arena.h defines api for recycling the buffers of xdelta streams
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A stream allocates the same handful of buffers, sized by its window and
+ * the I/O buffer, every time it is set up and frees them all when it is
+ * done.  Freed buffers are kept in one pool for every thread, on a list
+ * per size, and the next allocation of the same size takes the last one
+ * back instead of going to malloc.  The pool keeps at most the limit,
+ * dropping the oldest past it, no more than ARENA_SLOTS buffers and no more
+ * than ARENA_SIZES different sizes, so finding one stays cheap.
+ */
+#define ARENA_SLOTS 256
+#define ARENA_SIZES 32
+
+
+/*
+ * Initialize the pool, keeping at most limit bytes of freed buffers.
+ * A limit of 0 still works but keeps nothing.
+ */
+void arena_init(size_t limit);
+
+/*
+ * Free every buffer the pool keeps
+ */
+void arena_destroy();
+
+/*
+ * Returns size bytes, NULL if out of memory
+ */
+void *arena_alloc(size_t size);
+
+/*
+ * Give back a buffer from arena_alloc, NULL is ignored
+ */
+void arena_free(void *ptr);
+
+/*
+ * Returns the allocations served from the pool and those that were not
+ */
+void arena_stats(uint64_t *hits, uint64_t *misses);
+
+#endif /* ARENA_H */
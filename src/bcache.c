@@ -0,0 +1,252 @@
+/*
+ * bcache.c implements the parent block cache as defined in bcache.h
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bcache.h"
+
+#define BCACHE_BUCKETS 4096
+
+struct bcache_block {
+	bcache_key_t key;
+	uint8_t *data;
+	size_t len;
+	int refs;                     /* pins held by xdelta streams */
+	struct bcache_block *hnext;   /* hash chain */
+	struct bcache_block *prev;    /* LRU list, most recently used first */
+	struct bcache_block *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	bcache_block_t *table[BCACHE_BUCKETS];
+	bcache_block_t *head;
+	bcache_block_t *tail;
+	size_t bytes;
+	size_t limit;
+	uint64_t hits;
+	uint64_t misses;
+} bcache = { PTHREAD_MUTEX_INITIALIZER };
+
+
+static unsigned int bcache_hash(const bcache_key_t *key)
+{
+	uint64_t h = (uint64_t) key->ino * 2654435761U;
+
+	h ^= (uint64_t) key->dev * 40503U;
+	h ^= key->blkno * 2246822519U;
+	return (unsigned int) (h ^ (h >> 32)) % BCACHE_BUCKETS;
+}
+
+static int bcache_key_eq(const bcache_key_t *a, const bcache_key_t *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->gen == b->gen &&
+		a->blksize == b->blksize && a->blkno == b->blkno;
+}
+
+static bcache_block_t *bcache_lookup(const bcache_key_t *key)
+{
+	bcache_block_t *b;
+
+	for (b = bcache.table[bcache_hash(key)]; b; b = b->hnext) {
+		if (bcache_key_eq(&b->key, key)) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static void bcache_lru_remove(bcache_block_t *b)
+{
+	if (b->prev) {
+		b->prev->next = b->next;
+	} else {
+		bcache.head = b->next;
+	}
+	if (b->next) {
+		b->next->prev = b->prev;
+	} else {
+		bcache.tail = b->prev;
+	}
+}
+
+static void bcache_lru_push(bcache_block_t *b)
+{
+	b->prev = NULL;
+	b->next = bcache.head;
+	if (bcache.head) {
+		bcache.head->prev = b;
+	}
+	bcache.head = b;
+	if (!bcache.tail) {
+		bcache.tail = b;
+	}
+}
+
+static void bcache_drop(bcache_block_t *b)
+{
+	bcache_block_t **p = &bcache.table[bcache_hash(&b->key)];
+
+	while (*p != b) {
+		p = &(*p)->hnext;
+	}
+	*p = b->hnext;
+	bcache_lru_remove(b);
+	bcache.bytes -= b->len;
+	free(b->data);
+	free(b);
+}
+
+/*
+ * Evict unpinned blocks, least recently used first, until we fit
+ */
+static void bcache_shrink()
+{
+	bcache_block_t *b, *prev;
+
+	for (b = bcache.tail; b && bcache.bytes > bcache.limit; b = prev) {
+		prev = b->prev;
+		if (!b->refs) {
+			bcache_drop(b);
+		}
+	}
+}
+
+
+void bcache_init(size_t limit)
+{
+	pthread_mutex_lock(&bcache.lock);
+	bcache.limit = limit;
+	pthread_mutex_unlock(&bcache.lock);
+}
+
+void bcache_destroy()
+{
+	pthread_mutex_lock(&bcache.lock);
+	bcache.limit = 0;
+	bcache_shrink();
+	pthread_mutex_unlock(&bcache.lock);
+}
+
+bcache_block_t *bcache_get(const bcache_key_t *key, int fd)
+{
+	bcache_block_t *b, *other;
+	ssize_t r;
+
+	pthread_mutex_lock(&bcache.lock);
+	b = bcache_lookup(key);
+	if (b) {
+		b->refs++;
+		bcache_lru_remove(b);
+		bcache_lru_push(b);
+		bcache.hits++;
+		pthread_mutex_unlock(&bcache.lock);
+		return b;
+	}
+	bcache.misses++;
+	pthread_mutex_unlock(&bcache.lock);
+
+	/* Read the block without holding the lock */
+	b = malloc(sizeof(bcache_block_t));
+	if (!b) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	b->data = malloc(key->blksize);
+	if (!b->data) {
+		free(b);
+		errno = ENOMEM;
+		return NULL;
+	}
+	r = pread(fd, b->data, key->blksize, (off_t) (key->blkno * key->blksize));
+	if (r == -1) {
+		free(b->data);
+		free(b);
+		return NULL;
+	}
+	b->key = *key;
+	b->len = r;
+	b->refs = 1;
+
+	pthread_mutex_lock(&bcache.lock);
+	other = bcache_lookup(key);
+	if (other) {
+		/* Another stream read it in the meantime */
+		other->refs++;
+		pthread_mutex_unlock(&bcache.lock);
+		free(b->data);
+		free(b);
+		return other;
+	}
+	b->hnext = bcache.table[bcache_hash(key)];
+	bcache.table[bcache_hash(key)] = b;
+	bcache_lru_push(b);
+	bcache.bytes += b->len;
+	bcache_shrink();
+	pthread_mutex_unlock(&bcache.lock);
+	return b;
+}
+
+const uint8_t *bcache_data(const bcache_block_t *blk)
+{
+	return blk->data;
+}
+
+size_t bcache_len(const bcache_block_t *blk)
+{
+	return blk->len;
+}
+
+void bcache_release(bcache_block_t *blk)
+{
+	pthread_mutex_lock(&bcache.lock);
+	blk->refs--;
+	if (!blk->refs && bcache.bytes > bcache.limit) {
+		bcache_shrink();
+	}
+	pthread_mutex_unlock(&bcache.lock);
+}
+
+void bcache_invalidate(dev_t dev, ino_t ino)
+{
+	bcache_block_t *b, *next;
+
+	pthread_mutex_lock(&bcache.lock);
+	for (b = bcache.head; b; b = next) {
+		next = b->next;
+		if (b->key.dev == dev && b->key.ino == ino && !b->refs) {
+			bcache_drop(b);
+		}
+	}
+	pthread_mutex_unlock(&bcache.lock);
+}
+
+void bcache_stats(uint64_t *hits, uint64_t *misses)
+{
+	pthread_mutex_lock(&bcache.lock);
+	*hits = bcache.hits;
+	*misses = bcache.misses;
+	pthread_mutex_unlock(&bcache.lock);
+}
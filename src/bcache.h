@@ -0,0 +1,82 @@
+/*
+ * bcache.h defines api for the shared cache of parent (source) blocks
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Parent blocks are keyed by the parent file (device, inode and
+ * generation) and the block size and number the xdelta stream asked for.
+ * Every stream decoding or encoding against the same parent shares them.
+ */
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	uint64_t gen;
+	uint32_t blksize;
+	uint64_t blkno;
+} bcache_key_t;
+
+typedef struct bcache_block bcache_block_t;
+
+
+/*
+ * Initialize the cache, holding at most limit bytes of unpinned blocks.
+ * A limit of 0 still works but keeps nothing once it is released.
+ */
+void bcache_init(size_t limit);
+
+/*
+ * Drop every unpinned block
+ */
+void bcache_destroy();
+
+/*
+ * Returns block key->blkno of the file open at fd, reading it with pread
+ * on a miss.  The block stays pinned, and its data valid, until released
+ * with bcache_release.
+ * Returns the block on success, NULL on error setting errno
+ */
+bcache_block_t *bcache_get(const bcache_key_t *key, int fd);
+
+/*
+ * Data and length of a pinned block
+ */
+const uint8_t *bcache_data(const bcache_block_t *blk);
+size_t bcache_len(const bcache_block_t *blk);
+
+/*
+ * Unpin a block returned by bcache_get
+ */
+void bcache_release(bcache_block_t *blk);
+
+/*
+ * Drop all unpinned blocks of the file dev/ino
+ */
+void bcache_invalidate(dev_t dev, ino_t ino);
+
+/*
+ * Returns the number of lookups that hit and missed the cache
+ */
+void bcache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif /* BCACHE_H */
@@ -17,21 +17,31 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 
 #include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/wait.h>
-#include <semaphore.h>
 #include <fcntl.h> /* for O_* constants */
 #include <limits.h> /* for NAME_MAX */
+#include <sys/ioctl.h>
+#include <linux/fs.h> /* for FICLONE */
+#include <pthread.h>
 
 #include "xdelta/xdelta3.h"
 #include "xdelta/xdelta3.c"
 #include "delta.h"
 #include "sql.h"
 #include "opts.h"
+#include "windex.h"
+#include "wcache.h"
+#include "bcache.h"
+#include "readahead.h"
+#include "pool.h"
+#include "ilock.h"
+#include "arena.h"
+#include "splice.h"
 
 #ifndef DEBUG_MODE1
 #define DEBUG_MODE1 0
@@ -41,6 +51,12 @@
 #define DEBUG_MODE2 0
 #endif
 
+/* Frozen parents, inside DEFS_META_DIR */
+#define XDELTA_BASE_DIR "base"
+
+/* Longest VCDIFF file header a parked decoder remembers */
+#define XDELTA_HDR_MAX 32
+
 #if DEBUG_MODE1
 #define DEBUG1(x) x
 #else
@@ -54,103 +70,569 @@
 #endif
 
 
-char* semaphore_hash (const char* key)
+/*
+ * Size of the VCDIFF file header the encoder emits in front of window 0.
+ * defs never uses secondary compression or a custom code table.
+ */
+static uint64_t xdelta_hdrsize(xd3_stream *stream)
 {
-	/* First character is a slash, followed by a hash of the path */
-	int i;
-	unsigned int tmp_hash = 0;
-	char tmp[NAME_MAX-5];
-	char *hash = malloc(NAME_MAX-4);
-	for(i = 0; i < strlen(key); ++i) {
-		tmp_hash += (unsigned int) key[i] * i;
+	uint64_t size = 5; /* 3 magic bytes, version, header indicator */
+
+	if (stream->enc_appheader) {
+		size += xd3_sizeof_size(stream->enc_appheadsz) + stream->enc_appheadsz;
 	}
-	strcpy(hash, "/");
-	snprintf(tmp, NAME_MAX-5, "%u", tmp_hash);
-	strcat(hash, tmp);
-	return hash;
+	return size;
 }
 
 
-int xdelta_encode (const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* OutFile)
+/*
+ * Window size of deltas encoded against a parent of size bytes: windowabs,
+ * or windowrel of the parent but at most windowmax, and never less than
+ * XD3_ALLOCSIZE
+ */
+static int xdelta_winsize(off_t size)
 {
 	int BufSize;
-	struct stat statbuf;
-	struct stat instatbuf;
-	xd3_stream stream;
-	xd3_config config;
-	xd3_source source;
-	void* Input_Buf;
-	int Input_Buf_Read;
-	int r, ret;
 
 	if (dopt.window_abs) {
 		BufSize = dopt.window_abs;
 	}
+	else if (size * dopt.window_rel > dopt.window_max) {
+		BufSize = dopt.window_max;
+	}
 	else {
-		r = fstat(fileno(SrcFile), &statbuf);
-		if (r) {
-			return -errno;
-		}
-		BufSize = (int) (statbuf.st_size * dopt.window_rel);
+		BufSize = (int) (size * dopt.window_rel);
 	}
 
 	if (BufSize < XD3_ALLOCSIZE) {
 		BufSize = XD3_ALLOCSIZE;
 	}
+	return BufSize;
+}
 
-	printf("xdelta_encode\n");
-	fflush(NULL);
-  
-	memset (&stream, 0, sizeof(stream));
-	memset (&stream, 0, sizeof(source));
 
-	xd3_init_config(&config, XD3_ADLER32);
-	config.winsize = BufSize;
-	xd3_config_stream(&stream, &config);
+/*
+ * Generation of a file, changes whenever the file is rewritten
+ */
+static uint64_t xdelta_generation(const struct stat *statbuf)
+{
+	return ((uint64_t) statbuf->st_mtim.tv_sec << 30) ^
+		(uint64_t) statbuf->st_mtim.tv_nsec ^
+		((uint64_t) statbuf->st_size << 20);
+}
 
 
-	if (SrcFile) {
-		r = fstat(fileno(SrcFile), &statbuf);
-		if (r) {
-			return -errno;
+/*
+ * Drop anything cached from a file that was just rewritten, both its
+ * decoded windows (as a child) and its blocks (as a parent)
+ */
+static void xdelta_invalidate(const char *file)
+{
+	struct stat statbuf;
+
+	if (stat(file, &statbuf) == 0) {
+		wcache_invalidate(statbuf.st_dev, statbuf.st_ino);
+		bcache_invalidate(statbuf.st_dev, statbuf.st_ino);
+	}
+}
+
+
+/*
+ * A change to a file: cut or zero-extended to size, with len bytes of buf
+ * written at off if buf isn't NULL
+ */
+typedef struct {
+	off_t size;
+	const char *buf;
+	size_t len;
+	off_t off;
+} xdelta_change_t;
+
+/*
+ * Lay the bytes written by change over the len bytes at data, which hold
+ * the file from pos on
+ */
+static void xdelta_change_apply(const xdelta_change_t *change, char *data, off_t pos, size_t len)
+{
+	off_t from, to;
+
+	if (!change->buf) {
+		return;
+	}
+	from = change->off > pos ? change->off : pos;
+	to = change->off + (off_t) change->len < pos + (off_t) len ?
+		change->off + (off_t) change->len : pos + (off_t) len;
+	if (from < to) {
+		memcpy(data + (from - pos), change->buf + (from - change->off), to - from);
+	}
+}
+
+
+/*
+ * Source of an xdelta stream: a parent read through the shared block cache,
+ * as it is or as a change about to be made leaves it
+ */
+typedef struct {
+	int fd;
+	bcache_key_t key;
+	bcache_block_t *blk;  /* block currently handed to xdelta, pinned */
+	const xdelta_change_t *change; /* pending on the parent, NULL if none */
+	off_t old;            /* size of the parent before the change */
+	char *patch;          /* block handed to xdelta with the change made */
+} xdelta_src_t;
+
+
+/*
+ * getblk for a source with a change pending: the block of the parent, cut
+ * or zero-extended and written over as the change will leave it
+ */
+static int xdelta_getblk_change(xd3_source *source, xdelta_src_t *src, xoff_t blkno)
+{
+	const xdelta_change_t *change = src->change;
+	off_t start = (off_t) blkno * source->blksize;
+	bcache_block_t *blk;
+	size_t len = 0, n = 0;
+
+	if (start < change->size) {
+		len = change->size - start < (off_t) source->blksize ? change->size - start : source->blksize;
+	}
+	if (start < src->old) {
+		src->key.blkno = blkno;
+		blk = bcache_get(&src->key, src->fd);
+		if (!blk) {
+			return XD3_INTERNAL;
 		}
-		source.size = statbuf.st_size;
-		source.blksize = BufSize;
-		source.curblk = malloc(source.blksize);
-    
-		/* Load 1st block of stream. */
-		r = fseek(SrcFile, 0, SEEK_SET);
-		if (r) {
-			return -errno;
+		n = bcache_len(blk) < len ? bcache_len(blk) : len;
+		memcpy(src->patch, bcache_data(blk), n);
+		bcache_release(blk);
+	}
+	memset(src->patch + n, 0, len - n);
+	xdelta_change_apply(change, src->patch, start, len);
+
+	source->curblk = (uint8_t *) src->patch;
+	source->onblk = len;
+	source->curblkno = blkno;
+	return 0;
+}
+
+/*
+ * getblk callback, installed on every stream that has a source
+ */
+static int xdelta_getblk(xd3_stream *stream, xd3_source *source, xoff_t blkno)
+{
+	xdelta_src_t *src = source->ioh;
+	bcache_block_t *blk;
+
+	if (src->change) {
+		return xdelta_getblk_change(source, src, blkno);
+	}
+
+	src->key.blkno = blkno;
+	blk = bcache_get(&src->key, src->fd);
+	if (!blk) {
+		return XD3_INTERNAL;
+	}
+
+	if (src->blk) {
+		bcache_release(src->blk);
+	}
+	src->blk = blk;
+	source->curblk = bcache_data(blk);
+	source->onblk = bcache_len(blk);
+	source->curblkno = blkno;
+	return 0;
+}
+
+
+/*
+ * alloc and freef callbacks, so streams take their buffers from the arena
+ * and give them back to it
+ */
+static void *xdelta_alloc(void *opaque, usize_t items, usize_t size)
+{
+	return arena_alloc((size_t) items * size);
+}
+
+static void xdelta_free(void *opaque, void *ptr)
+{
+	arena_free(ptr);
+}
+
+
+/*
+ * Attach the parent open at fd as the source of a stream, read in blocks
+ * of blksize bytes, as change leaves it if change isn't NULL
+ */
+static int xdelta_source_open(xd3_stream *stream, xd3_source *source, xdelta_src_t *src, int fd, int blksize,
+			      const xdelta_change_t *change)
+{
+	struct stat statbuf;
+
+	if (fstat(fd, &statbuf)) {
+		return -errno;
+	}
+
+	memset(src, 0, sizeof(xdelta_src_t));
+	src->fd = fd;
+	src->key.dev = statbuf.st_dev;
+	src->key.ino = statbuf.st_ino;
+	src->key.gen = xdelta_generation(&statbuf);
+	src->key.blksize = blksize;
+
+	memset(source, 0, sizeof(xd3_source));
+	source->size = statbuf.st_size;
+	source->blksize = blksize;
+	source->ioh = src;
+
+	if (change) {
+		src->patch = arena_alloc(blksize);
+		if (!src->patch) {
+			return -ENOMEM;
 		}
-		source.onblk = fread((void*)source.curblk, 1, source.blksize, SrcFile);
-		source.curblkno = 0;
-		/* Set the stream. */
-		xd3_set_source(&stream, &source);
+		src->change = change;
+		src->old = statbuf.st_size;
+		source->size = change->size;
+	}
+	xd3_set_source(stream, source);
+	return 0;
+}
+
+
+static void xdelta_source_close(xdelta_src_t *src)
+{
+	if (src->blk) {
+		bcache_release(src->blk);
+		src->blk = NULL;
 	}
+	arena_free(src->patch);
+	src->patch = NULL;
+}
 
-	Input_Buf = malloc(BufSize);  
-	fseek(InFile, 0, SEEK_SET);
 
-	if (InFile) {
-		r = fstat(fileno(InFile), &instatbuf);
+/*
+ * Returns 1 if the len bytes at data are those of the parent at src_off,
+ * read through the block cache the encoder just went through, 0 otherwise
+ */
+static int xdelta_source_same(xdelta_src_t *src, const uint8_t *data, uint64_t src_off, size_t len)
+{
+	bcache_key_t key = src->key;
+	bcache_block_t *blk;
+	size_t off, n, pos;
+	int same = 1;
+
+	/* The cache holds the parent as it is, not as the pending change leaves it */
+	if (src->change) {
+		return 0;
+	}
+
+	for (pos = 0; pos < len && same; pos += n) {
+		key.blkno = (src_off + pos) / key.blksize;
+		off = (src_off + pos) % key.blksize;
+		blk = bcache_get(&key, src->fd);
+		if (!blk) {
+			return 0;
+		}
+		n = bcache_len(blk) > off ? bcache_len(blk) - off : 0;
+		if (n > len - pos) {
+			n = len - pos;
+		}
+		same = n && !memcmp(bcache_data(blk) + off, data + pos, n);
+		bcache_release(blk);
+	}
+	return same;
+}
+
+
+/*
+ * Record the window the encoder just finished, which was written to the
+ * delta file between win_start and win_end.  A window that turned out to
+ * be one stretch of the parent is flagged, so reads pread it instead.
+ */
+static int xdelta_index_window(xd3_stream *stream, windex_t *idx, uint64_t win_start, uint64_t win_end)
+{
+	uint64_t src_off = 0;
+	uint32_t src_len = 0;
+	int r;
+
+	if (stream->current_window == 0) {
+		/* The file header goes out together with the first window */
+		idx->hdr_len = xdelta_hdrsize(stream);
+		win_start += idx->hdr_len;
+	}
+
+	if (xd3_encoder_used_source(stream)) {
+		src_off = stream->src->srcbase;
+		src_len = stream->src->srclen;
+	}
+
+	r = windex_add(idx, stream->total_in - stream->avail_in, stream->avail_in,
+		       win_start, win_end - win_start, src_off, src_len,
+		       adler32(1L, stream->next_in, stream->avail_in));
+	if (!r && src_len && src_len == stream->avail_in &&
+	    xdelta_source_same(stream->src->ioh, stream->next_in, src_off, src_len)) {
+		idx->entries[idx->count - 1].flags = WINDEX_COPY;
+	}
+	return r;
+}
+
+
+/*
+ * Encoder state kept between encodes.  A fresh stream sizes its checksum
+ * tables for the parent and target windows and allocates them on its first
+ * xd3_encode_input, so the stream of the last encode is parked with its
+ * thread, tables and all, and the next encode there with the same window
+ * sizes takes them back and sets up the rest with xd3_encode_init_partial.
+ */
+typedef struct {
+	xd3_stream stream;
+	usize_t winsize;
+	usize_t srcwin_maxsz;
+	/* The tables of the last encode, out of the stream while it is parked */
+	xd3_hash_cfg large_hash;
+	xd3_hash_cfg small_hash;
+	usize_t *large_table;
+	usize_t *small_table;
+	xd3_slist *small_prev;
+} xdelta_encoder_t;
+
+static pthread_key_t xdelta_encoder_key;
+static pthread_once_t xdelta_encoder_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * Free the tables an encoder keeps from its last encode
+ */
+static void xdelta_encoder_drop(xdelta_encoder_t *enc)
+{
+	xdelta_free(NULL, enc->large_table);
+	xdelta_free(NULL, enc->small_table);
+	xdelta_free(NULL, enc->small_prev);
+	enc->large_table = NULL;
+	enc->small_table = NULL;
+	enc->small_prev = NULL;
+}
+
+static void xdelta_encoder_close(xdelta_encoder_t *enc)
+{
+	xdelta_encoder_drop(enc);
+	xd3_free_stream(&enc->stream);
+	free(enc);
+}
+
+static void xdelta_encoder_release(void *arg)
+{
+	xdelta_encoder_close((xdelta_encoder_t *) arg);
+}
+
+static void xdelta_encoder_setup()
+{
+	pthread_key_create(&xdelta_encoder_key, xdelta_encoder_release);
+}
+
+
+/*
+ * Returns an encoder with its stream configured by config, the one parked
+ * with the calling thread if it was set up with the same window sizes,
+ * NULL if out of memory
+ */
+static xdelta_encoder_t *xdelta_encoder_open(xd3_config *config)
+{
+	xdelta_encoder_t *enc;
+
+	pthread_once(&xdelta_encoder_once, xdelta_encoder_setup);
+	enc = (xdelta_encoder_t *) pthread_getspecific(xdelta_encoder_key);
+	if (enc) {
+		pthread_setspecific(xdelta_encoder_key, NULL);
+		if (enc->winsize != config->winsize || enc->srcwin_maxsz != config->srcwin_maxsz) {
+			xdelta_encoder_close(enc);
+			enc = NULL;
+		}
+	}
+	if (!enc) {
+		enc = calloc(1, sizeof(xdelta_encoder_t));
+		if (!enc) {
+			return NULL;
+		}
+		enc->winsize = config->winsize;
+		enc->srcwin_maxsz = config->srcwin_maxsz;
+	}
+	xd3_config_stream(&enc->stream, config);
+	return enc;
+}
+
+
+/*
+ * Hand the encoder's tables back to its stream, once the source is set
+ * and before the first xd3_encode_input.  Tables sized for a parent the
+ * stream doesn't have, or missing one it does, are dropped and the stream
+ * sets itself up from scratch instead.
+ * Returns 0 on success, otherwise -errno
+ */
+static int xdelta_encoder_start(xdelta_encoder_t *enc)
+{
+	xd3_stream *stream = &enc->stream;
+	int ret;
+
+	if (!enc->small_table || !stream->src != !enc->large_table) {
+		xdelta_encoder_drop(enc);
+		return 0;
+	}
+
+	stream->large_hash = enc->large_hash;
+	stream->small_hash = enc->small_hash;
+	stream->large_table = enc->large_table;
+	stream->small_table = enc->small_table;
+	stream->small_prev = enc->small_prev;
+	enc->large_table = NULL;
+	enc->small_table = NULL;
+	enc->small_prev = NULL;
+
+	/* Parent offsets of the last encode mean nothing for this one */
+	if (stream->large_table) {
+		memset(stream->large_table, 0, sizeof(usize_t) * stream->large_hash.size);
+	}
+	stream->small_reset = 1;
+
+	ret = xd3_encode_init_partial(stream);
+	if (ret) {
+		return -ENOMEM;
+	}
+	stream->enc_state = ENC_INPUT;
+	return 0;
+}
+
+
+/*
+ * Leave an encoder that is done with its encode with the calling thread,
+ * in place of the one it had.  Only the tables outlive the stream, and
+ * not at all if they alone would be past the memory kept for buffers.
+ */
+static void xdelta_encoder_park(xdelta_encoder_t *enc)
+{
+	xdelta_encoder_t *old;
+	xd3_stream *stream = &enc->stream;
+	size_t bytes;
+
+	enc->large_hash = stream->large_hash;
+	enc->small_hash = stream->small_hash;
+	enc->large_table = stream->large_table;
+	enc->small_table = stream->small_table;
+	enc->small_prev = stream->small_prev;
+	stream->large_table = NULL;
+	stream->small_table = NULL;
+	stream->small_prev = NULL;
+	xd3_close_stream(stream);
+	xd3_free_stream(stream);
+
+	bytes = sizeof(usize_t) * ((enc->large_table ? enc->large_hash.size : 0) +
+				   (enc->small_table ? enc->small_hash.size : 0));
+	if (bytes > (size_t) dopt.buffer_mem << 20) {
+		xdelta_encoder_close(enc);
+		return;
+	}
+
+	pthread_once(&xdelta_encoder_once, xdelta_encoder_setup);
+	old = (xdelta_encoder_t *) pthread_getspecific(xdelta_encoder_key);
+	if (pthread_setspecific(xdelta_encoder_key, enc)) {
+		xdelta_encoder_close(enc);
+		return;
+	}
+	if (old) {
+		xdelta_encoder_close(old);
+	}
+}
+
+
+/*
+ * Where an encode takes its target from: fills buf with up to len bytes
+ * following those it gave before, short only at the end.
+ * Returns how many, otherwise -errno
+ */
+typedef ssize_t (*xdelta_input_t)(void *arg, char *buf, size_t len);
+
+static ssize_t xdelta_file_input(void *arg, char *buf, size_t len)
+{
+	return fread(buf, 1, len, (FILE *) arg);
+}
+
+/*
+ * xdelta_encode of size bytes of target taken from input, a window at a
+ * time, against SrcFile as pending leaves it if pending isn't NULL.  The
+ * delta is written from where OutFile stands.
+ */
+static int xdelta_encode_input(const char* OutFileName, xdelta_input_t input, void *arg, off_t size, FILE* SrcFile,
+			       const xdelta_change_t *pending, FILE* OutFile)
+{
+	int BufSize;
+	struct stat statbuf;
+	xdelta_encoder_t *enc;
+	xd3_stream *stream;
+	xd3_config config;
+	xd3_source source;
+	xdelta_src_t src;
+	void* Input_Buf = NULL;
+	int Input_Buf_Read;
+	int r, ret;
+	windex_t idx;
+	uint64_t out_pos, win_start;
+
+	memset(&statbuf, 0, sizeof(statbuf));
+	if (SrcFile && fstat(fileno(SrcFile), &statbuf)) {
+		return -errno;
+	}
+	BufSize = xdelta_winsize(pending ? pending->size : statbuf.st_size);
+
+	memset (&source, 0, sizeof(source));
+	memset (&src, 0, sizeof(src));
+	windex_init(&idx);
+	idx.parent_ino = statbuf.st_ino;
+	idx.winsize = BufSize;
+	out_pos = 0;
+	win_start = 0;
+
+	xd3_init_config(&config, XD3_ADLER32);
+	config.winsize = BufSize;
+	config.getblk = xdelta_getblk;
+	config.alloc = xdelta_alloc;
+	config.freef = xdelta_free;
+	enc = xdelta_encoder_open(&config);
+	if (!enc) {
+		return -ENOMEM;
+	}
+	stream = &enc->stream;
+
+	if (SrcFile) {
+		r = xdelta_source_open(stream, &source, &src, fileno(SrcFile), dopt.buffer, pending);
 		if (r) {
-			return -errno;
+			goto out;
 		}
-		sql_update_size(OutFileName, instatbuf.st_size);
+	}
+	r = xdelta_encoder_start(enc);
+	if (r) {
+		goto out;
 	}
 
-	fseek(OutFile, 0, SEEK_SET);
-  
+	/* The target goes in by the I/O buffer, xdelta makes windows of it */
+	Input_Buf = arena_alloc(dopt.buffer);
+	if (!Input_Buf) {
+		r = -ENOMEM;
+		goto out;
+	}
+	sql_update_size(OutFileName, size);
+
 	do {
-		Input_Buf_Read = fread(Input_Buf, 1, BufSize, InFile);
-		if (Input_Buf_Read < BufSize) {
-			xd3_set_flags(&stream, XD3_FLUSH | stream.flags);
+		Input_Buf_Read = input(arg, Input_Buf, dopt.buffer);
+		if (Input_Buf_Read < 0) {
+			r = Input_Buf_Read;
+			goto out;
 		}
-		xd3_avail_input(&stream, Input_Buf, Input_Buf_Read);
+		if (Input_Buf_Read < dopt.buffer) {
+			xd3_set_flags(stream, XD3_FLUSH | stream->flags);
+		}
+		xd3_avail_input(stream, Input_Buf, Input_Buf_Read);
     
 	process:
-		ret = xd3_encode_input(&stream);
+		ret = xd3_encode_input(stream);
 
 
 		switch (ret) {
@@ -160,61 +642,75 @@ int xdelta_encode (const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* O
 
 		case XD3_OUTPUT:
 			DEBUG1(printf("DEBUG: XD3_OUTPUT\n"));
-			r = fwrite(stream.next_out, 1, stream.avail_out, OutFile);
-			DEBUG1(printf("Stream.avail_out  PARTY%u", (unsigned int) stream.avail_out));
+			r = fwrite(stream->next_out, 1, stream->avail_out, OutFile);
+			DEBUG1(printf("Stream.avail_out  PARTY%u", (unsigned int) stream->avail_out));
 			fflush(NULL);
-			if (r != (int)stream.avail_out) {
-				return -r;
+			if (r != (int)stream->avail_out) {
+				r = -EIO;
+				goto out;
 			}
-			xd3_consume_output(&stream);
+			out_pos += stream->avail_out;
+			xd3_consume_output(stream);
 			goto process;
       
-		case XD3_GETSRCBLK:
-			DEBUG1(printf("DEBUG: XD3_GETSRCBLK %qd\n", source.getblkno));
-			if (SrcFile) {
-				r = fseek(SrcFile, source.blksize * source.getblkno, SEEK_SET);
-				if (r) {
-					return -errno;
-				}
-				source.onblk = fread((void*)source.curblk, 1, source.blksize, SrcFile);
-				source.curblkno = source.getblkno;
-			}
-			goto process;
-    
 		case XD3_GOTHEADER:
 			DEBUG1(printf("DEBUG: XD3_GOTHEADER\n"));
 			goto process;
 
 		case XD3_WINSTART:
 			DEBUG1(printf("DEBUG: XD3_WINSTART\n"));
+			win_start = out_pos;
 			goto process;
     
 		case XD3_WINFINISH:
 			DEBUG1(printf("DEBUG: XD3_WINFINISH\n"));
+			r = xdelta_index_window(stream, &idx, win_start, out_pos);
+			if (r) {
+				goto out;
+			}
 			goto process;
     
 		default:
-			DEBUG1(printf("DEBUG: INVALID %s %d\n", stream.msg, ret));
-			return -ret;
+			DEBUG1(printf("DEBUG: INVALID %s %d\n", stream->msg, ret));
+			r = -EIO;
+			goto out;
 		}  
-	} while(Input_Buf_Read == BufSize);
-    
-	free(Input_Buf);
-	free((void*)source.curblk);
-	xd3_close_stream(&stream);
-	xd3_free_stream(&stream);
+	} while(Input_Buf_Read == dopt.buffer);
 
-	return 0;
+	/* The window index goes right after the VCDIFF data */
+	idx.delta_len = out_pos;
+	r = windex_write(&idx, OutFile);
+	fflush(OutFile);
+
+ out:
+	windex_free(&idx);
+	arena_free(Input_Buf);
+	xdelta_source_close(&src);
+	xdelta_encoder_park(enc);
+
+	return r;
 }
 
+int xdelta_encode (const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* OutFile)
+{
+	struct stat instatbuf;
 
-int xdelta_read(const char *file, const char *parent, size_t bytes, off_t offset, char *buffer)
+	fseek(InFile, 0, SEEK_SET);
+	fseek(OutFile, 0, SEEK_SET);
+	if (fstat(fileno(InFile), &instatbuf)) {
+		return -errno;
+	}
+	return xdelta_encode_input(OutFileName, xdelta_file_input, InFile, instatbuf.st_size, SrcFile, NULL, OutFile);
+}
+
+
+static int xdelta_read_scan(const char *file, const char *parent, size_t bytes, off_t offset, char *buffer)
 {
 	/*
-	 * xDelta Read Routine
-	 * -------------------
+	 * Read from a delta written before window indexes existed
+	 * -------------------------------------------------------
 	 *
-	 * Decode necessary window(s)
+	 * Walk every window, decoding only the ones overlapping the read
 	 * Write to buffer
 	 * Return bytes read for success, otherwise -errno
 	 */
@@ -222,10 +718,10 @@ int xdelta_read(const char *file, const char *parent, size_t bytes, off_t offset
 	FILE* InFile;
 	FILE* SrcFile;
   
-	struct stat statbuf;
 	xd3_stream stream;
 	xd3_source source;
 	xd3_config config;
+	xdelta_src_t src;
 
 	void* Input_Buf;
 	int Input_Buf_Read;
@@ -244,59 +740,31 @@ int xdelta_read(const char *file, const char *parent, size_t bytes, off_t offset
 		return -errno;
 	}
   
-	printf("xdelta_read\n");
-	fflush(NULL);
-
 	SrcFile = fopen(parent, "rb");
 	if (!SrcFile) {
 		return -errno;
 	}
 
-  
-	if (dopt.window_abs) {
-		BufSize = dopt.window_abs;
-	}
-	else {
-		r = fstat(fileno(SrcFile), &statbuf);
-		if (r) {
-			return -errno;
-		}
-		BufSize = (int) (statbuf.st_size * dopt.window_rel);
-	}
 
-	if(BufSize < XD3_ALLOCSIZE){
-		BufSize = XD3_ALLOCSIZE;
-	}
+	/* Decoding doesn't depend on the window size, read by the I/O buffer */
+	BufSize = dopt.buffer;
 
 	memset (&stream, 0, sizeof(stream));
 	memset (&source, 0, sizeof(source));
 
 	xd3_init_config(&config, XD3_ADLER32);
 	config.winsize = BufSize;
+	config.getblk = xdelta_getblk;
+	config.alloc = xdelta_alloc;
+	config.freef = xdelta_free;
 	xd3_config_stream(&stream, &config);
 
-
-	if (SrcFile) {
-		r = fstat(fileno(SrcFile), &statbuf);
-		if (r) {
-			return -errno;
-		}
-		source.size = statbuf.st_size;
-		source.blksize = BufSize;
-		source.curblk = malloc(source.blksize);
-    
-		/* Load 1st block of stream. */
-		r = fseek(SrcFile, 0, SEEK_SET);
-		if (r) {
-			return -errno;
-		}
-		source.onblk = fread((void*)source.curblk, 1, source.blksize, SrcFile);
-		source.curblkno = 0;
-		/* Set the stream. */
-		xd3_set_source(&stream, &source);
+	r = xdelta_source_open(&stream, &source, &src, fileno(SrcFile), BufSize, NULL);
+	if (r) {
+		return r;
 	}
 
-	Input_Buf = malloc(BufSize);
+	Input_Buf = arena_alloc(BufSize);
 	fseek(InFile, 0, SEEK_SET);
 	buffoff = 0;
 
@@ -345,19 +813,6 @@ int xdelta_read(const char *file, const char *parent, size_t bytes, off_t offset
       
 			xd3_consume_output(&stream);
 			goto process;
-		case XD3_GETSRCBLK:
-			DEBUG2(printf("DEBUG: XD3_GETSRCBLK %qd\n", source.getblkno));
-			if (SrcFile) {
-				r = fseek(SrcFile, source.blksize * source.getblkno, SEEK_SET);
-				if (r) {
-					return -errno;
-				}
-				source.onblk = fread((void*)source.curblk, 1, source.blksize, SrcFile);
-				source.curblkno = source.getblkno;
-	
-				DEBUG2(printf("Source.onblk %d Source.curblkno %d\n", (int) source.onblk, (int) source.curblkno));
-			}
-			goto process;
 		case XD3_GOTHEADER:
 			DEBUG2(printf("DEBUG: XD3_GOTHEADER\n"));
 		case XD3_WINSTART:
@@ -388,8 +843,8 @@ int xdelta_read(const char *file, const char *parent, size_t bytes, off_t offset
 		} 
 	} while(Input_Buf_Read == BufSize);
   
-	free(Input_Buf);
-	free((void*)source.curblk);
+	arena_free(Input_Buf);
+	xdelta_source_close(&src);
 	xd3_close_stream(&stream);
 	xd3_free_stream(&stream);
 
@@ -399,443 +854,1923 @@ int xdelta_read(const char *file, const char *parent, size_t bytes, off_t offset
 }
 
 
-int xdelta_link(const char *f1, const char *f2)
+/*
+ * Decoder state for random access into an indexed delta file.  Once it
+ * has taken the VCDIFF file header it decodes any window of any delta
+ * with the same header against the same parent, so a decoder whose
+ * reader closes is parked with its thread for the next reader there.
+ */
+typedef struct {
+	xd3_stream stream;
+	xd3_source source;
+	xdelta_src_t src;
+	int fd;              /* the delta file */
+	uint8_t *Input_Buf;
+	size_t Input_Buf_Size;
+	uint8_t hdr[XDELTA_HDR_MAX]; /* the file header it took */
+	uint64_t hdr_len;
+} xdelta_decoder_t;
+
+static pthread_key_t xdelta_parked_key;
+static pthread_once_t xdelta_parked_once = PTHREAD_ONCE_INIT;
+
+
+static void xdelta_decoder_close(xdelta_decoder_t *dec)
 {
-	/*
-	 * xDelta Link Routine
-	 * -------------------
-	 *
-	 * Create firm link of f1 at f2
-	 * 
-	 * Routine handles all file I/O
-	 * Return 0 for success, otherwise -errno
-	 */
-	FILE* InFile;
-	FILE* SrcFile;
-	FILE* OutFile;
-	int r;
+	arena_free(dec->Input_Buf);
+	xdelta_source_close(&dec->src);
+	xd3_close_stream(&dec->stream);
+	xd3_free_stream(&dec->stream);
+	free(dec);
+}
 
-	InFile = fopen(f1, "rb");
-	SrcFile = fopen(f1, "rb");
-	OutFile = fopen(f2, "wb");
+static void xdelta_parked_release(void *arg)
+{
+	xdelta_decoder_close((xdelta_decoder_t *) arg);
+}
 
-	r = xdelta_encode(f2, InFile, SrcFile, OutFile);
- 
-	fclose(InFile);
-	fclose(SrcFile);
-	fclose(OutFile);
-	return r;
+static void xdelta_parked_setup()
+{
+	pthread_key_create(&xdelta_parked_key, xdelta_parked_release);
 }
 
 
-int xdelta_write(const char *file, const char *buf, size_t size, off_t offset, int childc, char **childv, char *parent)
+/*
+ * Leave a decoder that is between windows with the calling thread, in
+ * place of the one it had
+ */
+static void xdelta_decoder_park(xdelta_decoder_t *dec)
 {
-	/*
-	 * xDelta Write Routine
-	 * --------------------
-	 *
-	 * Do a full decode saving to fd
-	 * Write appropriate changes to fd
-	 * Do an encode
-	 * Return bytes written for success, otherwise -errno
-	 */  
-  
-	int r;
-	char* buffer;
-	int res;
-	off_t off;
+	xdelta_decoder_t *old;
 
-	printf("File - %s\n", file);
-	printf("Parent - %s\n", parent);
-	fflush(NULL);
+	if (dec->hdr_len > XDELTA_HDR_MAX) {
+		xdelta_decoder_close(dec);
+		return;
+	}
+	/* Nothing of the files it read stays in use */
+	xdelta_source_close(&dec->src);
+	dec->source.curblk = NULL;
+	dec->src.fd = -1;
+	dec->fd = -1;
+
+	pthread_once(&xdelta_parked_once, xdelta_parked_setup);
+	old = (xdelta_decoder_t *) pthread_getspecific(xdelta_parked_key);
+	if (pthread_setspecific(xdelta_parked_key, dec)) {
+		xdelta_decoder_close(dec);
+		return;
+	}
+	if (old) {
+		xdelta_decoder_close(old);
+	}
+}
 
-	if (parent) {
-		/*
-		 * Write to a child
-		 *  Decode child
-		 *  Write changes
-		 *  Encode child
-		 */
-		sem_t *sem_child;
-		char* sem_child_name = semaphore_hash(file);
-		sem_child = sem_open(sem_child_name, O_CREAT, 0777, 1);
-		free(sem_child_name);
-		r = sem_wait(sem_child);
-    
-		FILE* OutFile;
-		FILE* SrcFile;
-		FILE* TmpFile;
-    
-		r = 0;
-		TmpFile = tmpfile();
-		if (!TmpFile) {
-			printf("ERROR Opening TmpFile %d", -errno);
-		}
-    
-		buffer = malloc(dopt.buffer);
-		fseek(TmpFile, 0, SEEK_SET);
-    
-		off = 0;
-		do {
-			r = xdelta_read(file, parent, dopt.buffer, off, buffer);
-			r = fwrite(buffer, 1, r, TmpFile);
-			off+= r;
-		} while (r == dopt.buffer);
-    
-		free(buffer);
-		fflush(NULL); /* Important to flush the current output buffers before writing changes. */
+/*
+ * Take the decoder parked with the calling thread if it was set up
+ * against the parent described by statbuf, with the same block size and
+ * file header
+ */
+static xdelta_decoder_t *xdelta_decoder_unpark(const struct stat *statbuf, int blksize,
+					       const uint8_t *hdr, uint64_t hdr_len)
+{
+	xdelta_decoder_t *dec;
+
+	pthread_once(&xdelta_parked_once, xdelta_parked_setup);
+	dec = (xdelta_decoder_t *) pthread_getspecific(xdelta_parked_key);
+	if (!dec || dec->src.key.dev != statbuf->st_dev || dec->src.key.ino != statbuf->st_ino ||
+	    dec->src.key.gen != xdelta_generation(statbuf) || dec->src.key.blksize != (uint32_t) blksize ||
+	    dec->hdr_len != hdr_len || memcmp(dec->hdr, hdr, hdr_len)) {
+		return NULL;
+	}
+	pthread_setspecific(xdelta_parked_key, NULL);
+	return dec;
+}
 
-		r = pwrite(fileno(TmpFile), buf, size, offset);
 
-		printf("PWrite returned: %d\n", r);
-		fflush(NULL); /* Important to flush output before encoding */
-    
-		OutFile = fopen(file, "wb");
-		SrcFile = fopen(parent, "rb");
+/*
+ * Set up a decoder against the parent open at srcfd and feed it the VCDIFF
+ * file header of the delta open at fd, or take the parked one if it
+ * already has
+ */
+static int xdelta_decoder_open(xdelta_decoder_t **decp, int fd, int srcfd, uint64_t hdr_len)
+{
+	struct stat statbuf;
+	xdelta_decoder_t *dec;
+	xd3_config config;
+	int r, ret;
 
-		fseek(TmpFile, 0, SEEK_SET);  /* Point to beginning of empty file */
-		fseek(SrcFile, 0, SEEK_SET);
-		res = xdelta_encode(file, TmpFile, SrcFile, OutFile);
-    
-		printf("xDelta Encode returned: %d\n", res);
-		printf("WROTE %s of size %d at offset %d\n", buf, size, (int) offset);
-		fflush(NULL);
-    
+	r = fstat(srcfd, &statbuf);
+	if (r) {
+		return -errno;
+	}
 
-		sem_post(sem_child);
-		fclose(OutFile);
-		fclose(TmpFile);
-		fclose(SrcFile);
+	dec = calloc(1, sizeof(xdelta_decoder_t));
+	if (!dec) {
+		return -ENOMEM;
+	}
+	dec->fd = fd;
+	dec->hdr_len = hdr_len;
+	if (hdr_len <= XDELTA_HDR_MAX) {
+		r = pread(fd, dec->hdr, hdr_len, 0);
+		if (r != (int) hdr_len) {
+			free(dec);
+			return -EIO;
+		}
+		*decp = xdelta_decoder_unpark(&statbuf, dopt.buffer, dec->hdr, hdr_len);
+		if (*decp) {
+			free(dec);
+			(*decp)->fd = fd;
+			(*decp)->src.fd = srcfd;
+			return 0;
+		}
 	}
-	else {
-		/*
-		 * Create an array of temp files for each child
-		 * Decode each child into a temp file
-		 * Write changes to parent
-		 * Encode each child
-		 */
-    
-		FILE* TmpFile[childc];
-		FILE* SrcFile;
-		FILE* OutFile;
-		sem_t *sem_child[childc];
-		sem_t *sem_parent;
-		char *sem_child_name;
-		char *sem_parent_name;
-		int i;
-    
-		sem_parent_name =  semaphore_hash(file);
-		sem_parent = sem_open(sem_parent_name, O_CREAT, 0777, 1);
-		free(sem_parent_name);
-		r = sem_wait(sem_parent);
-    
-		/*
-		 * Create an array of temp files for each child
-		 * Decode each child into a temp file
-		 */
-		for (i = 0; i < childc; ++i) {
-			printf("Create and decode\n");
-			fflush(NULL);
-      
-			sem_child_name = semaphore_hash(childv[i]);
-			sem_child[i] = sem_open(sem_child_name, O_CREAT, 0777, 1);
-			free(sem_child_name);
-			r = sem_wait(sem_child[i]);
 
-			TmpFile[i] = tmpfile();
+	/* Decoding doesn't depend on the window size, only I/O does */
+	xd3_init_config(&config, XD3_ADLER32);
+	config.winsize = dopt.buffer;
+	config.getblk = xdelta_getblk;
+	config.alloc = xdelta_alloc;
+	config.freef = xdelta_free;
+	xd3_config_stream(&dec->stream, &config);
+
+	r = xdelta_source_open(&dec->stream, &dec->source, &dec->src, srcfd, dopt.buffer, NULL);
+	if (r) {
+		goto err;
+	}
 
-			buffer = malloc(dopt.buffer);
-			fseek(TmpFile[i], 0, SEEK_SET);
-    
-			off = 0;
-			do {
-				r = xdelta_read(childv[i], file, dopt.buffer, off, buffer);
-				fwrite(buffer, 1, r, TmpFile[i]);
-				off+= r;
-			} while (r == dopt.buffer);
-			free(buffer);
-		}
-		/*
-		 * Write changes to parent
-		 */
-		printf("Write Changes\n");
-		fflush(NULL);  /* Important to flush output before writing changes */
+	dec->Input_Buf_Size = hdr_len > (uint64_t) dopt.buffer ? hdr_len : (uint64_t) dopt.buffer;
+	dec->Input_Buf = arena_alloc(dec->Input_Buf_Size);
+	if (!dec->Input_Buf) {
+		r = -ENOMEM;
+		goto err;
+	}
 
-		SrcFile = fopen(file, "r+b");
-		r = pwrite(fileno(SrcFile), buf, size, offset);
-		fflush(NULL); /* Important to write changes before closing */
-		fclose(SrcFile);
-		SrcFile = fopen(file, "rb");
-		
-		/*
-		 * Encode each child
-		 */
-		for (i = 0; i < childc; ++i) {
-			printf("Encode\n");
-			fflush(NULL); /* Important to flush output before encoding */
-			truncate(childv[i], 0);
-			OutFile = fopen(childv[i], "w+b");
-
-			fseek(TmpFile[i], 0, SEEK_SET);  /* Point to beginning of empty file */
-			fseek(SrcFile, 0, SEEK_SET);
-      
-			res = xdelta_encode(childv[i], TmpFile[i], SrcFile, OutFile);
-      
-			printf("xDelta Encode returned: %d\n", res);
-			printf("WROTE %s of size %d at offset %d\n", buf, size, (int) offset);
-			fflush(NULL);
-      
-			sem_post(sem_child[i]);
-			fclose(OutFile);
-			fclose(TmpFile[i]);
-		}
-		fclose(SrcFile);
-		sem_post(sem_parent);
-	}  
+	r = pread(fd, dec->Input_Buf, hdr_len, 0);
+	if (r != (int) hdr_len) {
+		r = -EIO;
+		goto err;
+	}
+	xd3_avail_input(&dec->stream, dec->Input_Buf, hdr_len);
+	ret = xd3_decode_input(&dec->stream);
+	if (ret != XD3_INPUT) {
+		DEBUG2(printf("DEBUG: INVALID header %s %d\n", dec->stream.msg, ret));
+		r = -EIO;
+		goto err;
+	}
+	*decp = dec;
+	return 0;
+
+ err:
+	xdelta_decoder_close(dec);
 	return r;
 }
 
-int xdelta_promote(const char *file, int childc, char **childv)
-{
-	/*
-	 * First child is promoted to parent
-	 *  Decode first child
-	 *  Write back to child file
-	 * Other children are made children of new parent
-	 *  Decode other children
-	 *  Encode with new parent
-	 */
 
-  
-	FILE* TmpFile;
-	FILE* OutFile;
-	FILE* SrcFile;
- 
-	char* buffer;
-	int r, i;
-	off_t off, off_count;
+/*
+ * Decode a single window into out, which holds e->tgt_len bytes
+ */
+static int xdelta_decoder_window(xdelta_decoder_t *dec, const windex_entry_t *e, char *out)
+{
+	xd3_stream *stream = &dec->stream;
+	unsigned int outoff;
+	uint8_t *buf;
+	size_t size;
+	int r, ret;
 
-	sem_t *sem_child[childc];
-	char *sem_child_name;
-  
-	for (i = 0; i < childc; ++i) {
-		sem_child_name = semaphore_hash(childv[i]);
-		sem_child[i] = sem_open(sem_child_name, O_CREAT, 0777, 1);
-		r = sem_wait(sem_child[i]);
-		free(sem_child_name);
+	if (e->delta_len > dec->Input_Buf_Size) {
+		/* In whole I/O buffers, so the sizes asked of the arena repeat */
+		size = (e->delta_len + dopt.buffer - 1) / dopt.buffer * dopt.buffer;
+		buf = arena_alloc(size);
+		if (!buf) {
+			return -ENOMEM;
+		}
+		arena_free(dec->Input_Buf);
+		dec->Input_Buf = buf;
+		dec->Input_Buf_Size = size;
 	}
-  
-	/* Decode first Child */
-	TmpFile = tmpfile();
-	if (!TmpFile) {
-		printf("Error opening TmpFile %d", -errno);
-		return -errno;
+	r = pread(dec->fd, dec->Input_Buf, e->delta_len, e->delta_off);
+	if (r != (int) e->delta_len) {
+		return -EIO;
 	}
-  
-	buffer = malloc(dopt.buffer);
-	fseek(TmpFile, 0, SEEK_SET);
-
-	off = 0;
-	do {
-		r = xdelta_read(childv[0], file, dopt.buffer, off, buffer);
-		fwrite(buffer, 1, r, TmpFile);
-		off+= r;
-	} while (r == dopt.buffer);
-
-	/* Write back to child file */
-	off_count = 0;
-	truncate(childv[0], 0);
-	SrcFile = fopen(childv[0], "w+b");  
-	do {
-		r = pread(fileno(TmpFile), buffer, dopt.buffer, off_count);
-		r = pwrite(fileno(SrcFile), buffer, r, off_count);
-		off_count += r;
-	} while (off_count < off);
-	free(buffer);
-	fclose(SrcFile);
-	fclose(TmpFile);
-  
-	for (i = 1; i < childc; ++i) {
-		/* Decode other children */
-		TmpFile = tmpfile();
-		if (!TmpFile) {
-			printf("Error opening TmpFile %d", -errno);
-			return -errno;
+	xd3_avail_input(stream, dec->Input_Buf, e->delta_len);
+	outoff = 0;
+
+ process:
+	ret = xd3_decode_input(stream);
+
+	switch (ret) {
+	case XD3_INPUT:
+		/* Window fully decoded, the decoder waits for the next one */
+		return outoff == e->tgt_len ? 0 : -EIO;
+	case XD3_OUTPUT:
+		DEBUG2(printf("DEBUG: XD3_OUTPUT\n"));
+		if (outoff + stream->avail_out > e->tgt_len) {
+			return -EIO;
 		}
-    
-		buffer = malloc(dopt.buffer);
-		fseek(TmpFile, 0, SEEK_SET);
-    
-		off = 0;
-		do {
-			r = xdelta_read(childv[i], file, dopt.buffer, off, buffer);
-			fwrite(buffer, 1, r, TmpFile);
-			off+= r;
-		} while (r == dopt.buffer);
-		free(buffer);
-
-		/* Encode with new parent */
-		truncate(childv[i], 0);
-		OutFile = fopen(childv[i], "w+b");
-		SrcFile = fopen(childv[0], "rb");
-    
-		fseek(TmpFile, 0, SEEK_SET);  /* Point to beginning of empty file */
-		fseek(SrcFile, 0, SEEK_SET);
- 
-		r = xdelta_encode(childv[i], TmpFile, SrcFile, OutFile);
-    
-		sem_post(sem_child[i]);
-		fclose(OutFile);
-		fclose(SrcFile);
-		fclose(TmpFile);
+		memcpy(out + outoff, stream->next_out, stream->avail_out);
+		outoff += stream->avail_out;
+		xd3_consume_output(stream);
+		goto process;
+	case XD3_GOTHEADER:
+	case XD3_WINSTART:
+	case XD3_WINFINISH:
+		goto process;
+	default:
+		DEBUG2(printf("DEBUG: INVALID %s %d\n", stream->msg, ret));
+		return -EIO;
 	}
-	return 0;
 }
 
 
-int xdelta_truncate(const char *file, off_t size, char *parent, int childc, char **childv)
+/*
+ * Decoder state kept across reads of one child, normally for as long as
+ * the file is open
+ */
+struct xdelta_reader {
+	char *file;
+	char *parent;
+	int fd;              /* the delta file */
+	int srcfd;           /* the parent */
+	dev_t dev;           /* of the delta, whose lock reads take */
+	ino_t ino;
+	dev_t pdev;          /* of the parent, whose lock reads take first */
+	ino_t pino;
+	windex_t idx;
+	int indexed;         /* idx is valid, otherwise reads fall back to a scan */
+	wcache_key_t key;    /* dev/ino/gen of the delta when idx was loaded */
+	xdelta_decoder_t *dec; /* NULL until the first window is decoded */
+	int last;            /* window held in buf, -1 if none */
+	char *buf;
+	size_t buf_size;
+	off_t next_off;      /* where a sequential read would continue */
+	int seq;             /* consecutive sequential reads */
+	int ra_next;         /* first window not yet queued for read-ahead */
+};
+
+
+xdelta_reader_t *xdelta_reader_open(const char *file, const char *parent)
 {
-	/*
-	 * xDelta Truncate Routine
-	 * -----------------------
-	 *
-	 * If it's a child
-	 *  Do a full decode
-	 *  Truncate
-	 *  Do an encode
-	 *  Return 0 on success, -1 on error setting errno
-	 *
-	 * If it's a parent
-	 *  Decode all children
-	 *  Truncate Parent
-	 *  Encode all children
-	 *  Return 0 on success, -1 on error setting errno
-	 */
+	struct stat statbuf;
+	xdelta_reader_t *rd;
+	int err;
 
-	char* buffer;
-	off_t off;
-	int res, r;
+	rd = calloc(1, sizeof(xdelta_reader_t));
+	if (!rd) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	rd->fd = -1;
+	rd->srcfd = -1;
+	rd->last = -1;
+
+	rd->file = strdup(file);
+	rd->parent = strdup(parent);
+	if (!rd->file || !rd->parent) {
+		err = ENOMEM;
+		goto err;
+	}
 
+	rd->fd = open(file, O_RDONLY);
+	if (rd->fd == -1 || fstat(rd->fd, &statbuf)) {
+		err = errno;
+		goto err;
+	}
+	rd->dev = statbuf.st_dev;
+	rd->ino = statbuf.st_ino;
+	rd->srcfd = open(parent, O_RDONLY);
+	if (rd->srcfd == -1 || fstat(rd->srcfd, &statbuf)) {
+		err = errno;
+		goto err;
+	}
+	rd->pdev = statbuf.st_dev;
+	rd->pino = statbuf.st_ino;
+	return rd;
+
+ err:
+	xdelta_reader_close(rd);
+	errno = err;
+	return NULL;
+}
 
-	if (parent) {
-		/* If it's a child */
 
-		/* Do a full decode */
-		FILE* TmpFile;
-		FILE* OutFile;
-		FILE* SrcFile;
-		sem_t *sem_child;
-		char *sem_child_name;
-    
-		sem_child_name = semaphore_hash(file);
-		sem_child = sem_open(sem_child_name, O_CREAT, 0777, 1);
-		free(sem_child_name);
-		r = sem_wait(sem_child);
-
-		TmpFile = tmpfile();
-		if (!TmpFile) {
-			printf("Error opening TmpFile %d", -errno);
-			return -errno;
-		}
-    
-		buffer = malloc(dopt.buffer);
-		fseek(TmpFile, 0, SEEK_SET);
-    
-		off = 0;
-		do {
-			r = xdelta_read(file, parent, dopt.buffer, off, buffer);
-			fwrite(buffer, 1, r, TmpFile);
-			off+= r;
-		} while (r == dopt.buffer);
-    
-		free(buffer);
+/*
+ * Follow the child to another parent, which happens when its parent was
+ * frozen into a base.  Only checked when the delta of an open reader
+ * changed, as freezing bumps the generation of every child.
+ */
+static int xdelta_reader_reparent(xdelta_reader_t *rd)
+{
+	struct stat statbuf;
+	char *parent = NULL;
+	int srcfd;
 
-		/* Truncate */
-		res = ftruncate(fileno(TmpFile), size);
+	sql_get_parent(rd->file, &parent);
+	if (!parent || !strcmp(parent, rd->parent)) {
+		free(parent);
+		return 0;
+	}
 
-		if (res) {
-			return -errno;
+	srcfd = open(parent, O_RDONLY);
+	if (srcfd == -1 || fstat(srcfd, &statbuf)) {
+		if (srcfd != -1) {
+			close(srcfd);
 		}
-    
-		/* Do an encode */
-		truncate(file, 0);
-		OutFile = fopen(file, "w+b");
-		SrcFile = fopen(parent, "rb");
-    
-		fseek(TmpFile, 0, SEEK_SET);  /* Point to beginning of empty file */
-		fseek(SrcFile, 0, SEEK_SET);
-    
-		res = xdelta_encode(file, TmpFile, SrcFile, OutFile);
-    
-		sem_post(sem_child);
+		free(parent);
+		return -errno;
+	}
+	close(rd->srcfd);
+	rd->srcfd = srcfd;
+	rd->pdev = statbuf.st_dev;
+	rd->pino = statbuf.st_ino;
+	free(rd->parent);
+	rd->parent = parent;
+	return 0;
+}
 
-		fclose(SrcFile);
-		fclose(OutFile);
-		fclose(TmpFile);
-	} else {
-		int i;
-		FILE* TmpFile[childc];
-		FILE* SrcFile;
-		FILE* OutFile;
-		sem_t *sem_child[childc];
-		sem_t *sem_parent;
-		char *sem_parent_name;
-		char *sem_child_name;
-    
-		sem_parent_name = semaphore_hash(file);
-		sem_parent = sem_open(file, O_CREAT, 0777, 1);
-		free(sem_parent_name);
-		r = sem_wait(sem_parent);
-
-		for (i = 0; i < childc; ++i) {
-			/* Decode children */
-			sem_child_name = semaphore_hash(childv[i]);
-			sem_child[i] = sem_open(sem_child_name, O_CREAT, 0777, 1);
-			free(sem_child_name);
-			r = sem_wait(sem_child[i]);
-
-			TmpFile[i] = tmpfile();
-			if (!TmpFile[i]) {
-				printf("Error opening TmpFile %d", -errno);
-				return -errno;
-			}
-      
-			buffer = malloc(dopt.buffer);
-			fseek(TmpFile[i], 0, SEEK_SET);
-      
-			off = 0;
-			do {
-				r = xdelta_read(childv[i], file, dopt.buffer, off, buffer);
-				fwrite(buffer, 1, r, TmpFile[i]);
-				off+= r;
-			} while (r == dopt.buffer);
-			free(buffer);
+/*
+ * Reload the index and drop the decoder if the delta changed since the
+ * last read.  Writes to the child or its parent rewrite the delta in place,
+ * so comparing generations catches both.
+ */
+static int xdelta_reader_sync(xdelta_reader_t *rd)
+{
+	struct stat statbuf;
+	uint64_t gen;
+	int r;
+
+	if (fstat(rd->fd, &statbuf)) {
+		return -errno;
+	}
+	gen = xdelta_generation(&statbuf);
+	if (rd->indexed && rd->key.gen == gen && rd->key.ino == statbuf.st_ino) {
+		return 0;
+	}
+
+	if (rd->dec) {
+		xdelta_decoder_park(rd->dec);
+		rd->dec = NULL;
+	}
+	rd->last = -1;
+	rd->ra_next = 0;
+	windex_free(&rd->idx);
+	rd->indexed = 0;
+
+	if (rd->key.ino) {
+		/* Not the first load, the parent may have moved */
+		r = xdelta_reader_reparent(rd);
+		if (r) {
+			return r;
+		}
+	}
+	r = windex_load(&rd->idx, rd->fd);
+	if (r) {
+		return r;
+	}
+	if (rd->idx.parent_ino && rd->idx.parent_ino != rd->pino) {
+		/* Opened against a parent the child has left since */
+		r = xdelta_reader_reparent(rd);
+		if (r || rd->idx.parent_ino != rd->pino) {
+			/* The table and the delta must agree on what it decodes against */
+			windex_free(&rd->idx);
+			return r ? r : -ESTALE;
 		}
+	}
+	rd->indexed = 1;
+	rd->key.dev = statbuf.st_dev;
+	rd->key.ino = statbuf.st_ino;
+	rd->key.gen = gen;
+	return 0;
+}
 
-		/* Truncate */
-		res = truncate(file, size);
-		if (res) {
-			return -errno;
+
+/*
+ * Decode window i into rd->buf, reusing the decoder left after the
+ * previous window, or the one an earlier reader parked
+ */
+static int xdelta_reader_decode(xdelta_reader_t *rd, int i)
+{
+	windex_entry_t *e = &rd->idx.entries[i];
+	char *window;
+	size_t size;
+	int r;
+
+	if (!rd->dec) {
+		r = xdelta_decoder_open(&rd->dec, rd->fd, rd->srcfd, rd->idx.hdr_len);
+		if (r) {
+			rd->dec = NULL;
+			return r;
 		}
-		
-		/* Encode children */
-		for (i = 0; i < childc; ++i) {
-			truncate(childv[i], 0);
-      
-			OutFile = fopen(childv[i], "w+b");
-			SrcFile = fopen(parent, "rb");
-      
-			fseek(TmpFile[i], 0, SEEK_SET);  /* Point to beginning of empty file */
-			fseek(SrcFile, 0, SEEK_SET);
-      
-			res = xdelta_encode(childv[i], TmpFile[i], SrcFile, OutFile);
-      
-			sem_post(sem_child[i]);
-			fclose(SrcFile);
-			fclose(OutFile);
-			fclose(TmpFile[i]);
+	}
+
+	if (!rd->buf || e->tgt_len > rd->buf_size) {
+		/* Sized for any window, so every reader asks the arena for the same */
+		size = e->tgt_len > rd->idx.winsize ? e->tgt_len : rd->idx.winsize;
+		window = arena_alloc(size);
+		if (!window) {
+			return -ENOMEM;
 		}
+		arena_free(rd->buf);
+		rd->buf = window;
+		rd->buf_size = size;
+	}
 
+	rd->last = -1;
+	r = xdelta_decoder_window(rd->dec, e, rd->buf);
+	if (r) {
+		/* The decoder is left mid window, start over next time */
+		xdelta_decoder_close(rd->dec);
+		rd->dec = NULL;
+		return r;
+	}
+	rd->last = i;
+	return 0;
+}
+
+/*
+ * Share the window just decoded with other readers of the same delta,
+ * handing rd->buf to the cache rather than copying it.  The next window
+ * is decoded into a buffer from the arena, which the cache gives its
+ * evicted windows back to.
+ */
+static void xdelta_reader_share(xdelta_reader_t *rd)
+{
+	rd->key.window = rd->last;
+	if (wcache_put(&rd->key, rd->buf, rd->idx.entries[rd->last].tgt_len)) {
+		rd->buf = NULL;
+		rd->buf_size = 0;
+		rd->last = -1;
+	}
+}
+
+
+/*
+ * Read len bytes at loff into the copy window e, straight from the parent
+ * Returns 0 on success, otherwise -errno
+ */
+static int xdelta_reader_copy(xdelta_reader_t *rd, const windex_entry_t *e, uint64_t loff, size_t len, char *out)
+{
+	ssize_t r;
+
+	while (len) {
+		r = pread(rd->srcfd, out, len, e->src_off + loff);
+		if (r <= 0) {
+			/* The parent is never shorter than what its children copy */
+			return r ? -errno : -EIO;
+		}
+		out += r;
+		loff += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+/*
+ * Queue the windows after w for read-ahead, in batches of about half the
+ * depth so the worker isn't handed one window at a time
+ */
+static void xdelta_reader_ahead(xdelta_reader_t *rd, int w)
+{
+	int depth = readahead_depth();
+	int end;
+
+	if (!depth) {
+		return;
+	}
+	if (rd->ra_next <= w) {
+		rd->ra_next = w + 1;
+	}
+	end = w + depth;
+	if (end >= (int) rd->idx.count) {
+		end = rd->idx.count - 1;
+	}
+	if (rd->ra_next > end || rd->ra_next > w + (depth + 1) / 2) {
+		return;
+	}
+	readahead_queue(rd->file, rd->parent, rd->key.gen, rd->ra_next, end + 1 - rd->ra_next);
+	rd->ra_next = end + 1;
+}
+
+
+/*
+ * xdelta_reader_read, with the lock of the delta already held by the caller
+ */
+static int xdelta_reader_read_locked(xdelta_reader_t *rd, size_t bytes, off_t offset, char *buffer)
+{
+	windex_entry_t *e;
+	uint64_t end, loff, roff;
+	int i, r, res;
+	int w = -1;
+	int ahead;
+
+	DEBUG1(printf("xdelta_reader_read\n"));
+
+	r = xdelta_reader_sync(rd);
+	if (r == -ENOENT) {
+		return xdelta_read_scan(rd->file, rd->parent, bytes, offset, buffer);
+	}
+	if (r) {
+		return r;
+	}
+
+	if (offset == rd->next_off) {
+		rd->seq++;
+	} else {
+		rd->seq = 0;
+	}
+	ahead = rd->seq && readahead_depth();
+
+	end = offset + bytes;
+	res = 0;
+
+	for (i = windex_find(&rd->idx, offset); i >= 0 && i < (int) rd->idx.count; ++i) {
+		e = &rd->idx.entries[i];
+		if (e->tgt_off >= end) {
+			break;
+		}
+		loff = e->tgt_off < (uint64_t) offset ? offset - e->tgt_off : 0;
+		roff = e->tgt_off + e->tgt_len > end ? end - e->tgt_off : e->tgt_len;
+
+		if (e->flags & WINDEX_COPY) {
+			r = xdelta_reader_copy(rd, e, loff, roff - loff, buffer + (e->tgt_off + loff - offset));
+			if (r) {
+				return res ? res : r;
+			}
+		} else if (i != rd->last) {
+			rd->key.window = i;
+			r = wcache_get(&rd->key, loff, roff - loff, buffer + (e->tgt_off + loff - offset));
+			if (ahead) {
+				readahead_account(r >= 0);
+			}
+			if (r < 0) {
+				r = xdelta_reader_decode(rd, i);
+				if (r) {
+					return res ? res : r;
+				}
+				memcpy(buffer + (e->tgt_off + loff - offset), rd->buf + loff, roff - loff);
+				xdelta_reader_share(rd);
+			}
+		} else {
+			memcpy(buffer + (e->tgt_off + loff - offset), rd->buf + loff, roff - loff);
+		}
+		res = e->tgt_off + roff - offset;
+		w = i;
+	}
+
+	rd->next_off = offset + res;
+	if (ahead && w >= 0) {
+		xdelta_reader_ahead(rd, w);
+	}
+	return res;
+}
+
+/*
+ * Take the lock of the parent of rd shared, then that of the delta.  A
+ * parent about to change holds its own while its children are re-encoded
+ * against the change, which they must not be decoded against before.
+ * Returns 0 on success, otherwise -errno with neither taken
+ */
+static int xdelta_reader_lock(xdelta_reader_t *rd, ilock_t **plock, ilock_t **lock)
+{
+	int r;
+
+	*plock = ilock_acquire(rd->pdev, rd->pino, 0);
+	if (!*plock) {
+		return -errno;
+	}
+	*lock = ilock_acquire(rd->dev, rd->ino, 0);
+	if (!*lock) {
+		r = -errno;
+		ilock_release(*plock);
+		return r;
+	}
+	return 0;
+}
+
+int xdelta_reader_read(xdelta_reader_t *rd, size_t bytes, off_t offset, char *buffer)
+{
+	ilock_t *plock, *lock;
+	ino_t pino;
+	int res;
+
+	for (;;) {
+		res = xdelta_reader_lock(rd, &plock, &lock);
+		if (res) {
+			return res;
+		}
+		/* The child may have moved to another parent, whose lock it needs */
+		pino = rd->pino;
+		xdelta_reader_sync(rd);
+		if (rd->pino == pino) {
+			break;
+		}
+		ilock_release(lock);
+		ilock_release(plock);
+	}
+	res = xdelta_reader_read_locked(rd, bytes, offset, buffer);
+	ilock_release(lock);
+	ilock_release(plock);
+	return res;
+}
+
+
+/*
+ * Decode windows first..first+count-1 of file into the window cache,
+ * skipping those already there.  Runs on the read-ahead thread, with its
+ * own reader.
+ * Returns the number of windows decoded, otherwise -errno
+ */
+int xdelta_prefetch(const char *file, const char *parent, uint64_t gen, int first, int count)
+{
+	xdelta_reader_t *rd;
+	ilock_t *plock, *lock;
+	int i, r, n;
+
+	rd = xdelta_reader_open(file, parent);
+	if (!rd) {
+		return -errno;
+	}
+	r = xdelta_reader_lock(rd, &plock, &lock);
+	if (r) {
+		xdelta_reader_close(rd);
+		return r;
+	}
+	r = xdelta_reader_sync(rd);
+	if (r || rd->key.gen != gen) {
+		/* Rewritten since the reader queued us */
+		ilock_release(lock);
+		ilock_release(plock);
+		xdelta_reader_close(rd);
+		return r;
+	}
+
+	n = 0;
+	for (i = first; i < first + count && i < (int) rd->idx.count; ++i) {
+		rd->key.window = i;
+		if ((rd->idx.entries[i].flags & WINDEX_COPY) || wcache_contains(&rd->key)) {
+			continue;
+		}
+		r = xdelta_reader_decode(rd, i);
+		if (r) {
+			break;
+		}
+		xdelta_reader_share(rd);
+		n++;
+	}
+
+	ilock_release(lock);
+	ilock_release(plock);
+	xdelta_reader_close(rd);
+	return n ? n : r;
+}
+
+
+void xdelta_reader_close(xdelta_reader_t *rd)
+{
+	if (!rd) {
+		return;
+	}
+	if (rd->dec) {
+		xdelta_decoder_park(rd->dec);
+	}
+	windex_free(&rd->idx);
+	if (rd->fd != -1) {
+		close(rd->fd);
+	}
+	if (rd->srcfd != -1) {
+		close(rd->srcfd);
+	}
+	arena_free(rd->buf);
+	free(rd->file);
+	free(rd->parent);
+	free(rd);
+}
+
+
+int xdelta_read(const char *file, const char *parent, size_t bytes, off_t offset, char *buffer)
+{
+	/*
+	 * xDelta Read Routine
+	 * -------------------
+	 *
+	 * One-shot read through a temporary reader
+	 * Return bytes read for success, otherwise -errno
+	 */
+
+	xdelta_reader_t *rd;
+	int res;
+
+	rd = xdelta_reader_open(file, parent);
+	if (!rd) {
+		return -errno;
+	}
+	res = xdelta_reader_read(rd, bytes, offset, buffer);
+	xdelta_reader_close(rd);
+	return res;
+}
+
+
+/*
+ * Copy the file open at srcfd into the empty file open at fd, sharing its
+ * extents where the filesystem supports it
+ * Returns 0 on success, otherwise an errno
+ */
+static int xdelta_copy(int fd, int srcfd)
+{
+	char *buffer;
+	int err;
+	ssize_t r;
+	off_t off;
+
+#ifdef FICLONE
+	if (ioctl(fd, FICLONE, srcfd) == 0) {
+		return 0;
+	}
+#endif
+	/* No reflinks here, copy the bytes */
+	buffer = arena_alloc(dopt.buffer);
+	if (!buffer) {
+		return ENOMEM;
+	}
+	off = 0;
+	while ((r = pread(srcfd, buffer, dopt.buffer, off)) > 0) {
+		if (write(fd, buffer, r) != r) {
+			break;
+		}
+		off += r;
+	}
+	err = r ? (errno ? errno : EIO) : 0;
+	arena_free(buffer);
+	return err;
+}
+
+/*
+ * The target of a re-encode as the encoder takes it in: the old content
+ * decoded a window at a time with a change made to it
+ */
+typedef struct {
+	xdelta_reader_t *rd;
+	off_t pos;           /* next byte to hand out */
+	off_t old;           /* size of the old content */
+	const xdelta_change_t *change;
+} xdelta_pipe_t;
+
+static ssize_t xdelta_pipe_input(void *arg, char *buf, size_t len)
+{
+	xdelta_pipe_t *p = (xdelta_pipe_t *) arg;
+	int r = 0;
+
+	if ((off_t) len > p->change->size - p->pos) {
+		len = p->change->size - p->pos;
+	}
+	if (p->pos < p->old) {
+		r = xdelta_reader_read_locked(p->rd, p->old - p->pos < (off_t) len ? p->old - p->pos : len,
+					      p->pos, buf);
+		if (r < 0) {
+			return r;
+		}
+	}
+	memset(buf + r, 0, len - r);
+	xdelta_change_apply(p->change, buf, p->pos, len);
+	p->pos += len;
+	return len;
+}
+
+/*
+ * Re-encode the child at file, decoding against parent, as its content
+ * with change made to it, against newparent as pending leaves it (if
+ * pending isn't NULL).  The delta is decoded as the encoder asks for
+ * input, so only a window of the content is held at a time and none of
+ * it goes to disk.  The new delta goes to a splice, which replaces the
+ * old one once it is complete.  The caller holds the lock of file.
+ * Returns 0 on success, otherwise -errno
+ */
+static int xdelta_reencode(const char *file, const char *parent, const char *newparent,
+			   const xdelta_change_t *change, const xdelta_change_t *pending)
+{
+	xdelta_pipe_t p;
+	FILE* SrcFile;
+	splice_t *s;
+	int r;
+
+	memset(&p, 0, sizeof(xdelta_pipe_t));
+	p.old = sql_get_size(file);
+	p.change = change;
+
+	p.rd = xdelta_reader_open(file, parent);
+	if (!p.rd) {
+		return -errno;
+	}
+	SrcFile = fopen(newparent, "rb");
+	if (!SrcFile) {
+		r = -errno;
+		xdelta_reader_close(p.rd);
+		return r;
+	}
+	s = splice_begin(file, 0);
+	if (!s) {
+		r = -errno;
+	} else {
+		r = xdelta_encode_input(file, xdelta_pipe_input, &p, change->size, SrcFile, pending, splice_file(s));
+		if (r) {
+			splice_abort(s);
+		} else {
+			r = splice_commit(s, -1);
+		}
+		xdelta_invalidate(file);
+	}
+
+	fclose(SrcFile);
+	xdelta_reader_close(p.rd);
+	return r;
+}
+
+
+int xdelta_link(const char *f1, const char *f2)
+{
+	/*
+	 * xDelta Link Routine
+	 * -------------------
+	 *
+	 * Create firm link of f1 at f2, as a clone: an index of windows that
+	 * copy f1 as is and no VCDIFF data, so f1 isn't read at all.  Writes
+	 * to f2 encode the windows they touch.
+	 * 
+	 * Routine handles all file I/O
+	 * Return 0 for success, otherwise -errno
+	 */
+	struct stat statbuf;
+	FILE* OutFile;
+	windex_t idx;
+	uint64_t off, len;
+	int BufSize;
+	int r;
+
+	if (stat(f1, &statbuf)) {
+		return -errno;
+	}
+	BufSize = xdelta_winsize(statbuf.st_size);
+
+	windex_init(&idx);
+	idx.parent_ino = statbuf.st_ino;
+	idx.winsize = BufSize;
+	r = 0;
+	for (off = 0; off < (uint64_t) statbuf.st_size && !r; off += len) {
+		len = statbuf.st_size - off < (uint64_t) BufSize ? statbuf.st_size - off : (uint64_t) BufSize;
+		r = windex_add_copy(&idx, off, len, 0, off);
+	}
+
+	OutFile = fopen(f2, "wb");
+	if (!OutFile) {
+		r = -errno;
+	}
+	if (!r) {
+		r = windex_write(&idx, OutFile);
+	}
+	if (OutFile && fclose(OutFile) && !r) {
+		r = -errno;
+	}
+	windex_free(&idx);
+	if (!r) {
+		sql_update_size(f2, statbuf.st_size);
+	}
+	xdelta_invalidate(f2);
+	return r;
+}
+
+
+/*
+ * Encode len bytes of target data, which start at tgt_off in the child,
+ * against the parent open at srcfd, or against nothing if srcfd is -1.
+ * The windows go to a malloc'ed buffer, behind the VCDIFF file header
+ * only if header is set, and are added to seg with delta offsets relative
+ * to the buffer as if it held the header.
+ * Returns 0 on success, otherwise -errno
+ */
+static int xdelta_encode_segment(const char *data, size_t len, uint64_t tgt_off, int srcfd,
+				 int BufSize, int header, windex_t *seg, uint8_t **out, size_t *outlen)
+{
+	xdelta_encoder_t *enc;
+	xd3_stream *stream;
+	xd3_config config;
+	xd3_source source;
+	xdelta_src_t src;
+	uint8_t *buf = NULL;
+	size_t alloc = 0;
+	uint64_t out_pos = 0, win_start = 0;
+	size_t pos = 0, chunk;
+	int r, ret;
+
+	memset(&src, 0, sizeof(src));
+	windex_init(seg);
+
+	xd3_init_config(&config, XD3_ADLER32);
+	config.winsize = BufSize;
+	config.getblk = xdelta_getblk;
+	config.alloc = xdelta_alloc;
+	config.freef = xdelta_free;
+	/*
+	 * Only index the parent around the segment, the default sizes the
+	 * checksum table for 64MB of parent on every write
+	 */
+	config.srcwin_maxsz = 4 * BufSize;
+	enc = xdelta_encoder_open(&config);
+	if (!enc) {
+		return -ENOMEM;
+	}
+	stream = &enc->stream;
+
+	if (srcfd != -1) {
+		r = xdelta_source_open(stream, &source, &src, srcfd, dopt.buffer, NULL);
+		if (r) {
+			goto out;
+		}
+	}
+	r = xdelta_encoder_start(enc);
+	if (r) {
+		goto out;
+	}
+
+	/*
+	 * Start where a full encode would be at this point of the child,
+	 * searching the parent from there instead of from its beginning.
+	 * xdelta3 has no call for this, so set the fields a full encode
+	 * would have advanced: they are zero in a fresh stream and first
+	 * read by the xd3_encode_input below.  total_in is otherwise only
+	 * read by xd3_srcwin_move_point (to pace the checksumming of the
+	 * parent) and debug output, and by xdelta_index_window as the offset
+	 * of the window.  match_srcpos is where the first match is tried and
+	 * srcwin_cksum_pos how far the parent has been checksummed.  The
+	 * xdelta3 sources are part of the tree, so they can't change under
+	 * us.
+	 */
+	stream->total_in = tgt_off;
+	if (stream->src) {
+		stream->match_srcpos = tgt_off < source.size ? tgt_off : source.size;
+		stream->srcwin_cksum_pos = tgt_off > (uint64_t) BufSize ? tgt_off - BufSize : 0;
+		if (stream->srcwin_cksum_pos > source.size) {
+			stream->srcwin_cksum_pos = source.size;
+		}
+	}
+
+	do {
+		chunk = len - pos < (size_t) BufSize ? len - pos : (size_t) BufSize;
+		if (pos + chunk == len) {
+			/* Flush with the last chunk, an empty one would add an empty window */
+			xd3_set_flags(stream, XD3_FLUSH | stream->flags);
+		}
+		xd3_avail_input(stream, (const uint8_t *) data + pos, chunk);
+		pos += chunk;
+
+	process:
+		ret = xd3_encode_input(stream);
+
+		switch (ret) {
+		case XD3_INPUT:
+			continue;
+		case XD3_OUTPUT:
+			if (out_pos + stream->avail_out > alloc) {
+				uint8_t *tmp;
+
+				alloc = 2 * (out_pos + stream->avail_out);
+				tmp = realloc(buf, alloc);
+				if (!tmp) {
+					r = -ENOMEM;
+					goto out;
+				}
+				buf = tmp;
+			}
+			memcpy(buf + out_pos, stream->next_out, stream->avail_out);
+			out_pos += stream->avail_out;
+			xd3_consume_output(stream);
+			goto process;
+		case XD3_GOTHEADER:
+			goto process;
+		case XD3_WINSTART:
+			win_start = out_pos;
+			goto process;
+		case XD3_WINFINISH:
+			r = xdelta_index_window(stream, seg, win_start, out_pos);
+			if (r) {
+				goto out;
+			}
+			goto process;
+		default:
+			DEBUG1(printf("DEBUG: INVALID %s %d\n", stream->msg, ret));
+			r = -EIO;
+			goto out;
+		}
+	} while (pos < len);
+
+	/* A fresh stream puts the file header in front of its first window */
+	if (!header) {
+		memmove(buf, buf + seg->hdr_len, out_pos - seg->hdr_len);
+		out_pos -= seg->hdr_len;
+	}
+	*out = buf;
+	*outlen = out_pos;
+	buf = NULL;
+	r = 0;
+
+ out:
+	free(buf);
+	if (r) {
+		windex_free(seg);
+	}
+	xdelta_source_close(&src);
+	xdelta_encoder_park(enc);
+	return r;
+}
+
+
+/*
+ * Append entry e of another index to idx, its data moved by shift bytes
+ * Returns 0 on success, otherwise -errno
+ */
+static int xdelta_index_keep(windex_t *idx, const windex_entry_t *e, int64_t shift)
+{
+	int r;
+
+	r = windex_add(idx, e->tgt_off, e->tgt_len, e->delta_off + shift, e->delta_len, e->src_off, e->src_len,
+		       e->cksum);
+	if (!r) {
+		idx->entries[idx->count - 1].flags = e->flags;
+	}
+	return r;
+}
+
+
+/*
+ * Write to an indexed child by decoding only the windows overlapping the
+ * write, re-encoding them against the parent and splicing the result into
+ * the delta in place of the old windows.  A clone has no VCDIFF data yet,
+ * its first write also puts the file header in front.  The delta is
+ * rewritten from the first window replaced on through a splice, so a
+ * crash can't leave it torn.  A write more than a window past the end
+ * fills the gap with one window of zeros encoded once and repeated.
+ * Returns bytes written for success, -ENOENT if the delta has no index
+ * (or no windows), otherwise -errno
+ */
+static int xdelta_write_windows(const char *file, const char *parent, const char *buf, size_t size, off_t offset)
+{
+	xdelta_reader_t *rd;
+	windex_t *idx;
+	windex_t seg, zseg, tseg, next;
+	struct stat statbuf;
+	uint64_t old_size, seg_off, seg_end, new_end, old_start, old_stop, z_start, z_end, pos;
+	uint64_t n, k;
+	int64_t shift;
+	size_t hdr;
+	char *data = NULL;
+	uint8_t *out = NULL, *zout = NULL, *tout = NULL;
+	size_t outlen, zlen = 0, tlen = 0;
+	splice_t *s = NULL;
+	int BufSize;
+	int a, b, i, fd = -1;
+	int r;
+
+	windex_init(&seg);
+	windex_init(&zseg);
+	windex_init(&tseg);
+	windex_init(&next);
+	rd = xdelta_reader_open(file, parent);
+	if (!rd) {
+		return -errno;
+	}
+	r = xdelta_reader_sync(rd);
+	if (r) {
+		goto out;
+	}
+	rd->next_off = -1; /* not a sequential reader, don't read ahead */
+	idx = &rd->idx;
+	if (!idx->count) {
+		r = -ENOENT;
+		goto out;
+	}
+
+	/* Windows a..b cover the write, the last one also anything past EOF */
+	old_size = windex_size(idx);
+	a = (uint64_t) offset < old_size ? windex_find(idx, offset) : (int) idx->count - 1;
+	b = offset + size < old_size ? windex_find(idx, offset + size - 1) : (int) idx->count - 1;
+	if (size == 0 || b < a) {
+		b = a;
+	}
+
+	seg_off = idx->entries[a].tgt_off;
+	seg_end = idx->entries[b].tgt_off + idx->entries[b].tgt_len;
+	new_end = offset + size > seg_end ? offset + size : seg_end;
+
+	if (fstat(rd->srcfd, &statbuf)) {
+		r = -errno;
+		goto out;
+	}
+	BufSize = xdelta_winsize(statbuf.st_size);
+
+	/*
+	 * Whole windows of the gap between the old end and a write past it
+	 * are z_start..z_end, none if it's less than a window
+	 */
+	z_start = seg_off + BufSize > seg_end ? seg_off + BufSize : seg_end;
+	n = (uint64_t) offset > z_start ? (offset - z_start) / BufSize : 0;
+	if (!n) {
+		z_start = new_end;
+	}
+	z_end = z_start + n * BufSize;
+
+	data = calloc(1, z_start - seg_off ? z_start - seg_off : 1);
+	if (!data) {
+		r = -ENOMEM;
+		goto out;
+	}
+	r = xdelta_reader_read_locked(rd, seg_end - seg_off, seg_off, data);
+	if (r != (int) (seg_end - seg_off)) {
+		r = r < 0 ? r : -EIO;
+		goto out;
+	}
+	if (!n) {
+		memcpy(data + (offset - seg_off), buf, size);
+	}
+	r = xdelta_encode_segment(data, z_start - seg_off, seg_off, rd->srcfd, BufSize, !idx->hdr_len,
+				  &seg, &out, &outlen);
+	if (r) {
+		goto out;
+	}
+
+	if (n) {
+		/* The zero windows don't need the parent, so they are all alike */
+		free(data);
+		data = calloc(1, new_end - z_end > (uint64_t) BufSize ? new_end - z_end : BufSize);
+		if (!data) {
+			r = -ENOMEM;
+			goto out;
+		}
+		r = xdelta_encode_segment(data, BufSize, 0, -1, BufSize, 0, &zseg, &zout, &zlen);
+		if (!r && (zseg.count != 1 || zseg.entries[0].delta_len != zlen)) {
+			r = -EIO;
+		}
+		if (r) {
+			goto out;
+		}
+
+		/* Then the rest of the gap and the write */
+		memcpy(data + (offset - z_end), buf, size);
+		r = xdelta_encode_segment(data, new_end - z_end, z_end, rd->srcfd, BufSize, 0, &tseg, &tout, &tlen);
+		if (r) {
+			goto out;
+		}
+	}
+
+	/*
+	 * New index: windows before a, the re-encoded ones, then the shifted
+	 * tail, everything behind the file header if it is new
+	 */
+	hdr = idx->hdr_len ? 0 : seg.hdr_len;
+	old_start = idx->entries[a].delta_off;
+	old_stop = idx->entries[b].delta_off + idx->entries[b].delta_len;
+	shift = (int64_t) (outlen + n * zlen + tlen) - (int64_t) (old_stop - old_start);
+
+	next.hdr_len = idx->hdr_len ? idx->hdr_len : seg.hdr_len;
+	next.delta_len = idx->delta_len + shift;
+	next.parent_ino = statbuf.st_ino;
+	next.winsize = idx->winsize ? idx->winsize : (uint32_t) BufSize;
+	for (i = 0; i < a && !r; ++i) {
+		r = xdelta_index_keep(&next, &idx->entries[i], hdr);
+	}
+	for (i = 0; i < (int) seg.count && !r; ++i) {
+		r = xdelta_index_keep(&next, &seg.entries[i], old_start + hdr - seg.hdr_len);
+	}
+	pos = old_start + outlen;
+	for (k = 0; k < n && !r; ++k) {
+		r = windex_add(&next, z_start + k * BufSize, BufSize, pos, zlen, 0, 0, zseg.entries[0].cksum);
+		pos += zlen;
+	}
+	for (i = 0; i < (int) tseg.count && !r; ++i) {
+		r = xdelta_index_keep(&next, &tseg.entries[i], pos - tseg.hdr_len);
+	}
+	for (i = b + 1; i < (int) idx->count && !r; ++i) {
+		r = xdelta_index_keep(&next, &idx->entries[i], shift);
+	}
+	if (r) {
+		goto out;
+	}
+
+	/* Everything from the first window replaced on: new windows, old tail, index */
+	fd = open(file, O_RDWR);
+	if (fd == -1) {
+		r = -errno;
+		goto out;
+	}
+	s = splice_begin(file, old_start);
+	if (!s) {
+		r = -errno;
+		goto out;
+	}
+	if (fwrite(out, 1, outlen, splice_file(s)) != outlen) {
+		r = -EIO;
+	}
+	for (k = 0; k < n && !r; ++k) {
+		if (fwrite(zout, 1, zlen, splice_file(s)) != zlen) {
+			r = -EIO;
+		}
+	}
+	if (!r && fwrite(tout, 1, tlen, splice_file(s)) != tlen) {
+		r = -EIO;
+	}
+	if (!r) {
+		r = splice_copy(s, fd, old_stop, idx->delta_len);
+	}
+	if (!r) {
+		r = windex_write(&next, splice_file(s));
+	}
+	if (r) {
+		splice_abort(s);
+		goto out;
+	}
+	r = splice_commit(s, fd);
+	if (r) {
+		goto out;
+	}
+
+	if (new_end > old_size) {
+		sql_update_size(file, new_end);
+	}
+	r = size;
+
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	windex_free(&seg);
+	windex_free(&zseg);
+	windex_free(&tseg);
+	windex_free(&next);
+	free(out);
+	free(zout);
+	free(tout);
+	free(data);
+	xdelta_reader_close(rd);
+	return r;
+}
+
+
+/*
+ * A page of the children of a parent about to change: each is locked,
+ * re-encoded straight from its decoded windows against the parent as the
+ * change will leave it and unlocked again, one pool job per child.  The
+ * caller holds the lock of the parent until it has changed, which keeps
+ * readers and writers of the children out in the meantime.
+ */
+typedef struct {
+	const char *parent;
+	const xdelta_change_t *pending;
+	char **childv;
+} xdelta_children_t;
+
+static int xdelta_unpack(const char *file, const char *parent);
+
+static int xdelta_child_reencode(void *arg, int i)
+{
+	xdelta_children_t *c = (xdelta_children_t *) arg;
+	xdelta_change_t change;
+	ilock_t *lock;
+	int r;
+
+	lock = ilock_acquire_path(c->childv[i], 1);
+	if (!lock) {
+		return -errno;
+	}
+
+	memset(&change, 0, sizeof(xdelta_change_t));
+	change.size = sql_get_size(c->childv[i]);
+	r = xdelta_reencode(c->childv[i], c->parent, c->parent, &change, c->pending);
+	DEBUG1(printf("xDelta Encode of %s returned: %d\n", c->childv[i], r));
+	if (r) {
+		/* Its delta is as it was, keep the content before the parent changes */
+		r = xdelta_unpack(c->childv[i], c->parent);
+		if (r) {
+			fprintf(stderr, "%s is lost when %s changes: %s\n",
+				c->childv[i], c->parent, strerror(-r));
+		} else {
+			sql_remove_child(c->childv[i]);
+		}
+	}
+	ilock_release(lock);
+	return r;
+}
+
+/*
+ * Re-encode the children of parent against it as pending will leave it,
+ * a page at a time.  A child that can't be re-encoded is unpacked into a
+ * plain file instead.  The caller holds the lock of parent.
+ * Returns 0 on success, otherwise the first error.  The parent must not
+ * change if done is left 0, and has to if it isn't.
+ */
+static int xdelta_children_reencode(const char *parent, const xdelta_change_t *pending, int *done)
+{
+	xdelta_children_t c;
+	sql_children_t *it;
+	int n, r = 0, res;
+
+	*done = 0;
+	c.parent = parent;
+	c.pending = pending;
+
+	it = sql_children_open(parent);
+	if (!it) {
+		return -ENOMEM;
+	}
+	while ((n = sql_children_next(it, &c.childv)) > 0) {
+		res = pool_run(n, xdelta_child_reencode, &c);
+		if (res && !r) {
+			r = res;
+		}
+		*done += n;
+	}
+	if (n < 0 && !r) {
+		r = -EIO;
+	}
+	sql_children_close(it);
+	return r;
+}
+
+/*
+ * Copy the parent at file to a new, read-only base in the metadata
+ * directory, sharing its extents where the filesystem supports it.
+ * Returns the malloc'ed path of the base, NULL on error setting errno
+ */
+static char *xdelta_base_create(const char *file)
+{
+	char *dir, *base;
+	int fd, srcfd, err;
+
+	dir = defs_meta_dir(XDELTA_BASE_DIR);
+	if (!dir) {
+		return NULL;
+	}
+	base = malloc(strlen(dir) + 8);
+	if (!base) {
+		free(dir);
+		errno = ENOMEM;
+		return NULL;
+	}
+	sprintf(base, "%s/XXXXXX", dir);
+	free(dir);
+
+	fd = mkstemp(base);
+	if (fd == -1) {
+		free(base);
+		return NULL;
+	}
+	srcfd = open(file, O_RDONLY);
+	if (srcfd == -1) {
+		err = errno;
+		goto err;
+	}
+
+	err = xdelta_copy(fd, srcfd);
+	if (err) {
+		goto err;
+	}
+
+	/* Children will depend on it, so it has to be on disk first */
+	if (fchmod(fd, 0400) || fsync(fd)) {
+		err = errno;
+		goto err;
+	}
+	close(srcfd);
+	close(fd);
+	return base;
+
+ err:
+	if (srcfd != -1) {
+		close(srcfd);
+	}
+	close(fd);
+	unlink(base);
+	free(base);
+	errno = err;
+	return NULL;
+}
+
+/*
+ * Record in the trailer of the delta at file that it now decodes against
+ * the parent with inode ino, whose content is the same
+ * Returns 0 on success, otherwise -errno
+ */
+static int xdelta_retarget(const char *file, ino_t ino)
+{
+	windex_t idx;
+	int fd, r;
+
+	fd = open(file, O_RDWR);
+	if (fd == -1) {
+		return -errno;
+	}
+	r = windex_load(&idx, fd);
+	if (!r) {
+		idx.parent_ino = ino;
+		r = windex_store(&idx, fd);
+	}
+	windex_free(&idx);
+	close(fd);
+	return r == -ENOENT ? 0 : r;
+}
+
+/*
+ * Point the child at file to the parent at to, whose inode is ino, from
+ * the parent at from, whose inode is from_ino.  The delta stays as it is,
+ * only its generation is bumped so readers notice their parent moved.
+ * Returns 0 on success, otherwise -errno and the child is as it was
+ */
+static int xdelta_move(const char *file, const char *to, ino_t ino, ino_t from_ino)
+{
+	ilock_t *lock;
+	int r;
+
+	/* Wait for reads decoding against the parent as it is */
+	lock = ilock_acquire_path(file, 1);
+	if (!lock) {
+		return -errno;
+	}
+	r = xdelta_retarget(file, ino);
+	if (!r && sql_set_parent(file, to)) {
+		r = -EIO;
+		if (xdelta_retarget(file, from_ino)) {
+			fprintf(stderr, "%s is left pointing to %s\n", file, to);
+		}
+	}
+	if (!r) {
+		utimensat(AT_FDCWD, file, NULL, 0);
+	}
+	xdelta_invalidate(file);
+	ilock_release(lock);
+	return r;
+}
+
+/*
+ * Move the children of the parent at from over to the parent at to,
+ * counting them in moved
+ * Returns 0 on success, otherwise -errno after the first failure
+ */
+static int xdelta_move_children(const char *from, const char *to, int *moved)
+{
+	sql_children_t *it;
+	struct stat fst, tst;
+	char **childv;
+	int i, n, r = 0;
+
+	*moved = 0;
+	if (stat(from, &fst) || stat(to, &tst)) {
+		return -errno;
+	}
+	it = sql_children_open(from);
+	if (!it) {
+		return -ENOMEM;
+	}
+	sql_begin();
+	while (!r && (n = sql_children_next(it, &childv)) != 0) {
+		if (n < 0) {
+			r = -EIO;
+		}
+		for (i = 0; i < n && !r; ++i) {
+			r = xdelta_move(childv[i], to, tst.st_ino, fst.st_ino);
+			if (!r) {
+				++*moved;
+			}
+		}
+	}
+	if ((sql_commit() || sql_sync()) && !r) {
+		r = -EIO;
+	}
+	sql_children_close(it);
+	return r;
+}
+
+/*
+ * Freeze the current content of the parent at file into the new base at
+ * base and move its children over to it, so the parent can change
+ * without re-encoding them.  If a child can't be moved the ones that were
+ * are moved back and the base removed, leaving the parent as it was.
+ * Returns 0 on success, otherwise -errno and the parent must not change
+ */
+static int xdelta_freeze(const char *file, const char *base)
+{
+	int r, res, moved, back;
+
+	r = xdelta_move_children(file, base, &moved);
+	if (r && moved) {
+		res = xdelta_move_children(base, file, &back);
+		if (res) {
+			/* Those left behind decode fine against the base, keep it */
+			fprintf(stderr, "could not move children of %s back from %s: %s\n",
+				file, base, strerror(-res));
+			return r;
+		}
+	}
+
+	/* Nobody came over, the base would never be released */
+	if (r || !moved) {
+		unlink(base);
+	}
+	return r;
+}
+
+int xdelta_base_release(const char *parent)
+{
+	const char *name;
+
+	/* Only bases live in a directory of that name inside the metadata directory */
+	name = strstr(parent, "/" DEFS_META_DIR "/" XDELTA_BASE_DIR "/");
+	if (!name || strchr(name + strlen("/" DEFS_META_DIR "/" XDELTA_BASE_DIR "/"), '/')) {
+		return 0;
+	}
+
+	if (sql_has_children(parent)) {
+		return 0;
+	}
+
+	xdelta_invalidate(parent);
+	if (unlink(parent)) {
+		return -errno;
+	}
+	return 1;
+}
+
+int xdelta_write(const char *file, const char *buf, size_t size, off_t offset, char *parent)
+{
+	/*
+	 * xDelta Write Routine
+	 * --------------------
+	 *
+	 * For an indexed child, re-encode only the windows the write touches
+	 * Otherwise decode the child a window at a time
+	 * Lay the changes over each window
+	 * Encode it as it comes
+	 * Return bytes written for success, otherwise -errno
+	 */  
+  
+	xdelta_change_t change;
+	struct stat statbuf;
+	int r;
+	int res;
+
+	if (parent) {
+		/*
+		 * Write to a child
+		 *  Decode child
+		 *  Write changes
+		 *  Encode child
+		 */
+		ilock_t *lock_parent, *lock_child;
+
+		/* Parent first, a parent about to change holds it over its children */
+		lock_parent = ilock_acquire_path(parent, 0);
+		if (!lock_parent) {
+			return -errno;
+		}
+		lock_child = ilock_acquire_path(file, 1);
+		if (!lock_child) {
+			r = -errno;
+			ilock_release(lock_parent);
+			return r;
+		}
+
+		r = xdelta_write_windows(file, parent, buf, size, offset);
+		if (r != -ENOENT) {
+			xdelta_invalidate(file);
+			ilock_release(lock_child);
+			ilock_release(lock_parent);
+			return r;
+		}
+
+		/* No window index to work from, rewrite the whole child */
+		change.size = sql_get_size(file);
+		if (change.size < offset + (off_t) size) {
+			change.size = offset + size;
+		}
+		change.buf = buf;
+		change.len = size;
+		change.off = offset;
+		res = xdelta_reencode(file, parent, parent, &change, NULL);
+		ilock_release(lock_child);
+		ilock_release(lock_parent);
+		r = res ? res : (int) size;
+	}
+	else {
+		/*
+		 * Encode each child against the parent as the write leaves it
+		 * Write changes to parent
+		 */
+		FILE* SrcFile;
+		ilock_t *lock_parent;
+		char *base;
+		int done;
+
+		lock_parent = ilock_acquire_path(file, 1);
+		if (!lock_parent) {
+			return -errno;
+		}
+
+		/* Children keep the content they were encoded against */
+		base = xdelta_base_create(file);
+		if (base) {
+			r = xdelta_freeze(file, base);
+			free(base);
+			if (!r) {
+				SrcFile = fopen(file, "r+b");
+				if (!SrcFile) {
+					r = -errno;
+				} else {
+					r = pwrite(fileno(SrcFile), buf, size, offset);
+					if (r == -1) {
+						r = -errno;
+					}
+					fclose(SrcFile);
+				}
+				xdelta_invalidate(file);
+			}
+			ilock_release(lock_parent);
+			return r;
+		}
+
+		if (stat(file, &statbuf)) {
+			r = -errno;
+			ilock_release(lock_parent);
+			return r;
+		}
+		change.size = statbuf.st_size;
+		if (change.size < offset + (off_t) size) {
+			change.size = offset + size;
+		}
+		change.buf = buf;
+		change.len = size;
+		change.off = offset;
+		res = xdelta_children_reencode(file, &change, &done);
+		if (res && !done) {
+			ilock_release(lock_parent);
+			return res;
+		}
+
+		/*
+		 * Write changes to parent
+		 */
+		SrcFile = fopen(file, "r+b");
+		if (!SrcFile) {
+			r = -errno;
+		} else {
+			r = pwrite(fileno(SrcFile), buf, size, offset);
+			if (r == -1) {
+				r = -errno;
+			}
+			fclose(SrcFile);
+		}
+		xdelta_invalidate(file);
+		if (res && r >= 0) {
+			r = res;
+		}
+		ilock_release(lock_parent);
+	}  
+	return r;
+}
+
+/*
+ * Replace the delta at file with what it decodes to against parent, a
+ * window at a time.  The content goes to a splice, which replaces the
+ * delta once it is complete.  The caller holds the lock of file.
+ * Returns 0 on success, otherwise -errno
+ */
+static int xdelta_unpack(const char *file, const char *parent)
+{
+	xdelta_reader_t *rd;
+	splice_t *s;
+	char *buffer;
+	off_t off;
+	int r;
+
+	rd = xdelta_reader_open(file, parent);
+	if (!rd) {
+		return -errno;
+	}
+	s = splice_begin(file, 0);
+	buffer = arena_alloc(dopt.buffer);
+	if (!s || !buffer) {
+		r = !s ? -errno : -ENOMEM;
+		goto out;
+	}
+
+	off = 0;
+	do {
+		r = xdelta_reader_read_locked(rd, dopt.buffer, off, buffer);
+		if (r > 0 && fwrite(buffer, 1, r, splice_file(s)) != (size_t) r) {
+			r = -EIO;
+		}
+		if (r < 0) {
+			goto out;
+		}
+		off += r;
+	} while (r == dopt.buffer);
+	r = splice_commit(s, -1);
+	s = NULL;
+
+ out:
+	if (s) {
+		splice_abort(s);
+	}
+	arena_free(buffer);
+	xdelta_reader_close(rd);
+	xdelta_invalidate(file);
+	return r;
+}
+
+/*
+ * A page of the children of a parent going away, moved over to the heir
+ * one pool job per child
+ */
+typedef struct {
+	const char *parent;
+	const char *heir;
+	char **childv;
+} xdelta_promote_t;
+
+static int xdelta_promote_child(void *arg, int i)
+{
+	xdelta_promote_t *p = (xdelta_promote_t *) arg;
+	const char *child = p->childv[i];
+	xdelta_change_t change;
+	ilock_t *lock_child;
+	int r;
+
+	lock_child = ilock_acquire_path(child, 1);
+	if (!lock_child) {
+		return -errno;
+	}
+
+	/* Decode against the old parent as the encode with new parent goes */
+	memset(&change, 0, sizeof(xdelta_change_t));
+	change.size = sql_get_size(child);
+	r = xdelta_reencode(child, p->parent, p->heir, &change, NULL);
+	if (r == 0) {
+		sql_set_parent(child, p->heir);
+	}
+	ilock_release(lock_child);
+	return r;
+}
+
+int xdelta_promote(const char *file, char **heir)
+{
+	/*
+	 * First child is promoted to parent
+	 *  Decode first child over its own delta
+	 * Other children are made children of new parent, a page at a time
+	 *  Decode other children
+	 *  Encode with new parent as they decode
+	 */
+
+	xdelta_promote_t p;
+	sql_children_t *it;
+	ilock_t *lock_heir;
+	char **childv;
+	int n, r, res;
+
+	*heir = NULL;
+	it = sql_children_open(file);
+	if (!it) {
+		return -ENOMEM;
+	}
+	n = sql_children_next(it, &childv);
+	if (n <= 0) {
+		sql_children_close(it);
+		return n;
+	}
+	*heir = strdup(childv[0]);
+	if (!*heir) {
+		sql_children_close(it);
+		return -ENOMEM;
+	}
+
+	/* Decode first Child */
+	lock_heir = ilock_acquire_path(*heir, 1);
+	if (!lock_heir) {
+		r = -errno;
+		sql_children_close(it);
+		return r;
+	}
+	r = xdelta_unpack(*heir, file);
+	if (r == 0) {
+		sql_remove_child(*heir);
+	}
+	ilock_release(lock_heir);
+	if (r) {
+		sql_children_close(it);
+		return r;
+	}
+
+	/* Only so many children are worked on at once, the pool's threads */
+	p.parent = file;
+	p.heir = *heir;
+	p.childv = childv + 1;
+	--n;
+	do {
+		res = pool_run(n, xdelta_promote_child, &p);
+		if (res && !r) {
+			r = res;
+		}
+		n = sql_children_next(it, &p.childv);
+	} while (n > 0);
+
+	sql_children_close(it);
+	return r;
+}
+
+
+int xdelta_truncate(const char *file, off_t size, char *parent)
+{
+	/*
+	 * xDelta Truncate Routine
+	 * -----------------------
+	 *
+	 * If it's a child
+	 *  Decode a window at a time
+	 *  Cut or zero-extend to size
+	 *  Encode it as it comes
+	 *
+	 * If it's a parent
+	 *  Encode all children against the parent as truncated
+	 *  Truncate Parent
+	 *
+	 * Return 0 on success, otherwise -errno
+	 */
+
+	xdelta_change_t change;
+	int res, r;
+
+	memset(&change, 0, sizeof(xdelta_change_t));
+	change.size = size;
+
+	if (parent) {
+		/* If it's a child */
+		ilock_t *lock_parent, *lock_child;
+    
+		lock_parent = ilock_acquire_path(parent, 0);
+		if (!lock_parent) {
+			return -errno;
+		}
+		lock_child = ilock_acquire_path(file, 1);
+		if (!lock_child) {
+			res = -errno;
+			ilock_release(lock_parent);
+			return res;
+		}
+
+		/* Decode, cut and encode a window at a time */
+		res = xdelta_reencode(file, parent, parent, &change, NULL);
+		ilock_release(lock_child);
+		ilock_release(lock_parent);
+		if (res) {
+			return res;
+		}
+	} else {
+		ilock_t *lock_parent;
+		char *base;
+		int done;
+    
+		lock_parent = ilock_acquire_path(file, 1);
+		if (!lock_parent) {
+			return -errno;
+		}
+
+		/* Children keep the content they were encoded against */
+		base = xdelta_base_create(file);
+		if (base) {
+			res = xdelta_freeze(file, base);
+			free(base);
+			if (!res) {
+				res = truncate(file, size);
+				if (res) {
+					res = -errno;
+				}
+				xdelta_invalidate(file);
+			}
+			ilock_release(lock_parent);
+			return res;
+		}
+
+		/* Encode children */
+		r = xdelta_children_reencode(file, &change, &done);
+		if (r && !done) {
+			ilock_release(lock_parent);
+			return r;
+		}
+
+		/* Truncate */
+		res = truncate(file, size);
+		if (res) {
+			res = -errno;
+		}
+		xdelta_invalidate(file);
+		ilock_release(lock_parent);
+		if (res || r) {
+			return res ? res : r;
+		}
 	}
 	return 0;
 }
@@ -23,6 +23,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdint.h>
 
 /*
  * Encodes the differences from an original Source File, an In File with changes
@@ -35,7 +36,8 @@ int xdelta_encode(const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* Ou
  * xDelta Link Routine
  * -------------------
  *
- * Create firm link of f1 at f2
+ * Create firm link of f1 at f2, a clone that reads f1 as is until
+ * written to
  * Routine handles all file I/O
  * Return 0 for success, otherwise -errno
  */
@@ -54,30 +56,67 @@ int xdelta_link(const char *f1, const char *f2);
 int xdelta_read(const char *file, const char* parent, size_t bytes, off_t offset, char *buffer);
 
 
+/*
+ * xDelta Reader Routines
+ * ----------------------
+ *
+ * A reader keeps the delta and parent open along with the window index and
+ * a decoder positioned after the last window it decoded, so reads through
+ * one open file don't start over each time.  Reads take the locks of the
+ * parent and then the delta shared, so a reader must not be used by two
+ * threads at once.
+ *
+ * xdelta_reader_open returns a reader on success, NULL on error setting errno
+ * xdelta_reader_read returns bytes read for success, otherwise -errno
+ */
+typedef struct xdelta_reader xdelta_reader_t;
+
+xdelta_reader_t *xdelta_reader_open(const char *file, const char *parent);
+int xdelta_reader_read(xdelta_reader_t *rd, size_t bytes, off_t offset, char *buffer);
+void xdelta_reader_close(xdelta_reader_t *rd);
+
+/*
+ * Decode windows first..first+count-1 of file into the window cache for
+ * the read-ahead thread, unless the delta's generation is no longer gen.
+ * Returns the number of windows decoded, otherwise -errno
+ */
+int xdelta_prefetch(const char *file, const char *parent, uint64_t gen, int first, int count);
+
+
 
 /*
  * xDelta Write Routine
  * --------------------
  *
- * Do a full decode
- * Write appropriate changes
- * Do an encode
+ * For a child with a window index, decode, patch and re-encode only the
+ * windows overlapping the write, splicing them into the delta
+ * For a parent (parent NULL), freeze its content into a base the
+ * children move to, then write it in place.  If a child can't be moved
+ * the write is refused and the children stay where they were.  If no
+ * base can be made, re-encode each child against the parent as the write
+ * will leave it, then write it.
+ * Otherwise decode the child a window at a time
+ * Lay the changes over each window
+ * Encode it as it comes
  * Returns bytes written for success, otherwise -errno
  */
-int xdelta_write(const char *file, const char *buf, size_t size, off_t offset, int childc, char **childv, char *parent);
+int xdelta_write(const char *file, const char *buf, size_t size, off_t offset, char *parent);
 
 /*
  * xDelta Promote Routine
  * ----------------------
  *
  * First child is promoted to parent
- *  Decode first child
- *  Write back to child file
- * Other children are made children of new parent
+ *  Decode first child over its own delta
+ *  Drop it from the link table
+ * Other children are made children of new parent, a page at a time
  *  Decode other children
- *  Encode with new parent
+ *  Encode with new parent as they decode
+ *  Move them in the link table
+ * Sets heir to the malloc'ed first child, NULL if there were none
+ * Returns 0 on success, otherwise -errno
  */
-int xdelta_promote(const char *file, int childc, char **childv);
+int xdelta_promote(const char *file, char **heir);
 
 
 /*
@@ -85,19 +124,26 @@ int xdelta_promote(const char *file, int childc, char **childv);
  * -----------------------
  *
  * If it's a child
- *  Do a full decode
- *  Truncate
- *  Do an encode
- *  Return 0 on success, -1 on error setting errno
+ *  Decode a window at a time
+ *  Cut or zero-extend to size
+ *  Encode it as it comes
  *
- * If it's a parent
- *  Decode all children
+ * If it's a parent (parent NULL)
+ *  Freeze it into a base the children move to
+ *  If a child can't be moved, refuse
+ *  If no base can be made, encode all children against it as truncated
  *  Truncate Parent
- *  Encode all children
- *  Return 0 on success, -1 on error setting errno
+ *
+ * Return 0 on success, otherwise -errno
  */
 
-int xdelta_truncate(const char *file, off_t size, char *parent, int childc, char **childv);
+int xdelta_truncate(const char *file, off_t size, char *parent);
+
+/*
+ * Remove parent if it is a frozen base without children left
+ * Returns 1 if removed, 0 if not, otherwise -errno
+ */
+int xdelta_base_release(const char *parent);
 
 
 
@@ -37,8 +37,10 @@
 #include <dirent.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sqlite3.h>
 #include <limits.h> /* PATH_MAX */
+#include <pthread.h>
 #include <sys/time.h>
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
@@ -47,6 +49,15 @@
 #include "delta.h"
 #include "sql.h"
 #include "opts.h"
+#include "wcache.h"
+#include "bcache.h"
+#include "readahead.h"
+#include "pool.h"
+#include "ilock.h"
+#include "acache.h"
+#include "arena.h"
+#include "dirty.h"
+#include "splice.h"
 
 static struct fuse_opt defs_opts[] = {
 	FUSE_OPT_KEY("--help", KEY_HELP),
@@ -55,10 +66,41 @@ static struct fuse_opt defs_opts[] = {
 	FUSE_OPT_KEY("-V", KEY_VERSION),
 	FUSE_OPT_KEY("windowabs=%s", KEY_WINDOW_ABS),
 	FUSE_OPT_KEY("windowrel=%s", KEY_WINDOW_REL),
+	FUSE_OPT_KEY("windowmax=%s", KEY_WINDOW_MAX),
+	FUSE_OPT_KEY("iobuf=%s", KEY_IOBUF),
+	FUSE_OPT_KEY("bufmem=%s", KEY_BUFMEM),
+	FUSE_OPT_KEY("cachesize=%s", KEY_CACHE_SIZE),
+	FUSE_OPT_KEY("srccache=%s", KEY_SRCCACHE_SIZE),
+	FUSE_OPT_KEY("readahead=%s", KEY_READAHEAD),
+	FUSE_OPT_KEY("dirtysize=%s", KEY_DIRTY_SIZE),
+	FUSE_OPT_KEY("dirtytimeout=%s", KEY_DIRTY_TIMEOUT),
+	FUSE_OPT_KEY("workers=%s", KEY_WORKERS),
 	FUSE_OPT_END
 };
 
 
+/* Idle readers kept per open file, one per read FUSE runs at once on it */
+#define DEFS_READERS 4
+
+/*
+ * Per-open state, kept in fi->fh.  FUSE may run several reads and writes
+ * on one handle at once: they hold lock shared, a refresh of parent holds
+ * it exclusive.  A reader is used by one read at a time, so each read
+ * takes an idle one from readers, or opens its own.
+ */
+typedef struct {
+	int fd;                   /* backing file */
+	char *key;                /* in the link table, see defs_key */
+	pthread_rwlock_t lock;    /* parent, meta_gen, dirty and readers */
+	char *parent;             /* parent if this is a child, NULL otherwise */
+	unsigned int meta_gen;    /* sql_generation() when parent was looked up */
+	dirty_t *dirty;           /* buffered writes of a child, NULL when writes aren't buffered */
+	pthread_mutex_t readers_lock;
+	xdelta_reader_t *readers[DEFS_READERS]; /* idle decoder states for a child */
+	int readerc;
+} defs_handle_t;
+
+
 char *defs_fix_path(const char *path)
 {
 	char *fixed_path = strdup(dopt.directory);
@@ -68,34 +110,361 @@ char *defs_fix_path(const char *path)
 	return fixed_path;
 }
 
+/*
+ * Encode buffered writes of the children of key before it changes
+ */
+static void defs_flush_children(const char *key)
+{
+	sql_children_t *it;
+	char **childv;
+	int i, n;
+
+	it = sql_children_open(key);
+	while (it && (n = sql_children_next(it, &childv)) > 0) {
+		for (i = 0; i < n; ++i) {
+			dirty_flush_file(childv[i]);
+		}
+	}
+	sql_children_close(it);
+}
+
+
+/*
+ * Links are keyed by inode, not by name.  Every file in a link, parent or
+ * child, is pinned by a hard link named after its inode number in the ino
+ * directory of DEFS_META_DIR, and the link table only holds those names
+ * (and those of bases).  Renaming a file or a whole directory leaves them
+ * alone, and an inode can't be reused while its row is there.
+ */
+static char *defs_ino_dir;   /* NULL without a metadata directory */
+static dev_t defs_dev;       /* of the underlying directory */
+
+/*
+ * Returns the key (malloc'ed) of the file st describes, NULL if it can't
+ * be in a link
+ */
+static char *defs_key(const struct stat *st)
+{
+	char *key;
+
+	if (!defs_ino_dir || !S_ISREG(st->st_mode) || st->st_dev != defs_dev) {
+		return NULL;
+	}
+	key = malloc(strlen(defs_ino_dir) + 22);
+	if (key) {
+		sprintf(key, "%s/%llu", defs_ino_dir, (unsigned long long) st->st_ino);
+	}
+	return key;
+}
+
+/*
+ * Returns the key of the file at fixed_path if it may be in a link, which
+ * takes a second name, NULL otherwise
+ */
+static char *defs_lookup_key(const char *fixed_path)
+{
+	struct stat st;
+
+	if (lstat(fixed_path, &st) == -1 || st.st_nlink < 2) {
+		return NULL;
+	}
+	return defs_key(&st);
+}
+
+/*
+ * Pin the file at fixed_path under its key, for it to be linked
+ * Returns the key, NULL on error setting errno
+ */
+static char *defs_pin(const char *fixed_path)
+{
+	struct stat st, kst;
+	char *key;
+
+	if (lstat(fixed_path, &st) == -1) {
+		return NULL;
+	}
+	key = defs_key(&st);
+	if (!key) {
+		errno = S_ISREG(st.st_mode) ? EXDEV : EPERM;
+		return NULL;
+	}
+	if (link(fixed_path, key) == -1) {
+		if (errno != EEXIST || lstat(key, &kst) == -1) {
+			free(key);
+			return NULL;
+		}
+		/* Left from an inode of that number that's gone */
+		if (kst.st_ino != st.st_ino &&
+		    (unlink(key) == -1 || link(fixed_path, key) == -1)) {
+			free(key);
+			return NULL;
+		}
+	}
+	return key;
+}
+
+/*
+ * Returns 1 if path is a key or a base, which never move
+ */
+static int defs_is_pinned(const char *path)
+{
+	size_t len = strlen(dopt.directory);
+
+	return !strncmp(path, dopt.directory, len) &&
+		!strncmp(path + len, DEFS_META_DIR "/", strlen(DEFS_META_DIR) + 1);
+}
+
+/*
+ * Take the file with key out of its links, as it is going away: a child
+ * is dropped, the children of a parent are moved to the first of them,
+ * which gets decoded in full.  Unpins it.
+ */
+static void defs_unlink_key(const char *key)
+{
+	char *parent = NULL;
+	char *heir = NULL;
+
+	sql_get_parent(key, &parent);
+
+	if (parent) { /* child */
+		dirty_forget(key);
+		sql_remove_child(key);
+		xdelta_base_release(parent);
+		free(parent);
+	} else if (sql_has_children(key)) { /* parent with children */
+		defs_flush_children(key);
+		if (xdelta_promote(key, &heir)) {
+			/* Those not moved still decode against it, keep it pinned */
+			free(heir);
+			return;
+		}
+		if (heir && !sql_has_children(heir)) {
+			unlink(heir);
+		}
+		free(heir);
+	}
+	unlink(key);
+}
+
+/*
+ * A link as the table had it, collected by defs_collect_unpinned
+ */
+typedef struct defs_row {
+	char *parent;
+	char *child;
+	int64_t size;
+	struct defs_row *next;
+} defs_row_t;
+
+static int defs_collect_unpinned(const char *parent, const char *child, int64_t size, void *arg)
+{
+	defs_row_t **rows = (defs_row_t **) arg;
+	defs_row_t *row;
+
+	if (defs_is_pinned(parent) && defs_is_pinned(child)) {
+		return 0;
+	}
+	row = malloc(sizeof(defs_row_t));
+	if (!row) {
+		return -1;
+	}
+	row->parent = strdup(parent);
+	row->child = strdup(child);
+	row->size = size;
+	row->next = *rows;
+	*rows = row;
+	return 0;
+}
+
+/*
+ * Links made by path, before links were keyed by inode or by a dln that
+ * found no metadata directory, are pinned and keyed now
+ */
+static void defs_pin_links()
+{
+	defs_row_t *rows = NULL, *row;
+	char *parent, *child;
+
+	sql_foreach(defs_collect_unpinned, &rows);
+	while ((row = rows) != NULL) {
+		rows = row->next;
+		parent = defs_is_pinned(row->parent) ? strdup(row->parent) : defs_pin(row->parent);
+		child = defs_is_pinned(row->child) ? strdup(row->child) : defs_pin(row->child);
+		if (parent && child) {
+			sql_begin();
+			sql_remove_child(row->child);
+			sql_add(parent, child, row->size);
+			sql_commit();
+		} else {
+			fprintf(stderr, "could not pin the link of %s to %s\n", row->child, row->parent);
+		}
+		free(parent);
+		free(child);
+		free(row->parent);
+		free(row->child);
+		free(row);
+	}
+}
+
+/*
+ * Drop pins whose file was deleted behind our back, unless other files
+ * still decode against it
+ */
+static void defs_sweep_pins()
+{
+	DIR *dp;
+	struct dirent *de;
+	struct stat st;
+	char *key;
+
+	dp = opendir(defs_ino_dir);
+	while (dp && (de = readdir(dp)) != NULL) {
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		key = malloc(strlen(defs_ino_dir) + strlen(de->d_name) + 2);
+		if (!key) {
+			break;
+		}
+		sprintf(key, "%s/%s", defs_ino_dir, de->d_name);
+		if (lstat(key, &st) == 0 && st.st_nlink == 1 && !sql_has_children(key)) {
+			defs_unlink_key(key);
+		}
+		free(key);
+	}
+	if (dp) {
+		closedir(dp);
+	}
+}
+
+static void *defs_init(struct fuse_conn_info *conn)
+{
+	char *journal, *splices;
+	struct stat st;
+
+	(void) conn;
+
+	/* Threads don't survive the fork into the background, start them here */
+	if (pool_init(dopt.workers)) {
+		fprintf(stderr, "could not start every worker, re-encoding on fewer\n");
+	}
+	if (sql_cache_init()) {
+		fprintf(stderr, "could not load the link table, querying it instead\n");
+	}
+	if (dopt.cache_size) {
+		readahead_init(dopt.readahead);
+	}
+
+	/* Finish rewrites of deltas a crash interrupted before anything reads them */
+	splices = defs_meta_dir("splice");
+	if (!splices || splice_init(splices)) {
+		fprintf(stderr, "no splice directory, a crash may tear deltas being written\n");
+	}
+	free(splices);
+
+	journal = defs_meta_dir("journal");
+	if (!journal) {
+		fprintf(stderr, "no journal directory, fsync will encode\n");
+	}
+	dirty_init((size_t) dopt.dirty_size << 20, dopt.dirty_timeout, journal);
+	free(journal);
+
+	defs_ino_dir = defs_meta_dir(DEFS_INO_DIR);
+	if (!defs_ino_dir || stat(dopt.directory, &st) == -1) {
+		fprintf(stderr, "no directory to pin links in, firm links are off\n");
+		free(defs_ino_dir);
+		defs_ino_dir = NULL;
+	} else {
+		defs_dev = st.st_dev;
+		defs_pin_links();
+		defs_sweep_pins();
+	}
+	return NULL;
+}
+
+static void defs_destroy(void *private_data)
+{
+	(void) private_data;
+
+	dirty_destroy();
+	splice_destroy();
+	readahead_destroy();
+	pool_destroy();
+	sql_cache_destroy();
+	free(defs_ino_dir);
+	defs_ino_dir = NULL;
+}
+
+
+/*
+ * Returns 1 if path is inside the directory defs keeps its own files in
+ */
+static int defs_is_meta(const char *path)
+{
+	size_t len = strlen(DEFS_META_DIR);
+
+	return path[0] == '/' && !strncmp(path + 1, DEFS_META_DIR, len) &&
+		(path[len + 1] == '\0' || path[len + 1] == '/');
+}
+
+/*
+ * Returns the size of the file st describes if it is a child,
+ * SQL_LINK_PARENT if it is otherwise pinned, SQL_LINK_NONE if it isn't
+ */
+static int64_t defs_link_size(const struct stat *st)
+{
+	unsigned int gen = sql_generation();
+	char *key, *parent = NULL;
+	struct stat kst;
+	int64_t size;
+
+	if (st->st_nlink < 2 || !(key = defs_key(st))) {
+		return SQL_LINK_NONE;
+	}
+	if (acache_get(st->st_ino, gen, &size)) {
+		free(key);
+		return size;
+	}
+	size = SQL_LINK_NONE;
+	if (lstat(key, &kst) == 0 && kst.st_ino == st->st_ino) {
+		sql_get_parent_size(key, &parent, &size);
+		if (!parent) {
+			size = SQL_LINK_PARENT;
+		}
+		free(parent);
+	}
+	acache_put(st->st_ino, size, gen);
+	free(key);
+	return size;
+}
+
 static int defs_getattr(const char *path, struct stat *stbuf)
 {
 	int res;
-	int fd;
-	char *parent = NULL;
-	char *fixed_path = defs_fix_path(path);
+	int64_t size;
+	char *fixed_path;
 
-	sql_get_parent(fixed_path, &parent);
+	if (defs_is_meta(path)) {
+		return -ENOENT;
+	}
+	fixed_path = defs_fix_path(path);
 
 	res = lstat(fixed_path, stbuf);
+	free(fixed_path);
 	if (res == -1) {
-		free(fixed_path);
 		return -errno;
 	}  
-  
-	fd = open(fixed_path, O_RDONLY);
-	if (fd == -1) {
-		free(fixed_path);
-		return -errno;
+
+	size = defs_link_size(stbuf);
+	if (size != SQL_LINK_NONE) {
+		/* The pin isn't a name anyone should see */
+		stbuf->st_nlink--;
 	}
-   
-	if (parent) { /* it's a delta file */
-		stbuf->st_size = sql_get_size(fixed_path);
-		free(parent);
+	if (size >= 0) { /* it's a delta file */
+		if (!dirty_size(stbuf->st_dev, stbuf->st_ino, &stbuf->st_size)) {
+			stbuf->st_size = size;
+		}
 	}
-  
-	close(fd);
-	free(fixed_path);
 	return 0;
 }
 
@@ -133,11 +502,78 @@ static int defs_readlink(const char *path, char *buf, size_t size)
 }
 
 
+/*
+ * An entry defs_readdir collected
+ */
+typedef struct {
+	char *name;
+	struct stat st;
+} defs_dirent_t;
+
+/*
+ * Look up the links of the regular files among the count entries of the
+ * directory at fixed_path at once, filling the attribute cache for the
+ * getattr that follows for each of them, and the size of children in
+ * their entry
+ */
+static void defs_readdir_prefetch(const char *fixed_path, defs_dirent_t *entv, int count)
+{
+	unsigned int gen = sql_generation();
+	struct stat st, kst;
+	char **keyv;
+	int64_t *sizev;
+	int *entryv;
+	int keyc = 0;
+	int i;
+
+	if (!defs_ino_dir || stat(fixed_path, &st) == -1 || st.st_dev != defs_dev) {
+		return;
+	}
+	keyv = malloc(count * sizeof(char *));
+	sizev = malloc(count * sizeof(int64_t));
+	entryv = malloc(count * sizeof(int));
+	if (!keyv || !sizev || !entryv) {
+		goto out;
+	}
+
+	for (i = 0; i < count; ++i) {
+		entv[i].st.st_dev = st.st_dev;
+		if (S_ISREG(entv[i].st.st_mode) && (keyv[keyc] = defs_key(&entv[i].st)) != NULL) {
+			entryv[keyc++] = i;
+		}
+		entv[i].st.st_dev = 0;
+	}
+	if (sql_get_links(keyc, keyv, sizev) == 0) {
+		for (i = 0; i < keyc; ++i) {
+			/* Files in no link are left to getattr, which checks for a stray pin */
+			if (sizev[i] == SQL_LINK_NONE || lstat(keyv[i], &kst) == -1 ||
+			    kst.st_ino != entv[entryv[i]].st.st_ino) {
+				continue;
+			}
+			acache_put(kst.st_ino, sizev[i], gen);
+			if (sizev[i] >= 0) {
+				entv[entryv[i]].st.st_size = sizev[i];
+			}
+		}
+	}
+
+ out:
+	for (i = 0; i < keyc; ++i) {
+		free(keyv[i]);
+	}
+	free(keyv);
+	free(sizev);
+	free(entryv);
+}
+
 static int defs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			off_t offset, struct fuse_file_info *fi)
 {
 	DIR *dp;
 	struct dirent *de;
+	defs_dirent_t *entv = NULL, *v;
+	int count = 0, alloc = 0;
+	int i, res = 0;
   
 	(void) offset;
 	(void) fi;
@@ -150,19 +586,47 @@ static int defs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		return -errno;
 	}
   
+	/* Collect the whole directory first to look its links up at once */
 	while ((de = readdir(dp)) != NULL) {
-		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0)) {
+		if (!strcmp(path, "/") && !strcmp(de->d_name, DEFS_META_DIR)) {
+			continue;
+		}
+		if (count == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			v = realloc(entv, alloc * sizeof(defs_dirent_t));
+			if (!v) {
+				res = -ENOMEM;
+				break;
+			}
+			entv = v;
+		}
+		entv[count].name = strdup(de->d_name);
+		if (!entv[count].name) {
+			res = -ENOMEM;
+			break;
+		}
+		memset(&entv[count].st, 0, sizeof(struct stat));
+		entv[count].st.st_ino = de->d_ino;
+		entv[count].st.st_mode = de->d_type << 12;
+		count++;
+	}
+
+	if (!res) {
+		defs_readdir_prefetch(fixed_path, entv, count);
+	}
+	for (i = 0; !res && i < count; ++i) {
+		if (filler(buf, entv[i].name, &entv[i].st, 0)) {
 			break;
 		}
 	}
   
+	for (i = 0; i < count; ++i) {
+		free(entv[i].name);
+	}
+	free(entv);
 	closedir(dp);
 	free(fixed_path);
-	return 0;
+	return res;
 }
 
 static int defs_mknod(const char *path, mode_t mode, dev_t rdev)
@@ -212,34 +676,16 @@ static int defs_mkdir(const char *path, mode_t mode)
 
 static int defs_unlink(const char *path)
 {
-	int res, r;
-	char *parent = NULL;
-	int childc;
-	char **childv;
-	int i;
+	int res;
+	char *key;
 
 	char *fixed_path = defs_fix_path(path);
 
-	sql_get_parent(fixed_path, &parent);
-	sql_get_children(fixed_path, &childc, &childv);
-
-	if (parent) { /* child */
-		sql_remove_child(fixed_path);
-		free(parent);
-	} else if (childc != 0) { /* parent with children */
-		res = xdelta_promote(fixed_path, childc, childv);
-    
-		for (i = 1; i < childc; ++i) {
-			r = sql_get_size(childv[i]);
-			sql_remove_child(childv[i]);
-			sql_add(childv[0], childv[i], r);
-		}
+	key = defs_lookup_key(fixed_path);
+	if (key) {
+		defs_unlink_key(key);
+		free(key);
 	}
-  
-	for (i = 0; i < childc; ++i) {
-		free(childv[i]);
-	}
-	free(childv);
 	
 	res = unlink(fixed_path);
 	if (res == -1) {
@@ -288,43 +734,31 @@ static int defs_symlink(const char *from, const char *to)
 
 static int defs_rename(const char *from, const char *to)
 {
-	int res, r;
-	char *parent = NULL;
-	int childc;
-	char **childv;
-	int i;
+	int res;
+	char *key;
+	struct stat from_st, to_st;
 
 	char *fixed_from = defs_fix_path(from);
 	char *fixed_to = defs_fix_path(to);
 
-	sql_get_parent(fixed_from, &parent);
-	sql_get_children(fixed_from, &childc, &childv);
-
-	/* Currently this only supports a one level hierarchy */
-	if (parent) {  /* child */
-		r = sql_get_size(fixed_from);
-		sql_remove_child(fixed_from);
-		sql_add(parent, fixed_to, r);
-		free(parent);
-	} else if (childc != 0) {  /* parent */
-		for (i = 0; i < childc; ++i) {
-			r = sql_get_size(childv[i]);
-			sql_remove_child(childv[i]);
-			sql_add(fixed_to, childv[i], r);
-		}
-	}
-
-	for (i = 0; i < childc; ++i) {
-		free(childv[i]);
+	/* Links go by inode, only a file that gets replaced changes them */
+	key = NULL;
+	if (lstat(fixed_to, &to_st) == 0 && to_st.st_nlink > 1 &&
+	    (lstat(fixed_from, &from_st) == -1 || from_st.st_ino != to_st.st_ino)) {
+		key = defs_key(&to_st);
 	}
-	free(childv);
 
 	res = rename(fixed_from, fixed_to);
 	if (res == -1) {
+		free(key);
 		free(fixed_from);
 		free(fixed_to);
 		return -errno;
 	}
+	if (key) {
+		defs_unlink_key(key);
+		free(key);
+	}
   
 	free(fixed_from);
 	free(fixed_to);
@@ -336,24 +770,44 @@ static int defs_link(const char *from, const char *to)
 	int rc;
 	char *fixed_from = defs_fix_path(from);
 	char *fixed_to = defs_fix_path(to);
+	char *key_from, *key_to;
 	struct stat statbuf;
 	
 	char *parent = NULL;
 
-	sql_get_parent(fixed_from, &parent);
+	key_from = defs_pin(fixed_from);
+	if (!key_from || stat(fixed_from, &statbuf) == -1) {
+		rc = -errno;
+		goto out;
+	}
 
+	sql_get_parent(key_from, &parent);
 	if (parent) { /* Don't allow links of links */
 		free(parent);
-		return -1;
-	}
-	
-	if (stat(fixed_from, &statbuf) == -1) {
-		return -1;
+		rc = -EPERM;
+		goto out;
 	}
 
-	sql_add(fixed_from, fixed_to, statbuf.st_size);
-	rc = xdelta_link(fixed_from, fixed_to);
+	rc = xdelta_link(key_from, fixed_to);
+	if (!rc) {
+		key_to = defs_pin(fixed_to);
+		if (key_to) {
+			sql_add(key_from, key_to, statbuf.st_size);
+			free(key_to);
+		} else {
+			rc = -errno;
+			unlink(fixed_to);
+		}
+	}
+	if (rc) {
+		/* Don't leave a pin on a file that didn't become a parent */
+		if (!sql_has_children(key_from)) {
+			unlink(key_from);
+		}
+	}
 
+ out:
+	free(key_from);
 	free(fixed_from);
 	free(fixed_to);
 	return rc;
@@ -395,33 +849,32 @@ static int defs_truncate(const char *path, off_t size)
 {
 	int res;
 	char *parent = NULL;
-	int childc;
-	char **childv;
-	int i;
 
 	char *fixed_path = defs_fix_path(path);
+	char *key = defs_lookup_key(fixed_path);
 
-	sql_get_parent(fixed_path, &parent);
-	sql_get_children(fixed_path, &childc, &childv);
+	if (key) {
+		sql_get_parent(key, &parent);
+	}
   
-	if (parent || (childc != 0)) {
-		res = xdelta_truncate(fixed_path, size, parent, childc, childv);
+	if (parent) {
+		dirty_flush_file(key);
+		res = xdelta_truncate(key, size, parent);
 		free(parent);
 	}
+	else if (key && sql_has_children(key)) {
+		defs_flush_children(key);
+		res = xdelta_truncate(key, size, NULL);
+	}
 	else {
 		res = truncate(fixed_path, size);
+		if (res == -1) {
+			res = -errno;
+		}
 	}
-	for (i = 0; i < childc; ++i) {
-		free(childv[i]);
-	}
-	free(childv);
-	if (res == -1) {
-		free(fixed_path);
-		return -errno;
-	}
-
+	free(key);
 	free(fixed_path);
-	return 0;
+	return res;
 }
 
 static int defs_utimens(const char *path, const struct timespec ts[2])
@@ -446,106 +899,190 @@ static int defs_utimens(const char *path, const struct timespec ts[2])
 	return 0;
 }
 
+/*
+ * Close the idle readers of h
+ */
+static void defs_handle_drop_readers(defs_handle_t *h)
+{
+	pthread_mutex_lock(&h->readers_lock);
+	while (h->readerc) {
+		xdelta_reader_close(h->readers[--h->readerc]);
+	}
+	pthread_mutex_unlock(&h->readers_lock);
+}
+
+/*
+ * Take the lock of h shared, looking the parent up again first if links
+ * changed since the handle last did
+ */
+static void defs_handle_lock(defs_handle_t *h)
+{
+	unsigned int gen = sql_generation();
+
+	pthread_rwlock_rdlock(&h->lock);
+	if (h->meta_gen == gen) {
+		return;
+	}
+	pthread_rwlock_unlock(&h->lock);
+
+	pthread_rwlock_wrlock(&h->lock);
+	if (h->meta_gen != gen) {
+		free(h->parent);
+		h->parent = NULL;
+		sql_get_parent(h->key, &h->parent);
+
+		defs_handle_drop_readers(h);
+		dirty_close(h->dirty);
+		h->dirty = NULL;
+		if (h->parent && dirty_enabled()) {
+			h->dirty = dirty_open(h->key, h->parent);
+		}
+		h->meta_gen = gen;
+	}
+	pthread_rwlock_unlock(&h->lock);
+	pthread_rwlock_rdlock(&h->lock);
+}
+
+/*
+ * Returns an idle reader of the child h, or a new one, NULL on error
+ * setting errno.  The lock of h must be held.
+ */
+static xdelta_reader_t *defs_handle_reader(defs_handle_t *h)
+{
+	xdelta_reader_t *rd = NULL;
+
+	pthread_mutex_lock(&h->readers_lock);
+	if (h->readerc) {
+		rd = h->readers[--h->readerc];
+	}
+	pthread_mutex_unlock(&h->readers_lock);
+	if (!rd) {
+		rd = xdelta_reader_open(h->key, h->parent);
+	}
+	return rd;
+}
+
+/*
+ * Give rd back to h once a read is done with it
+ */
+static void defs_handle_put_reader(defs_handle_t *h, xdelta_reader_t *rd)
+{
+	pthread_mutex_lock(&h->readers_lock);
+	if (h->readerc < DEFS_READERS) {
+		h->readers[h->readerc++] = rd;
+		rd = NULL;
+	}
+	pthread_mutex_unlock(&h->readers_lock);
+	xdelta_reader_close(rd);
+}
+
 static int defs_open(const char *path, struct fuse_file_info *fi)
 {
-	int res;
-  
-	char *fixed_path = defs_fix_path(path);
+	defs_handle_t *h;
+	char *fixed_path;
+	struct stat st;
 
-	res = open(fixed_path, fi->flags);
-	if (res == -1) {
+	h = calloc(1, sizeof(defs_handle_t));
+	if (!h) {
+		return -ENOMEM;
+	}
+	fixed_path = defs_fix_path(path);
+
+	/* Writes go through pwrite at the offset FUSE gives us */
+	h->fd = open(fixed_path, fi->flags & ~O_APPEND);
+	if (h->fd == -1) {
 		free(fixed_path);
+		free(h);
 		return -errno;
 	}
-  
-	close(res);
-	free(fixed_path);
+
+	/* The inode can't change under the handle, and neither can its key */
+	if (fstat(h->fd, &st) == 0) {
+		h->key = defs_key(&st);
+	}
+	if (h->key) {
+		free(fixed_path);
+	} else {
+		h->key = fixed_path;
+	}
+
+	pthread_rwlock_init(&h->lock, NULL);
+	pthread_mutex_init(&h->readers_lock, NULL);
+	h->meta_gen = sql_generation();
+	sql_get_parent(h->key, &h->parent);
+	if (h->parent && dirty_enabled()) {
+		h->dirty = dirty_open(h->key, h->parent);
+	}
+
+	fi->fh = (uint64_t) (uintptr_t) h;
 	return 0;
 }
 
 static int defs_read(const char *path, char *buf, size_t size, off_t offset,
 		     struct fuse_file_info *fi)
 {
-	int fd;
+	defs_handle_t *h = (defs_handle_t *) (uintptr_t) fi->fh;
+	xdelta_reader_t *rd;
 	int res;
 
-	char *fixed_path = defs_fix_path(path);
-	char* parent = NULL;
-	sql_get_parent(fixed_path, &parent);
+	(void) path;
 
-	(void) fi;
-	fd = open(fixed_path, O_RDONLY);
-	if (fd == -1) {
-		free(fixed_path);
-		return -errno;
-	}
+	defs_handle_lock(h);
 
-	if (parent) {
-		res = xdelta_read(fixed_path, parent, size, offset, buf);
-		free(parent);
+	if (h->parent) {
+		rd = defs_handle_reader(h);
+		if (!rd) {
+			res = -errno;
+		} else {
+			if (h->dirty) {
+				res = dirty_read(h->dirty, rd, buf, size, offset);
+			} else {
+				res = xdelta_reader_read(rd, size, offset, buf);
+			}
+			defs_handle_put_reader(h, rd);
+		}
 	}
 	else {
-		res = pread(fd, buf, size, offset);
+		res = pread(h->fd, buf, size, offset);
 		if (res == -1) {
 			res = -errno;
 		}
 	}
 
-	close(fd);
-	free(fixed_path);
+	pthread_rwlock_unlock(&h->lock);
 	return res;
 }
 
 static int defs_write(const char *path, const char *buf, size_t size,
 		      off_t offset, struct fuse_file_info *fi)
 {
-	int fd;
+	defs_handle_t *h = (defs_handle_t *) (uintptr_t) fi->fh;
 	int res;
 
-	char *fixed_path = defs_fix_path(path);
+	(void) path;
 
-	(void) fi;
-	fd = open(fixed_path, O_RDWR);
-	if (fd == -1) {
-		free(fixed_path);
-		return -errno;
-	}
-    
-	int childc;
-	char **childv;
-	int i;
-	char *parent = NULL;
-  
-	sql_get_parent(fixed_path, &parent);
-	sql_get_children(fixed_path, &childc, &childv);
-	printf("Has %d children\n", childc);
-	for (i = 0; i < childc; ++i) {
-		printf("Child %d - %s", i, childv[i]);
-	}
-	printf("Parent %s\n", parent);
-	fflush(NULL);
-  
-	if (parent) { /* child */
-		res = xdelta_write(fixed_path, buf, size, offset, childc, childv, parent);
-		free(parent);
+	defs_handle_lock(h);
+
+	if (h->parent) { /* child */
+		/* Only one level of links, so a child has no children */
+		if (h->dirty) {
+			res = dirty_write(h->dirty, buf, size, offset);
+		} else {
+			res = xdelta_write(h->key, buf, size, offset, h->parent);
+		}
 	}
-	else if (childc != 0) { /* parent */
-		res = xdelta_write(fixed_path, buf, size, offset, childc, childv, parent);
+	else if (sql_has_children(h->key)) { /* parent */
+		defs_flush_children(h->key);
+		res = xdelta_write(h->key, buf, size, offset, NULL);
 	}
 	else { /* neither */
-		res = pwrite(fd, buf, size, offset);
+		res = pwrite(h->fd, buf, size, offset);
 		if (res == -1) {
 			res = -errno;
 		}
 	}
 
-	for (i = 0; i < childc; ++i) {
-		free(childv[i]);
-	}
-	free(childv);
-
-	close(fd);
-	free(fixed_path);
+	pthread_rwlock_unlock(&h->lock);
 	return res;
 }
 
@@ -567,32 +1104,39 @@ static int defs_statfs(const char *path, struct statvfs *stbuf)
 
 static int defs_release(const char *path, struct fuse_file_info *fi)
 {
-	/* Just a stub. This method is optional and can safely be left
-	   unimplemented */
-  
-	char *fixed_path = defs_fix_path(path);
-
-	(void) fixed_path;
-	(void) fi;
-  
-	free(fixed_path);
+	defs_handle_t *h = (defs_handle_t *) (uintptr_t) fi->fh;
+
+	(void) path;
+
+	dirty_close(h->dirty);
+	defs_handle_drop_readers(h);
+	close(h->fd);
+	free(h->parent);
+	free(h->key);
+	pthread_mutex_destroy(&h->readers_lock);
+	pthread_rwlock_destroy(&h->lock);
+	free(h);
 	return 0;
 }
 
 static int defs_fsync(const char *path, int isdatasync,
 		      struct fuse_file_info *fi)
 {
-	/* Just a stub. This method is optional and can safely be left
-	   unimplemented */
-  
-	char *fixed_path = defs_fix_path(path);
+	defs_handle_t *h = (defs_handle_t *) (uintptr_t) fi->fh;
+	int r;
 
-	(void) fixed_path;
+	(void) path;
 	(void) isdatasync;
-	(void) fi;
 
-	free(fixed_path);
-	return 0;
+	/* Buffered child writes are safe once journaled */
+	pthread_rwlock_rdlock(&h->lock);
+	r = h->dirty ? dirty_sync(h->dirty) : 0;
+	pthread_rwlock_unlock(&h->lock);
+	if (r) {
+		return r;
+	}
+	/* and the links they go with once written back */
+	return sql_sync();
 }
 
 #ifdef HAVE_SETXATTR
@@ -657,6 +1201,8 @@ static int defs_removexattr(const char *path, const char *name)
 #endif /* HAVE_SETXATTR */
 
 static struct fuse_operations defs_oper = {
+	.init		= defs_init,
+	.destroy	= defs_destroy,
 	.getattr	= defs_getattr,
 	.access 	= defs_access,
 	.readlink	= defs_readlink,
@@ -689,6 +1235,10 @@ static struct fuse_operations defs_oper = {
 int main(int argc, char *argv[])
 {
 	int rc;
+	uint64_t hits, misses, windows;
+	uint64_t writes, flushes;
+	uint64_t lock_hist[ILOCK_HIST_BUCKETS];
+	int i;
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	dopt_init();
@@ -706,9 +1256,49 @@ int main(int argc, char *argv[])
 	}
 
 	rc = sql_init_db();
+
+	wcache_init((size_t) dopt.cache_size << 20);
+	bcache_init((size_t) dopt.srccache_size << 20);
+	arena_init((size_t) dopt.buffer_mem << 20);
   
 	umask(0); /* change to fix permissions */
 	rc = fuse_main(args.argc, args.argv, &defs_oper, NULL);
+
+	wcache_stats(&hits, &misses);
+	printf("Window cache: %llu hits, %llu misses\n",
+	       (unsigned long long) hits, (unsigned long long) misses);
+	bcache_stats(&hits, &misses);
+	printf("Parent block cache: %llu hits, %llu misses\n",
+	       (unsigned long long) hits, (unsigned long long) misses);
+	readahead_stats(&hits, &misses, &windows);
+	printf("Read-ahead: %llu hits, %llu misses, %llu windows decoded ahead\n",
+	       (unsigned long long) hits, (unsigned long long) misses,
+	       (unsigned long long) windows);
+	dirty_stats(&writes, &flushes);
+	printf("Write buffer: %llu writes, %llu flushes\n",
+	       (unsigned long long) writes, (unsigned long long) flushes);
+	sql_stats(&writes, &flushes);
+	printf("Metadata: %llu changes in %llu commits\n",
+	       (unsigned long long) writes, (unsigned long long) flushes);
+	acache_stats(&hits, &misses);
+	printf("Attribute cache: %llu hits, %llu misses\n",
+	       (unsigned long long) hits, (unsigned long long) misses);
+	arena_stats(&hits, &misses);
+	printf("Stream buffers: %llu reused, %llu allocated\n",
+	       (unsigned long long) hits, (unsigned long long) misses);
+	ilock_stats(lock_hist);
+	printf("Lock waits:");
+	for (i = 0; i < ILOCK_HIST_BUCKETS; ++i) {
+		if (lock_hist[i]) {
+			printf(" %s%lluus %llu", i == ILOCK_HIST_BUCKETS - 1 ? ">=" : "<",
+			       1ULL << (i == ILOCK_HIST_BUCKETS - 1 ? i - 1 : i),
+			       (unsigned long long) lock_hist[i]);
+		}
+	}
+	printf("\n");
+	wcache_destroy();
+	bcache_destroy();
+	arena_destroy();
 	sql_close();
 	return rc;
 }
@@ -0,0 +1,1084 @@
+/*
+ * dirty.c implements buffered child writes as defined in dirty.h
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "dirty.h"
+#include "sql.h"
+
+#define DIRTY_JOURNAL_MAGIC "DEFSJNL1"
+
+/*
+ * A journal starts with this header and the child and parent paths
+ * (without terminators), then one record per buffered write
+ */
+typedef struct {
+	char magic[8];
+	uint32_t file_len;
+	uint32_t parent_len;
+} dirty_jhdr_t;
+
+typedef struct {
+	uint64_t off;
+	uint32_t len;
+	uint32_t sum;                /* of off, len and the data */
+} dirty_jrec_t;
+
+/*
+ * Extents never overlap and sit in an AVL tree by offset, so a write
+ * finds its neighbours in O(log n) however scattered the writes are
+ */
+typedef struct dirty_extent {
+	off_t off;
+	size_t len;
+	size_t alloc;
+	char *data;
+	struct dirty_extent *left;
+	struct dirty_extent *right;
+	struct dirty_extent *up;
+	int height;
+} dirty_extent_t;
+
+struct dirty {
+	dev_t dev;
+	ino_t ino;
+	char *file;                  /* NULL once unlinked */
+	char *parent;
+	pthread_mutex_t lock;        /* extents and size, and the delta while flushing */
+	dirty_extent_t *extents;     /* root of the tree */
+	uint64_t gen;                /* bumped whenever the delta is written */
+	size_t bytes;
+	off_t size;                  /* size of the child with the extents applied */
+	time_t mtime;                /* last buffered write */
+	time_t since;                /* first buffered write */
+	int jfd;                     /* journal, -1 until the first write */
+	char *jpath;
+	off_t jsize;
+	int refs;                    /* handles, and anyone flushing it */
+	struct dirty *next;
+};
+
+static struct {
+	pthread_mutex_t lock;        /* the list, refs and bytes */
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int stop;
+	dirty_t *head;
+	size_t bytes;
+	size_t limit;
+	int timeout;
+	char *jdir;                  /* NULL without journals */
+	uint64_t writes;
+	uint64_t flushes;
+} dt = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+
+static uint32_t dirty_sum(const dirty_jrec_t *rec, const char *data)
+{
+	/* FNV-1a, enough to spot a record torn by a crash */
+	uint32_t h = 2166136261U;
+	uint32_t i;
+
+	for (i = 0; i < sizeof(rec->off); ++i) {
+		h = (h ^ ((rec->off >> (8 * i)) & 0xff)) * 16777619U;
+	}
+	for (i = 0; i < sizeof(rec->len); ++i) {
+		h = (h ^ ((rec->len >> (8 * i)) & 0xff)) * 16777619U;
+	}
+	for (i = 0; i < rec->len; ++i) {
+		h = (h ^ (unsigned char) data[i]) * 16777619U;
+	}
+	return h;
+}
+
+static void dirty_replay(const char *path);
+
+/*
+ * Set the path of the journal of d, named after its inode
+ */
+static int dirty_journal_path(dirty_t *d)
+{
+	if (!d->jpath) {
+		d->jpath = malloc(strlen(dt.jdir) + 64);
+		if (!d->jpath) {
+			return -ENOMEM;
+		}
+		sprintf(d->jpath, "%s/%llu.%llu", dt.jdir,
+			(unsigned long long) d->dev, (unsigned long long) d->ino);
+	}
+	return 0;
+}
+
+/*
+ * Append a write to the journal of d, creating it with the first one.  A
+ * journal already there holds writes nothing else has, so it is replayed
+ * first, and never overwritten if that fails.
+ */
+static int dirty_journal_append(dirty_t *d, const char *buf, size_t size, off_t offset)
+{
+	dirty_jhdr_t hdr;
+	dirty_jrec_t rec;
+	struct iovec iov[3];
+	ssize_t r;
+
+	if (!dt.jdir) {
+		return 0;
+	}
+
+	if (d->jfd == -1) {
+		r = dirty_journal_path(d);
+		if (r) {
+			return r;
+		}
+		d->jfd = open(d->jpath, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+		if (d->jfd == -1 && errno == EEXIST) {
+			dirty_replay(d->jpath);
+			d->jfd = open(d->jpath, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+		}
+		if (d->jfd == -1) {
+			return errno == EEXIST ? -EIO : -errno;
+		}
+
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, DIRTY_JOURNAL_MAGIC, sizeof(hdr.magic));
+		hdr.file_len = strlen(d->file);
+		hdr.parent_len = strlen(d->parent);
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = d->file;
+		iov[1].iov_len = hdr.file_len;
+		iov[2].iov_base = d->parent;
+		iov[2].iov_len = hdr.parent_len;
+		r = writev(d->jfd, iov, 3);
+		if (r != (ssize_t) (sizeof(hdr) + hdr.file_len + hdr.parent_len)) {
+			return r == -1 ? -errno : -EIO;
+		}
+		d->jsize = r;
+	}
+
+	rec.off = offset;
+	rec.len = size;
+	rec.sum = dirty_sum(&rec, buf);
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *) buf;
+	iov[1].iov_len = size;
+	r = writev(d->jfd, iov, 2);
+	if (r != (ssize_t) (sizeof(rec) + size)) {
+		return r == -1 ? -errno : -EIO;
+	}
+	d->jsize += r;
+	return 0;
+}
+
+/*
+ * Sync the delta of d, which now holds what its journal did
+ * Returns 0 on success, otherwise -errno
+ */
+static int dirty_delta_sync(dirty_t *d)
+{
+	int fd, r = 0;
+
+	fd = open(d->file, O_RDONLY);
+	if (fd == -1) {
+		return -errno;
+	}
+	if (fsync(fd)) {
+		r = -errno;
+	}
+	close(fd);
+	return r;
+}
+
+/*
+ * Remove the journal of d once everything in it is in the delta
+ */
+static void dirty_journal_drop(dirty_t *d)
+{
+	if (d->jfd != -1) {
+		close(d->jfd);
+		d->jfd = -1;
+	}
+	if (d->jpath) {
+		unlink(d->jpath);
+	}
+	d->jsize = 0;
+}
+
+
+static dirty_t *dirty_lookup(dev_t dev, ino_t ino)
+{
+	dirty_t *d;
+
+	for (d = dt.head; d; d = d->next) {
+		if (d->dev == dev && d->ino == ino) {
+			return d;
+		}
+	}
+	return NULL;
+}
+
+static int dirty_height(const dirty_extent_t *e)
+{
+	return e ? e->height : 0;
+}
+
+static void dirty_update(dirty_extent_t *e)
+{
+	int l = dirty_height(e->left), r = dirty_height(e->right);
+
+	e->height = 1 + (l > r ? l : r);
+}
+
+/*
+ * Put e where old hangs below up, or at the root
+ */
+static void dirty_replace(dirty_t *d, dirty_extent_t *up, dirty_extent_t *old, dirty_extent_t *e)
+{
+	if (!up) {
+		d->extents = e;
+	} else if (up->left == old) {
+		up->left = e;
+	} else {
+		up->right = e;
+	}
+	if (e) {
+		e->up = up;
+	}
+}
+
+static dirty_extent_t *dirty_rotate_left(dirty_t *d, dirty_extent_t *x)
+{
+	dirty_extent_t *y = x->right;
+
+	x->right = y->left;
+	if (y->left) {
+		y->left->up = x;
+	}
+	dirty_replace(d, x->up, x, y);
+	y->left = x;
+	x->up = y;
+	dirty_update(x);
+	dirty_update(y);
+	return y;
+}
+
+static dirty_extent_t *dirty_rotate_right(dirty_t *d, dirty_extent_t *x)
+{
+	dirty_extent_t *y = x->left;
+
+	x->left = y->right;
+	if (y->right) {
+		y->right->up = x;
+	}
+	dirty_replace(d, x->up, x, y);
+	y->right = x;
+	x->up = y;
+	dirty_update(x);
+	dirty_update(y);
+	return y;
+}
+
+/*
+ * Restore the balance from e up to the root after e's subtree changed
+ */
+static void dirty_rebalance(dirty_t *d, dirty_extent_t *e)
+{
+	int bal;
+
+	for (; e; e = e->up) {
+		dirty_update(e);
+		bal = dirty_height(e->left) - dirty_height(e->right);
+		if (bal > 1) {
+			if (dirty_height(e->left->left) < dirty_height(e->left->right)) {
+				dirty_rotate_left(d, e->left);
+			}
+			e = dirty_rotate_right(d, e);
+		} else if (bal < -1) {
+			if (dirty_height(e->right->right) < dirty_height(e->right->left)) {
+				dirty_rotate_right(d, e->right);
+			}
+			e = dirty_rotate_left(d, e);
+		}
+	}
+}
+
+static void dirty_tree_insert(dirty_t *d, dirty_extent_t *e)
+{
+	dirty_extent_t **p = &d->extents, *up = NULL;
+
+	while (*p) {
+		up = *p;
+		p = e->off < up->off ? &up->left : &up->right;
+	}
+	e->left = e->right = NULL;
+	e->up = up;
+	e->height = 1;
+	*p = e;
+	dirty_rebalance(d, up);
+}
+
+static void dirty_tree_remove(dirty_t *d, dirty_extent_t *e)
+{
+	dirty_extent_t *s, *from;
+
+	if (e->left && e->right) {
+		/* Its successor takes its place */
+		for (s = e->right; s->left; s = s->left)
+			;
+		if (s->up == e) {
+			from = s;
+		} else {
+			from = s->up;
+			dirty_replace(d, s->up, s, s->right);
+			s->right = e->right;
+			s->right->up = s;
+		}
+		s->left = e->left;
+		s->left->up = s;
+		dirty_replace(d, e->up, e, s);
+		dirty_rebalance(d, from);
+	} else {
+		from = e->up;
+		dirty_replace(d, e->up, e, e->left ? e->left : e->right);
+		dirty_rebalance(d, from);
+	}
+}
+
+static dirty_extent_t *dirty_first(const dirty_t *d)
+{
+	dirty_extent_t *e = d->extents;
+
+	while (e && e->left) {
+		e = e->left;
+	}
+	return e;
+}
+
+static dirty_extent_t *dirty_next(dirty_extent_t *e)
+{
+	if (e->right) {
+		for (e = e->right; e->left; e = e->left)
+			;
+		return e;
+	}
+	while (e->up && e->up->right == e) {
+		e = e->up;
+	}
+	return e->up;
+}
+
+/*
+ * Returns the first extent ending at or after off, NULL if there is none
+ */
+static dirty_extent_t *dirty_find(const dirty_t *d, off_t off)
+{
+	dirty_extent_t *e = d->extents, *last = NULL;
+
+	/* The last one starting at or before off, if it reaches off */
+	while (e) {
+		if (e->off <= off) {
+			last = e;
+			e = e->right;
+		} else {
+			e = e->left;
+		}
+	}
+	if (last && last->off + (off_t) last->len >= off) {
+		return last;
+	}
+	return last ? dirty_next(last) : dirty_first(d);
+}
+
+
+/*
+ * Take a reference on the entry of the file at path, if there is one
+ */
+static dirty_t *dirty_get(const char *file)
+{
+	struct stat statbuf;
+	dirty_t *d;
+
+	if (stat(file, &statbuf)) {
+		return NULL;
+	}
+	pthread_mutex_lock(&dt.lock);
+	d = dirty_lookup(statbuf.st_dev, statbuf.st_ino);
+	if (d) {
+		d->refs++;
+	}
+	pthread_mutex_unlock(&dt.lock);
+	return d;
+}
+
+static int dirty_flush_locked(dirty_t *d);
+
+static void dirty_free_tree(dirty_extent_t *e)
+{
+	if (e) {
+		dirty_free_tree(e->left);
+		dirty_free_tree(e->right);
+		free(e->data);
+		free(e);
+	}
+}
+
+static void dirty_free_extents(dirty_t *d)
+{
+	dirty_free_tree(d->extents);
+	d->extents = NULL;
+	pthread_mutex_lock(&dt.lock);
+	dt.bytes -= d->bytes;
+	pthread_mutex_unlock(&dt.lock);
+	d->bytes = 0;
+}
+
+/*
+ * Drop a reference, flushing the entry and freeing it with the last one,
+ * whether that was a handle or not.  Anyone taking a reference meanwhile
+ * gets to drop the last one instead, and writes need d->lock, so nothing
+ * is buffered once the entry is out of the list.
+ */
+static void dirty_put(dirty_t *d)
+{
+	dirty_t **p;
+
+	pthread_mutex_lock(&dt.lock);
+	if (d->refs > 1) {
+		d->refs--;
+		pthread_mutex_unlock(&dt.lock);
+		return;
+	}
+	pthread_mutex_unlock(&dt.lock);
+
+	pthread_mutex_lock(&d->lock);
+	dirty_flush_locked(d);
+	pthread_mutex_lock(&dt.lock);
+	if (--d->refs) {
+		pthread_mutex_unlock(&dt.lock);
+		pthread_mutex_unlock(&d->lock);
+		return;
+	}
+	for (p = &dt.head; *p != d; p = &(*p)->next)
+		;
+	*p = d->next;
+	pthread_mutex_unlock(&dt.lock);
+	pthread_mutex_unlock(&d->lock);
+
+	/* Extents a failed flush left are in the journal, for the next open */
+	dirty_free_extents(d);
+	if (d->jfd != -1) {
+		close(d->jfd);
+	}
+	pthread_mutex_destroy(&d->lock);
+	free(d->jpath);
+	free(d->file);
+	free(d->parent);
+	free(d);
+}
+
+/*
+ * Merge [offset, offset+size) into the extents, with d->lock held
+ */
+static int dirty_insert(dirty_t *d, const char *buf, size_t size, off_t offset)
+{
+	dirty_extent_t *e, *first, *next;
+	off_t lo = offset, hi = offset + size;
+	size_t old = 0, alloc;
+	char *data;
+
+	/* Find the extents overlapping or touching the write */
+	first = dirty_find(d, lo);
+	for (e = first; e && e->off <= hi; e = dirty_next(e)) {
+		if (e->off < lo) {
+			lo = e->off;
+		}
+		if (e->off + (off_t) e->len > hi) {
+			hi = e->off + e->len;
+		}
+	}
+
+	next = first ? dirty_next(first) : NULL;
+	if (first && first->off == lo && (!next || next->off > hi)) {
+		/* Only one extent, grow it in place, which is what sequential writes do */
+		if ((size_t) (hi - lo) > first->alloc) {
+			alloc = 2 * (hi - lo);
+			data = realloc(first->data, alloc);
+			if (!data) {
+				return -ENOMEM;
+			}
+			first->data = data;
+			first->alloc = alloc;
+		}
+		old = first->len;
+		memcpy(first->data + (offset - lo), buf, size);
+		first->len = hi - lo;
+	} else {
+		e = calloc(1, sizeof(dirty_extent_t));
+		data = malloc(hi - lo ? hi - lo : 1);
+		if (!e || !data) {
+			free(e);
+			free(data);
+			return -ENOMEM;
+		}
+		/* Copy the extents being merged, then the write over them */
+		for (; first && first->off <= hi; first = next) {
+			next = dirty_next(first);
+			memcpy(data + (first->off - lo), first->data, first->len);
+			old += first->len;
+			dirty_tree_remove(d, first);
+			free(first->data);
+			free(first);
+		}
+		memcpy(data + (offset - lo), buf, size);
+		e->off = lo;
+		e->len = e->alloc = hi - lo;
+		e->data = data;
+		dirty_tree_insert(d, e);
+	}
+
+	d->bytes += (hi - lo) - old;
+	pthread_mutex_lock(&dt.lock);
+	dt.bytes += (hi - lo) - old;
+	dt.writes++;
+	pthread_mutex_unlock(&dt.lock);
+	return 0;
+}
+
+/*
+ * Encode the extents into the delta, with d->lock held
+ */
+static int dirty_flush_locked(dirty_t *d)
+{
+	dirty_extent_t *e;
+	int r = 0;
+
+	if (!d->extents) {
+		return 0;
+	}
+	if (!d->file || !d->parent) {
+		/* Unlinked or no longer a child, nothing to write to */
+		dirty_free_extents(d);
+		dirty_journal_drop(d);
+		return 0;
+	}
+
+	d->gen++;
+	while ((e = dirty_first(d)) != NULL) {
+		r = xdelta_write(d->file, e->data, e->len, e->off, d->parent);
+		if (r < 0) {
+			break;
+		}
+		r = 0;
+		dirty_tree_remove(d, e);
+		pthread_mutex_lock(&dt.lock);
+		dt.bytes -= e->len;
+		pthread_mutex_unlock(&dt.lock);
+		d->bytes -= e->len;
+		free(e->data);
+		free(e);
+	}
+	if (!d->extents && d->jfd != -1) {
+		/* The journal may have been synced, so the delta has to be before it goes */
+		r = dirty_delta_sync(d);
+		if (!r) {
+			dirty_journal_drop(d);
+		}
+	}
+
+	pthread_mutex_lock(&dt.lock);
+	dt.flushes++;
+	pthread_mutex_unlock(&dt.lock);
+	return r;
+}
+
+/*
+ * Compact journals into their deltas: children idle for longer than the
+ * timeout, buffering for much longer than that, or whose journal grew
+ * past the limit
+ */
+static void *dirty_worker(void *arg)
+{
+	struct timespec ts;
+	dirty_t *d, *next;
+	time_t now;
+	size_t limit;
+	int timeout;
+
+	(void) arg;
+
+	pthread_mutex_lock(&dt.lock);
+	while (!dt.stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&dt.cond, &dt.lock, &ts);
+		if (dt.stop) {
+			break;
+		}
+
+		/*
+		 * One at a time, by d->lock as writes change what is checked.
+		 * A reference keeps each in the list while the list lock is
+		 * dropped, so its next one is still there after.
+		 */
+		limit = dt.limit;
+		timeout = dt.timeout;
+		d = dt.head;
+		if (d) {
+			d->refs++;
+		}
+		while (d) {
+			pthread_mutex_unlock(&dt.lock);
+			now = time(NULL);
+			pthread_mutex_lock(&d->lock);
+			if (d->bytes && (now - d->mtime >= timeout ||
+					 now - d->since >= 4 * timeout ||
+					 (size_t) d->jsize > limit)) {
+				dirty_flush_locked(d);
+			}
+			pthread_mutex_unlock(&d->lock);
+
+			pthread_mutex_lock(&dt.lock);
+			next = dt.stop ? NULL : d->next;
+			if (next) {
+				next->refs++;
+			}
+			pthread_mutex_unlock(&dt.lock);
+			dirty_put(d);
+			pthread_mutex_lock(&dt.lock);
+			d = next;
+		}
+	}
+	pthread_mutex_unlock(&dt.lock);
+	return NULL;
+}
+
+
+/*
+ * Encode the records of one journal left behind by a crash and remove it.
+ * Journals of children that are gone or were re-parented are dropped, and
+ * replay stops at the first torn or corrupt record.
+ */
+static void dirty_replay(const char *path)
+{
+	dirty_jhdr_t hdr;
+	dirty_jrec_t rec;
+	dirty_t d;
+	struct stat statbuf;
+	char *parent = NULL;
+	char *data;
+	int fd, keep = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return;
+	}
+
+	memset(&d, 0, sizeof(d));
+	d.jfd = -1;
+	pthread_mutex_init(&d.lock, NULL);
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, DIRTY_JOURNAL_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.file_len >= PATH_MAX || hdr.parent_len >= PATH_MAX) {
+		goto out;
+	}
+	d.file = calloc(1, hdr.file_len + 1);
+	d.parent = calloc(1, hdr.parent_len + 1);
+	if (!d.file || !d.parent ||
+	    read(fd, d.file, hdr.file_len) != (ssize_t) hdr.file_len ||
+	    read(fd, d.parent, hdr.parent_len) != (ssize_t) hdr.parent_len) {
+		goto out;
+	}
+	if (stat(d.file, &statbuf) || sql_get_parent(d.file, &parent) ||
+	    !parent || strcmp(parent, d.parent)) {
+		fprintf(stderr, "dropping journal %s of %s\n", path, d.file);
+		goto out;
+	}
+	d.dev = statbuf.st_dev;
+	d.ino = statbuf.st_ino;
+	d.size = sql_get_size(d.file);
+
+	while (read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+		data = malloc(rec.len ? rec.len : 1);
+		if (!data) {
+			break;
+		}
+		if (read(fd, data, rec.len) != (ssize_t) rec.len ||
+		    dirty_sum(&rec, data) != rec.sum ||
+		    dirty_insert(&d, data, rec.len, rec.off)) {
+			free(data);
+			break;
+		}
+		if ((off_t) (rec.off + rec.len) > d.size) {
+			d.size = rec.off + rec.len;
+		}
+		free(data);
+	}
+	if (d.extents && (dirty_flush_locked(&d) || dirty_delta_sync(&d))) {
+		/* Leave it for the next mount rather than lose the writes */
+		fprintf(stderr, "could not replay journal %s of %s\n", path, d.file);
+		keep = 1;
+	}
+
+out:
+	close(fd);
+	if (!keep) {
+		unlink(path);
+	}
+	dirty_free_extents(&d);
+	pthread_mutex_destroy(&d.lock);
+	free(parent);
+	free(d.file);
+	free(d.parent);
+}
+
+int dirty_init(size_t limit, int timeout, const char *jdir)
+{
+	struct dirent *ent;
+	DIR *dir;
+	char *path;
+	int r = 0;
+
+	if (jdir && limit) {
+		dt.jdir = strdup(jdir);
+		dir = opendir(jdir);
+		while (dir && (ent = readdir(dir)) != NULL) {
+			if (ent->d_name[0] == '.') {
+				continue;
+			}
+			path = malloc(strlen(jdir) + strlen(ent->d_name) + 2);
+			if (path) {
+				sprintf(path, "%s/%s", jdir, ent->d_name);
+				dirty_replay(path);
+				free(path);
+			}
+		}
+		if (dir) {
+			closedir(dir);
+		}
+	}
+
+	pthread_mutex_lock(&dt.lock);
+	dt.limit = limit;
+	dt.timeout = timeout;
+	dt.stop = 0;
+	if (limit && timeout > 0) {
+		r = pthread_create(&dt.thread, NULL, dirty_worker, NULL);
+		dt.running = !r;
+	}
+	pthread_mutex_unlock(&dt.lock);
+	return -r;
+}
+
+void dirty_destroy()
+{
+	dirty_t *d;
+
+	pthread_mutex_lock(&dt.lock);
+	if (dt.running) {
+		dt.stop = 1;
+		pthread_cond_signal(&dt.cond);
+		pthread_mutex_unlock(&dt.lock);
+		pthread_join(dt.thread, NULL);
+		pthread_mutex_lock(&dt.lock);
+		dt.running = 0;
+	}
+
+	/* Handles still open at unmount don't get a release */
+	while ((d = dt.head) != NULL) {
+		d->refs = 1;
+		pthread_mutex_unlock(&dt.lock);
+		dirty_put(d);
+		pthread_mutex_lock(&dt.lock);
+	}
+	free(dt.jdir);
+	dt.jdir = NULL;
+	pthread_mutex_unlock(&dt.lock);
+}
+
+int dirty_enabled()
+{
+	int on;
+
+	pthread_mutex_lock(&dt.lock);
+	on = dt.limit != 0;
+	pthread_mutex_unlock(&dt.lock);
+	return on;
+}
+
+dirty_t *dirty_open(const char *file, const char *parent)
+{
+	struct stat statbuf;
+	dirty_t *d, *n;
+	char *f, *p;
+
+	if (stat(file, &statbuf)) {
+		return NULL;
+	}
+	f = strdup(file);
+	p = strdup(parent);
+	n = calloc(1, sizeof(dirty_t));
+	if (!f || !p || !n) {
+		free(f);
+		free(p);
+		free(n);
+		errno = ENOMEM;
+		return NULL;
+	}
+	n->dev = statbuf.st_dev;
+	n->ino = statbuf.st_ino;
+	n->jfd = -1;
+	n->refs = 1;
+	pthread_mutex_init(&n->lock, NULL);
+	/* Locked before it is in the list, as d->lock comes before dt.lock */
+	pthread_mutex_lock(&n->lock);
+
+	pthread_mutex_lock(&dt.lock);
+	d = dirty_lookup(statbuf.st_dev, statbuf.st_ino);
+	if (d) {
+		d->refs++;
+		pthread_mutex_unlock(&dt.lock);
+		pthread_mutex_unlock(&n->lock);
+		pthread_mutex_destroy(&n->lock);
+		free(n);
+
+		/* The newest open knows the current name and parent */
+		pthread_mutex_lock(&d->lock);
+		free(d->file);
+		free(d->parent);
+		d->file = f;
+		d->parent = p;
+		pthread_mutex_unlock(&d->lock);
+		return d;
+	}
+
+	d = n;
+	d->file = f;
+	d->parent = p;
+	d->next = dt.head;
+	dt.head = d;
+	pthread_mutex_unlock(&dt.lock);
+
+	/*
+	 * A journal of the inode that outlived its last entry holds writes
+	 * nothing else has: encode them before any new ones, as mount does
+	 */
+	if (dt.jdir && !dirty_journal_path(d) && access(d->jpath, F_OK) == 0) {
+		dirty_replay(d->jpath);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return d;
+}
+
+void dirty_close(dirty_t *d)
+{
+	if (d) {
+		dirty_put(d);
+	}
+}
+
+int dirty_write(dirty_t *d, const char *buf, size_t size, off_t offset)
+{
+	int r, over;
+
+	pthread_mutex_lock(&d->lock);
+	if (!d->file) {
+		/* Unlinked under an open handle */
+		pthread_mutex_unlock(&d->lock);
+		return -ENOENT;
+	}
+	if (!dt.limit) {
+		d->gen++;
+		r = xdelta_write(d->file, buf, size, offset, d->parent);
+		pthread_mutex_unlock(&d->lock);
+		return r;
+	}
+
+	if (!d->extents) {
+		/* Start from the size the delta has now */
+		d->size = sql_get_size(d->file);
+		d->since = time(NULL);
+	}
+
+	/* Journal it first, a dirty_sync after this makes it survive a crash */
+	r = dirty_journal_append(d, buf, size, offset);
+	if (!r) {
+		r = dirty_insert(d, buf, size, offset);
+	}
+	if (r) {
+		pthread_mutex_unlock(&d->lock);
+		return r;
+	}
+	if (offset + (off_t) size > d->size) {
+		d->size = offset + size;
+	}
+	d->mtime = time(NULL);
+
+	pthread_mutex_lock(&dt.lock);
+	over = dt.bytes > dt.limit;
+	pthread_mutex_unlock(&dt.lock);
+	if (over) {
+		r = dirty_flush_locked(d);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return r ? r : (int) size;
+}
+
+int dirty_read(dirty_t *d, xdelta_reader_t *rd, char *buf, size_t size, off_t offset)
+{
+	dirty_extent_t *e;
+	off_t end, lo, hi;
+	uint64_t gen;
+	int res;
+
+	/*
+	 * Decode without the lock, so reads don't wait for each other, and
+	 * again if the extents were flushed into the delta meanwhile
+	 */
+	pthread_mutex_lock(&d->lock);
+	do {
+		gen = d->gen;
+		pthread_mutex_unlock(&d->lock);
+		res = xdelta_reader_read(rd, size, offset, buf);
+		pthread_mutex_lock(&d->lock);
+	} while (res >= 0 && gen != d->gen);
+	if (res < 0 || !d->extents) {
+		pthread_mutex_unlock(&d->lock);
+		return res;
+	}
+
+	/* Writes past the end of the delta grow the file, zero filling any gap */
+	end = offset + size < d->size ? offset + size : d->size;
+	if (end > offset + res) {
+		memset(buf + res, 0, end - offset - res);
+		res = end - offset;
+	}
+
+	for (e = dirty_find(d, offset); e && e->off < offset + res; e = dirty_next(e)) {
+		lo = e->off > offset ? e->off : offset;
+		hi = e->off + (off_t) e->len < offset + res ? e->off + (off_t) e->len : offset + res;
+		if (lo < hi) {
+			memcpy(buf + (lo - offset), e->data + (lo - e->off), hi - lo);
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	return res;
+}
+
+int dirty_flush(dirty_t *d)
+{
+	int r;
+
+	pthread_mutex_lock(&d->lock);
+	r = dirty_flush_locked(d);
+	pthread_mutex_unlock(&d->lock);
+	return r;
+}
+
+int dirty_sync(dirty_t *d)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->jfd != -1) {
+		if (fdatasync(d->jfd)) {
+			r = -errno;
+		}
+	} else {
+		r = dirty_flush_locked(d);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return r;
+}
+
+int dirty_flush_file(const char *file)
+{
+	dirty_t *d;
+	int r;
+
+	d = dirty_get(file);
+	if (!d) {
+		return 0;
+	}
+	r = dirty_flush(d);
+	dirty_put(d);
+	return r;
+}
+
+void dirty_forget(const char *file)
+{
+	dirty_t *d;
+
+	d = dirty_get(file);
+	if (!d) {
+		return;
+	}
+	pthread_mutex_lock(&d->lock);
+	dirty_free_extents(d);
+	dirty_journal_drop(d);
+	free(d->file);
+	d->file = NULL;
+	pthread_mutex_unlock(&d->lock);
+	dirty_put(d);
+}
+
+int dirty_size(dev_t dev, ino_t ino, off_t *size)
+{
+	dirty_t *d;
+	int res = 0;
+
+	pthread_mutex_lock(&dt.lock);
+	d = dirty_lookup(dev, ino);
+	if (d) {
+		d->refs++;
+	}
+	pthread_mutex_unlock(&dt.lock);
+	if (!d) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	if (d->extents) {
+		*size = d->size;
+		res = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	dirty_put(d);
+	return res;
+}
+
+void dirty_stats(uint64_t *writes, uint64_t *flushes)
+{
+	pthread_mutex_lock(&dt.lock);
+	*writes = dt.writes;
+	*flushes = dt.flushes;
+	pthread_mutex_unlock(&dt.lock);
+}
@@ -0,0 +1,125 @@
+/*
+ * dirty.h defines api for buffering writes to children before encoding
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DIRTY_H
+#define DIRTY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "delta.h"
+
+/*
+ * Writes to a child collect in a per-inode list of dirty extents, merged
+ * as they overlap or touch.  Reads through dirty_read see them laid over
+ * the decoded data.  Each write is also appended to a per-inode journal
+ * before it is acknowledged, so fsync only has to sync the journal.  The
+ * extents are encoded into the delta (with xdelta_write), and the journal
+ * removed, when the last handle is released, when the buffered bytes pass
+ * the limit, or by the background thread once the child has been idle for
+ * the timeout, has buffered for four times as long, or its journal has
+ * grown past the limit.
+ */
+typedef struct dirty dirty_t;
+
+
+/*
+ * Set the limit of buffered bytes and the idle timeout in seconds, replay
+ * the journals a crash left in jdir, and start the thread flushing idle
+ * children.  A limit of 0 writes through, a timeout of 0 only flushes on
+ * release and the limit, a NULL jdir keeps no journals (and fsync then
+ * flushes).
+ * Must be called after FUSE forked into the background.
+ */
+int dirty_init(size_t limit, int timeout, const char *jdir);
+
+/*
+ * Flush everything and stop the thread
+ */
+void dirty_destroy();
+
+/*
+ * Returns 1 if child writes are buffered, 0 if they are written through
+ * and there is no need for dirty_open
+ */
+int dirty_enabled();
+
+/*
+ * Returns the dirty state of the child file decoded against parent,
+ * shared by every handle open on the same inode, NULL on error setting
+ * errno.  A journal the inode still has from an earlier entry is encoded
+ * first.  Drop it with dirty_close.
+ */
+dirty_t *dirty_open(const char *file, const char *parent);
+
+/*
+ * Drop a reference, flushing the child when it was the last one
+ */
+void dirty_close(dirty_t *d);
+
+/*
+ * Buffer a write to the child
+ * Returns bytes written for success, otherwise -errno
+ */
+int dirty_write(dirty_t *d, const char *buf, size_t size, off_t offset);
+
+/*
+ * Read through rd, laying the dirty extents over the result.  The lock of
+ * d is only held for the overlay, not while decoding.
+ * Returns bytes read for success, otherwise -errno
+ */
+int dirty_read(dirty_t *d, xdelta_reader_t *rd, char *buf, size_t size, off_t offset);
+
+/*
+ * Encode the dirty extents into the delta
+ * Returns 0 on success, otherwise -errno
+ */
+int dirty_flush(dirty_t *d);
+
+/*
+ * Make the buffered writes durable: sync the journal, or flush when there
+ * is none
+ * Returns 0 on success, otherwise -errno
+ */
+int dirty_sync(dirty_t *d);
+
+/*
+ * Flush the child at file, if anything of it is buffered.  Done before
+ * anything that rewrites, truncates, renames or re-parents the child.
+ * Returns 0 on success, otherwise -errno
+ */
+int dirty_flush_file(const char *file);
+
+/*
+ * Drop anything buffered for the child at file, which is being unlinked
+ */
+void dirty_forget(const char *file);
+
+/*
+ * Returns 1 and sets size to the size of the child dev/ino including
+ * buffered writes if it has any, 0 otherwise
+ */
+int dirty_size(dev_t dev, ino_t ino, off_t *size);
+
+/*
+ * Returns the number of writes buffered and of flushes done
+ */
+void dirty_stats(uint64_t *writes, uint64_t *flushes);
+
+#endif /* DIRTY_H */
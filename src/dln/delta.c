@@ -31,6 +31,7 @@
 #include "../xdelta/xdelta3.c"
 #include "delta.h"
 #include "../sql.h"
+#include "../windex.h"
 #include "opts.h"
 
 #ifndef DEBUG_MODE1
@@ -71,6 +72,47 @@ char* semaphore_hash (const char* key)
 }
 
 
+/*
+ * Size of the VCDIFF file header the encoder emits in front of window 0.
+ * defs never uses secondary compression or a custom code table.
+ */
+static uint64_t xdelta_hdrsize(xd3_stream *stream)
+{
+	uint64_t size = 5; /* 3 magic bytes, version, header indicator */
+
+	if (stream->enc_appheader) {
+		size += xd3_sizeof_size(stream->enc_appheadsz) + stream->enc_appheadsz;
+	}
+	return size;
+}
+
+
+/*
+ * Record the window the encoder just finished, which was written to the
+ * delta file between win_start and win_end
+ */
+static int xdelta_index_window(xd3_stream *stream, windex_t *idx, uint64_t win_start, uint64_t win_end)
+{
+	uint64_t src_off = 0;
+	uint32_t src_len = 0;
+
+	if (stream->current_window == 0) {
+		/* The file header goes out together with the first window */
+		idx->hdr_len = xdelta_hdrsize(stream);
+		win_start += idx->hdr_len;
+	}
+
+	if (xd3_encoder_used_source(stream)) {
+		src_off = stream->src->srcbase;
+		src_len = stream->src->srclen;
+	}
+
+	return windex_add(idx, stream->total_in - stream->avail_in, stream->avail_in,
+			  win_start, win_end - win_start, src_off, src_len,
+			  adler32(1L, stream->next_in, stream->avail_in));
+}
+
+
 int xdelta_encode (const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* OutFile)
 {
 	int BufSize;
@@ -82,6 +124,8 @@ int xdelta_encode (const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* O
 	void* Input_Buf;
 	int Input_Buf_Read;
 	int r, ret;
+	windex_t idx;
+	uint64_t out_pos, win_start;
 
 	if (dopt.window_abs) {
 		BufSize = dopt.window_abs;
@@ -92,6 +136,9 @@ int xdelta_encode (const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* O
 			return -errno;
 		}
 		BufSize = (int) (statbuf.st_size * dopt.window_rel);
+		if (statbuf.st_size * dopt.window_rel > dopt.window_max) {
+			BufSize = dopt.window_max;
+		}
 	}
 
 	if (BufSize < XD3_ALLOCSIZE) {
@@ -102,7 +149,11 @@ int xdelta_encode (const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* O
 	fflush(NULL);
   
 	memset (&stream, 0, sizeof(stream));
-	memset (&stream, 0, sizeof(source));
+	memset (&source, 0, sizeof(source));
+	windex_init(&idx);
+	idx.winsize = BufSize;
+	out_pos = 0;
+	win_start = 0;
 
 	xd3_init_config(&config, XD3_ADLER32);
 	config.winsize = BufSize;
@@ -115,6 +166,7 @@ int xdelta_encode (const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* O
 			return -errno;
 		}
 		source.size = statbuf.st_size;
+		idx.parent_ino = statbuf.st_ino;
 		source.blksize = BufSize;
 		source.curblk = malloc(source.blksize);
     
@@ -166,6 +218,7 @@ int xdelta_encode (const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* O
 			if (r != (int)stream.avail_out) {
 				return -r;
 			}
+			out_pos += stream.avail_out;
 			xd3_consume_output(&stream);
 			goto process;
       
@@ -187,10 +240,15 @@ int xdelta_encode (const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* O
 
 		case XD3_WINSTART:
 			DEBUG1(printf("DEBUG: XD3_WINSTART\n"));
+			win_start = out_pos;
 			goto process;
     
 		case XD3_WINFINISH:
 			DEBUG1(printf("DEBUG: XD3_WINFINISH\n"));
+			r = xdelta_index_window(&stream, &idx, win_start, out_pos);
+			if (r) {
+				return r;
+			}
 			goto process;
     
 		default:
@@ -198,11 +256,17 @@ int xdelta_encode (const char* OutFileName, FILE* InFile, FILE* SrcFile, FILE* O
 			return -ret;
 		}  
 	} while(Input_Buf_Read == BufSize);
+
+	/* The window index goes right after the VCDIFF data */
+	idx.delta_len = out_pos;
+	r = windex_write(&idx, OutFile);
+	windex_free(&idx);
+	fflush(OutFile);
     
 	free(Input_Buf);
 	free((void*)source.curblk);
 	xd3_close_stream(&stream);
 	xd3_free_stream(&stream);
 
-	return 0;
+	return r;
 }
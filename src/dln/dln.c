@@ -26,10 +26,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
 
 #include "opts.h"
 #include "delta.h"
 #include "../sql.h"
+#include "../windex.h"
 
 #define DLN_TMP ".dlnbak"
 
@@ -42,10 +44,12 @@ static struct option long_options[] = {
         {"output",    required_argument, 0, 'o'},
 	{"windowabs", required_argument, 0, 'a'},
 	{"windowrel", required_argument, 0, 'r'},
+	{"windowmax", required_argument, 0, 'm'},
+	{"rebuild",   required_argument, 0, 'R'},
         {0,           0,                 0,   0}
 };
 
-static const char* short_options = "hVvsSo:a:r:";
+static const char* short_options = "hVvsSo:a:r:m:R:";
 
 /*
  * Take a relative path as argument and return the absolute path by using the
@@ -90,6 +94,229 @@ char *make_absolute(char *relpath)
 }
 
 
+/*
+ * Returns the malloc'ed directory defs pins links in for file, that of the
+ * nearest directory above it with a DEFS_META_DIR on the same filesystem,
+ * NULL if there is none
+ */
+static char *find_ino_dir(const char *file)
+{
+	struct stat st, mst;
+	char *dir, *slash;
+	char *ino_dir = NULL;
+
+	if (stat(file, &st) == -1) {
+		return NULL;
+	}
+	dir = malloc(strlen(file) + strlen(DEFS_META_DIR) + strlen(DEFS_INO_DIR) + 3);
+	if (!dir) {
+		return NULL;
+	}
+	strcpy(dir, file);
+	while ((slash = strrchr(dir, '/')) != NULL) {
+		slash[1] = '\0';
+		strcat(dir, DEFS_META_DIR);
+		if (stat(dir, &mst) == 0 && S_ISDIR(mst.st_mode) && mst.st_dev == st.st_dev) {
+			strcat(dir, "/" DEFS_INO_DIR);
+			if (mkdir(dir, 0700) == 0 || errno == EEXIST) {
+				ino_dir = dir;
+			}
+			break;
+		}
+		*slash = '\0';
+	}
+	if (!ino_dir) {
+		free(dir);
+	}
+	return ino_dir;
+}
+
+/*
+ * Pin file by a hard link named after its inode in ino_dir, as defs does
+ * Returns the malloc'ed name, the key of file in the link table, NULL on
+ * error setting errno
+ */
+static char *pin(const char *ino_dir, const char *file)
+{
+	struct stat st, kst;
+	char *key;
+
+	if (stat(file, &st) == -1) {
+		return NULL;
+	}
+	key = malloc(strlen(ino_dir) + 22);
+	if (!key) {
+		return NULL;
+	}
+	sprintf(key, "%s/%llu", ino_dir, (unsigned long long) st.st_ino);
+	if (link(file, key) == -1) {
+		if (errno != EEXIST || stat(key, &kst) == -1) {
+			free(key);
+			return NULL;
+		}
+		/* Left from an inode of that number that's gone */
+		if (kst.st_ino != st.st_ino &&
+		    (unlink(key) == -1 || link(file, key) == -1)) {
+			free(key);
+			return NULL;
+		}
+	}
+	return key;
+}
+
+
+
+/*
+ * A file that may be a parent, found by rebuild
+ */
+typedef struct {
+	ino_t ino;
+	char *path;
+} parent_t;
+
+static int parent_cmp(const void *a, const void *b)
+{
+	const parent_t *pa = a, *pb = b;
+
+	return pa->ino < pb->ino ? -1 : pa->ino > pb->ino;
+}
+
+/*
+ * Add the files of the metadata subdirectory name of top to parents
+ * Returns 0 on success, -1 on error
+ */
+static int scan_parents(const char *top, const char *name, parent_t **parents, int *count, int *alloc)
+{
+	DIR *dp;
+	struct dirent *de;
+	struct stat st;
+	parent_t *p;
+	char *path;
+
+	path = malloc(strlen(top) + strlen(DEFS_META_DIR) + strlen(name) + 2);
+	if (!path) {
+		return -1;
+	}
+	sprintf(path, "%s%s/%s", top, DEFS_META_DIR, name);
+	dp = opendir(path);
+	free(path);
+	if (!dp) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		path = malloc(strlen(top) + strlen(DEFS_META_DIR) + strlen(name) + strlen(de->d_name) + 3);
+		if (!path) {
+			break;
+		}
+		sprintf(path, "%s%s/%s/%s", top, DEFS_META_DIR, name, de->d_name);
+		if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+			free(path);
+			continue;
+		}
+		if (*count == *alloc) {
+			*alloc = *alloc ? 2 * *alloc : 256;
+			p = realloc(*parents, *alloc * sizeof(parent_t));
+			if (!p) {
+				free(path);
+				break;
+			}
+			*parents = p;
+		}
+		(*parents)[*count].ino = st.st_ino;
+		(*parents)[*count].path = path;
+		++*count;
+	}
+	closedir(dp);
+	return de ? -1 : 0;
+}
+
+/*
+ * Rebuild the link table of the defs directory dir from the trailers of
+ * the deltas pinned in it, adding the links it is missing and correcting
+ * those that name the wrong parent
+ * Returns 0 on success, 1 on error
+ */
+static int rebuild(const char *dir)
+{
+	char *abspath, *top;
+	parent_t *parents = NULL;
+	parent_t *p, key;
+	int count = 0, alloc = 0;
+	int fixed = 0, bad = 0;
+	char *parent;
+	windex_t idx;
+	int fd, i;
+
+	/* Keys are spelled as defs spells them, from the directory with a / */
+	abspath = make_absolute((char *) dir);
+	if (!abspath) {
+		return 1;
+	}
+	top = malloc(strlen(abspath) + 2);
+	if (!top) {
+		return 1;
+	}
+	strcpy(top, abspath);
+	if (top[strlen(top) - 1] != '/') {
+		strcat(top, "/");
+	}
+	if (abspath != dir) {
+		free(abspath);
+	}
+
+	if (scan_parents(top, DEFS_INO_DIR, &parents, &count, &alloc) ||
+	    scan_parents(top, DEFS_BASE_DIR, &parents, &count, &alloc)) {
+		perror("Could not scan");
+		return 1;
+	}
+	qsort(parents, count, sizeof(parent_t), parent_cmp);
+
+	sql_begin();
+	for (i = 0; i < count; ++i) {
+		fd = open(parents[i].path, O_RDONLY);
+		if (fd == -1) {
+			continue;
+		}
+		if (windex_load(&idx, fd) || !idx.parent_ino) {
+			/* Not a delta, or one from before deltas named their parent */
+			windex_free(&idx);
+			close(fd);
+			continue;
+		}
+		key.ino = idx.parent_ino;
+		p = bsearch(&key, parents, count, sizeof(parent_t), parent_cmp);
+		if (!p) {
+			fprintf(stderr, "No parent for %s\n", parents[i].path);
+			++bad;
+		} else {
+			parent = NULL;
+			sql_get_parent(parents[i].path, &parent);
+			if (!parent || strcmp(parent, p->path)) {
+				sql_remove_child(parents[i].path);
+				sql_add(p->path, parents[i].path, windex_size(&idx));
+				++fixed;
+			}
+			free(parent);
+		}
+		windex_free(&idx);
+		close(fd);
+	}
+	sql_commit();
+
+	if (dopt.verbose_flag != 2) {
+		printf("%d links restored, %d deltas without a parent\n", fixed, bad);
+	}
+	for (i = 0; i < count; ++i) {
+		free(parents[i].path);
+	}
+	free(parents);
+	free(top);
+	return bad != 0;
+}
+
 
 int main (int argc, char* argv[])
 {
@@ -117,11 +344,26 @@ int main (int argc, char* argv[])
 	int res;
 	char *parent = NULL;
 	struct stat statbuf;
+	char *ino_dir;
+	char *srckey;
+	char *outkey;
 
 	dopt_init();
 	dopt_proc(argc, argv, short_options, long_options);
 	dopt_finalize();
 
+	if (dopt.rebuild_dir) {
+		if (optind != argc || sql_open()) {
+			fprintf(stderr, "Usage %s -R DIR\n", argv[0]);
+			sql_close();
+			exit(1);
+		}
+		sql_init_db();
+		res = rebuild(dopt.rebuild_dir);
+		sql_close();
+		return res;
+	}
+
 	if ( optind != argc - 2) { /* 2 required options - SrcFile and InFile */
 		fprintf(stderr, "Usage %s [options] SrcFile InFile\n", argv[0]);
 		exit(1);
@@ -138,7 +380,19 @@ int main (int argc, char* argv[])
 	srcfilename = make_absolute(argv[optind++]);
 	infilename = make_absolute(argv[optind++]);
 
-	sql_get_parent(srcfilename, &parent);
+	/*
+	 * Under a defs directory links are keyed by inode, so renames there
+	 * leave them alone.  Elsewhere they are keyed by path, and defs keys
+	 * them when it mounts the directory.
+	 */
+	ino_dir = find_ino_dir(srcfilename);
+	srckey = ino_dir ? pin(ino_dir, srcfilename) : srcfilename;
+	if (!srckey) {
+		perror("Could not pin SrcFile");
+		exit(1);
+	}
+
+	sql_get_parent(srckey, &parent);
 	if (parent) {  /* Don't allow links of links */
 		fprintf(stderr, "Links of links are not allowed");
 		exit(1);
@@ -180,11 +434,21 @@ int main (int argc, char* argv[])
 			return -errno;
 		}
 		
-		sql_add(srcfilename, outfilename, statbuf.st_size);
+		outkey = ino_dir ? pin(ino_dir, outfilename) : outfilename;
+		if (!outkey) {
+			perror("Could not pin OutFile");
+			rename(infiletmp, infilename);
+			exit(1);
+		}
+		sql_add(srckey, outkey, statbuf.st_size);
 
-		res = xdelta_encode(outfilename, InFile, SrcFile, OutFile);		
+		res = xdelta_encode(outkey, InFile, SrcFile, OutFile);		
 
 		if (res) {
+			sql_remove_child(outkey);
+			if (ino_dir) {
+				unlink(outkey);
+			}
 			res = rename(infiletmp, infilename);
 			if (res == -1) {
 				perror("Could not rename");
@@ -222,9 +486,20 @@ int main (int argc, char* argv[])
 			return -errno;
 		}
 		
-		sql_add(srcfilename, outfilename, statbuf.st_size);
+		outkey = ino_dir ? pin(ino_dir, outfilename) : outfilename;
+		if (!outkey) {
+			perror("Could not pin OutFile");
+			exit(1);
+		}
+		sql_add(srckey, outkey, statbuf.st_size);
 
-		res = xdelta_encode(outfilename, InFile, SrcFile, OutFile);
+		res = xdelta_encode(outkey, InFile, SrcFile, OutFile);
+		if (res) {
+			sql_remove_child(outkey);
+			if (ino_dir) {
+				unlink(outkey);
+			}
+		}
 	}
 
 	sql_close();
@@ -32,6 +32,7 @@ void dopt_init ()
 {
 	memset(&dopt, 0, sizeof(dlnopt_t));  /* initialize with zeroes */
 	dopt.window_rel = 0;
+	dopt.window_max = 1 << 23; /* as in defs, so it can decode in bounded memory */
 }
 
 void dopt_finalize ()
@@ -54,6 +55,7 @@ void print_help (const char *program_name)
 		"Corey McClymonds <galeru@gmail.com>\n"
 		"\n"
 		"Usage %s [options] SrcFile InFile\n"
+		"      %s -R DIR\n"
 		"\n"
 		"general options:\n"
 		"    -h   --help            print help\n"
@@ -65,8 +67,11 @@ void print_help (const char *program_name)
 		"    -S   --safe            safe mode\n"
 		"    -o   --output          specify a different output file\n"
 		"    -a   --windowabs       specify a delta window absolute size\n"
-		"    -r   --windowrel       specify a delta window relative size\n",
-		program_name);
+		"    -r   --windowrel       specify a delta window relative size\n"
+		"    -m   --windowmax       specify the largest relative window size\n"
+		"    -R   --rebuild DIR     rebuild the links of the defs directory DIR\n"
+		"                           from its deltas\n",
+		program_name, program_name);
 }
 
 int dopt_proc (int argc, char *argv[], const char *short_options, const struct option *long_options)
@@ -118,6 +123,17 @@ int dopt_proc (int argc, char *argv[], const char *short_options, const struct o
 			}
 			break;
 
+		case 'm':  /* -m or --windowmax */
+			res = atoi(optarg);
+			if (res >= (1U<<14) && res <= (1U<<23)) {
+				dopt.window_max = res;
+			}
+			break;
+
+		case 'R':  /* -R or --rebuild */
+			dopt.rebuild_dir = strdup(optarg);
+			break;
+
 		case -1:
 			break;
 
@@ -22,12 +22,19 @@
 
 #include <unistd.h>
 
+/* As in ../opts.h and ../delta.c, so dln finds links where defs keeps them */
+#define DEFS_META_DIR ".defs"
+#define DEFS_INO_DIR "ino"
+#define DEFS_BASE_DIR "base"
+
 typedef struct {
 	int verbose_flag;
 	char* output_file;
 	int safe_mode;
 	int window_abs;
 	double window_rel;
+	int window_max;
+	char* rebuild_dir;
 } dlnopt_t;
 
 
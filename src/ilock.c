@@ -0,0 +1,185 @@
+/*
+ * ilock.c implements the table of reader/writer locks as defined in ilock.h
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "ilock.h"
+
+/* Each shard has its own mutex, so unrelated files rarely contend */
+#define ILOCK_SHARDS 64
+
+struct ilock {
+	dev_t dev;
+	ino_t ino;
+	int readers;
+	int writer;
+	int writers_waiting;
+	int refs;                    /* holders and waiters, freed at 0 */
+	pthread_cond_t cond;
+	struct ilock *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	ilock_t *head;
+} ilock_shards[ILOCK_SHARDS];
+
+static pthread_once_t ilock_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ilock_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t ilock_hist[ILOCK_HIST_BUCKETS];
+
+
+static void ilock_setup()
+{
+	int i;
+
+	for (i = 0; i < ILOCK_SHARDS; ++i) {
+		pthread_mutex_init(&ilock_shards[i].lock, NULL);
+	}
+}
+
+static unsigned int ilock_shard(dev_t dev, ino_t ino)
+{
+	uint64_t h = (uint64_t) ino * 2654435761U;
+
+	h ^= (uint64_t) dev * 40503U;
+	return (unsigned int) (h ^ (h >> 32)) % ILOCK_SHARDS;
+}
+
+static void ilock_account(const struct timespec *start)
+{
+	struct timespec now;
+	uint64_t us;
+	int b;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (uint64_t) (now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+	for (b = 0; us && b < ILOCK_HIST_BUCKETS - 1; ++b) {
+		us >>= 1;
+	}
+
+	pthread_mutex_lock(&ilock_stats_lock);
+	ilock_hist[b]++;
+	pthread_mutex_unlock(&ilock_stats_lock);
+}
+
+
+ilock_t *ilock_acquire(dev_t dev, ino_t ino, int write)
+{
+	struct timespec start;
+	unsigned int s;
+	ilock_t *l;
+
+	pthread_once(&ilock_once, ilock_setup);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	s = ilock_shard(dev, ino);
+	pthread_mutex_lock(&ilock_shards[s].lock);
+	for (l = ilock_shards[s].head; l; l = l->next) {
+		if (l->dev == dev && l->ino == ino) {
+			break;
+		}
+	}
+	if (!l) {
+		l = calloc(1, sizeof(ilock_t));
+		if (!l) {
+			pthread_mutex_unlock(&ilock_shards[s].lock);
+			errno = ENOMEM;
+			return NULL;
+		}
+		l->dev = dev;
+		l->ino = ino;
+		pthread_cond_init(&l->cond, NULL);
+		l->next = ilock_shards[s].head;
+		ilock_shards[s].head = l;
+	}
+	l->refs++;
+
+	if (write) {
+		l->writers_waiting++;
+		while (l->writer || l->readers) {
+			pthread_cond_wait(&l->cond, &ilock_shards[s].lock);
+		}
+		l->writers_waiting--;
+		l->writer = 1;
+	} else {
+		while (l->writer || l->writers_waiting) {
+			pthread_cond_wait(&l->cond, &ilock_shards[s].lock);
+		}
+		l->readers++;
+	}
+	pthread_mutex_unlock(&ilock_shards[s].lock);
+
+	ilock_account(&start);
+	return l;
+}
+
+ilock_t *ilock_acquire_path(const char *path, int write)
+{
+	struct stat statbuf;
+
+	if (stat(path, &statbuf)) {
+		return NULL;
+	}
+	return ilock_acquire(statbuf.st_dev, statbuf.st_ino, write);
+}
+
+void ilock_release(ilock_t *l)
+{
+	unsigned int s;
+	ilock_t **p;
+
+	if (!l) {
+		return;
+	}
+
+	s = ilock_shard(l->dev, l->ino);
+	pthread_mutex_lock(&ilock_shards[s].lock);
+	if (l->writer) {
+		l->writer = 0;
+	} else {
+		l->readers--;
+	}
+	pthread_cond_broadcast(&l->cond);
+
+	l->refs--;
+	if (!l->refs) {
+		for (p = &ilock_shards[s].head; *p != l; p = &(*p)->next)
+			;
+		*p = l->next;
+		pthread_cond_destroy(&l->cond);
+		free(l);
+	}
+	pthread_mutex_unlock(&ilock_shards[s].lock);
+}
+
+void ilock_stats(uint64_t hist[ILOCK_HIST_BUCKETS])
+{
+	pthread_mutex_lock(&ilock_stats_lock);
+	memcpy(hist, ilock_hist, sizeof(ilock_hist));
+	pthread_mutex_unlock(&ilock_stats_lock);
+}
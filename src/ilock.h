@@ -0,0 +1,64 @@
+/*
+ * ilock.h defines api for the in-process reader/writer locks on files
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILOCK_H
+#define ILOCK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Lock waits are counted in buckets by powers of two microseconds: bucket
+ * 0 holds waits under 1us, bucket i those under 2^i us, the last one the
+ * rest
+ */
+#define ILOCK_HIST_BUCKETS 24
+
+/*
+ * Locks are keyed by device and inode, so every name of a file shares
+ * one.  Any number of readers or one writer hold it at a time, and
+ * waiting writers keep new readers out.  A lock may be released by
+ * another thread than the one that took it.
+ */
+typedef struct ilock ilock_t;
+
+
+/*
+ * Take the lock of dev/ino, shared or for write, waiting as long as needed
+ * Returns the lock, NULL on error setting errno
+ */
+ilock_t *ilock_acquire(dev_t dev, ino_t ino, int write);
+
+/*
+ * Take the lock of the file at path
+ * Returns the lock, NULL on error setting errno
+ */
+ilock_t *ilock_acquire_path(const char *path, int write);
+
+/*
+ * Release a lock taken with ilock_acquire or ilock_acquire_path
+ */
+void ilock_release(ilock_t *l);
+
+/*
+ * Copy the histogram of lock waits into hist
+ */
+void ilock_stats(uint64_t hist[ILOCK_HIST_BUCKETS]);
+
+#endif /* ILOCK_H */
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <errno.h>
 
 #include "opts.h"
 #include "version.h"
@@ -35,24 +36,26 @@ void dopt_init()
 {
 	memset(&dopt, 0, sizeof(dopt_t)); /* initialize with zeros */
 	dopt.window_rel = 0;
+	dopt.window_max = 1 << 23; /* largest window windowrel gives */
+	dopt.buffer = 1 << 20; /* bytes read or written at a time */
+	dopt.buffer_mem = 64; /* MB of stream buffers kept for reuse */
+	dopt.cache_size = 64; /* MB of decoded windows */
+	dopt.srccache_size = 64; /* MB of parent blocks */
+	dopt.readahead = 4; /* windows decoded ahead of sequential reads */
+	dopt.dirty_size = 64; /* MB of child writes buffered before encoding */
+	dopt.dirty_timeout = 5; /* seconds a child stays dirty while idle */
+	dopt.workers = 0; /* children re-encoded at once, 0 is one per CPU */
 }
 
 void dopt_finalize()
 {
 	if (!dopt.window_rel && !dopt.window_abs) {
 		dopt.window_rel = .01; /* use relative window of 1/100 if no option specified */
-		dopt.buffer = 200000;
 	}
 	else if (dopt.window_rel && dopt.window_abs) {
 		fprintf(stderr, "You may not specify windowrel and windowabs\n");
 		exit(1); /* still very early stage, we can abort here */
 	}
-	else if (dopt.window_abs) {
-		dopt.buffer = dopt.window_abs; /* window_abs set */
-	}
-	else {
-		dopt.buffer = 200000;
-	}
 }
 
 
@@ -121,6 +124,33 @@ char *make_absolute(char *relpath)
 }
 
 
+/*
+ * Returns the malloc'ed path of the subdirectory name of the hidden
+ * metadata directory, creating both as needed, NULL on error
+ */
+char *defs_meta_dir(const char *name)
+{
+	char *path;
+
+	path = malloc(strlen(dopt.directory) + strlen(DEFS_META_DIR) + strlen(name) + 2);
+	if (!path) {
+		return NULL;
+	}
+	sprintf(path, "%s%s", dopt.directory, DEFS_META_DIR);
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		free(path);
+		return NULL;
+	}
+	strcat(path, "/");
+	strcat(path, name);
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		free(path);
+		return NULL;
+	}
+	return path;
+}
+
+
 /*
  * Options without any -X prefix, so this defines our directory
  */
@@ -204,6 +234,15 @@ static void print_help(const char *progname){
 		"DeltaFS options:\n"
 		"    -o windowabs=size         delta window absolute size\n"
 		"    -o windowrel=size         delta window relative size size\n"
+		"    -o windowmax=size         largest relative window (default 8388608)\n"
+		"    -o iobuf=size             bytes read or written at a time (default 1048576)\n"
+		"    -o bufmem=MB              stream buffers kept for reuse (default 64)\n"
+		"    -o cachesize=MB           decoded window cache size (default 64, 0 disables)\n"
+		"    -o srccache=MB            parent block cache size (default 64)\n"
+		"    -o readahead=N            windows decoded ahead of sequential reads (default 4, 0 disables)\n"
+		"    -o dirtysize=MB           child writes buffered before encoding (default 64, 0 writes through)\n"
+		"    -o dirtytimeout=SEC       encode buffered writes after SEC idle (default 5, 0 only on close)\n"
+		"    -o workers=N              children re-encoded at once on parent changes (default 0, one per CPU)\n"
 		"\n",
 		progname);
 }
@@ -238,6 +277,60 @@ int defs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outarg
 			dopt.window_rel = dres;
 		}
 		return 0;
+	case KEY_WINDOW_MAX:
+		res = get_arg(arg);
+		if (res >= (1U<<14) && res <= (1U<<23)) {
+			dopt.window_max = res;
+		}
+		return 0;
+	case KEY_IOBUF:
+		res = get_arg(arg);
+		if (res >= (1U<<12) && res <= (1U<<26)) {
+			dopt.buffer = res;
+		}
+		return 0;
+	case KEY_BUFMEM:
+		res = get_arg(arg);
+		if (res >= 0) {
+			dopt.buffer_mem = res;
+		}
+		return 0;
+	case KEY_CACHE_SIZE:
+		res = get_arg(arg);
+		if (res >= 0) {
+			dopt.cache_size = res;
+		}
+		return 0;
+	case KEY_SRCCACHE_SIZE:
+		res = get_arg(arg);
+		if (res >= 0) {
+			dopt.srccache_size = res;
+		}
+		return 0;
+	case KEY_READAHEAD:
+		res = get_arg(arg);
+		if (res >= 0) {
+			dopt.readahead = res;
+		}
+		return 0;
+	case KEY_DIRTY_SIZE:
+		res = get_arg(arg);
+		if (res >= 0) {
+			dopt.dirty_size = res;
+		}
+		return 0;
+	case KEY_DIRTY_TIMEOUT:
+		res = get_arg(arg);
+		if (res >= 0) {
+			dopt.dirty_timeout = res;
+		}
+		return 0;
+	case KEY_WORKERS:
+		res = get_arg(arg);
+		if (res >= 0) {
+			dopt.workers = res;
+		}
+		return 0;
 	default:
 		return 1;
 	}
@@ -24,12 +24,32 @@
 
 #include <fuse.h>
 
+/*
+ * Hidden directory at the top of the underlying directory holding defs'
+ * own files, never shown through the mount
+ */
+#define DEFS_META_DIR ".defs"
+
+/*
+ * Subdirectory of DEFS_META_DIR holding the files in links under their
+ * inode numbers, shared with dln
+ */
+#define DEFS_INO_DIR "ino"
+
 typedef struct {
 	int directory_set;
 	char *directory;
 	int window_abs;
 	double window_rel;
+	int window_max;
 	int buffer;
+	int buffer_mem;
+	int cache_size;
+	int srccache_size;
+	int readahead;
+	int dirty_size;
+	int dirty_timeout;
+	int workers;
 } dopt_t;
 
 
@@ -37,7 +57,16 @@ enum {
 	KEY_HELP,
 	KEY_VERSION,
 	KEY_WINDOW_ABS,
-	KEY_WINDOW_REL
+	KEY_WINDOW_REL,
+	KEY_WINDOW_MAX,
+	KEY_IOBUF,
+	KEY_BUFMEM,
+	KEY_CACHE_SIZE,
+	KEY_SRCCACHE_SIZE,
+	KEY_READAHEAD,
+	KEY_DIRTY_SIZE,
+	KEY_DIRTY_TIMEOUT,
+	KEY_WORKERS
 };
 
 
@@ -47,6 +76,7 @@ void dopt_init();
 int defs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs);
 char *make_absolute(char *relpath);
 char *add_trailing_slash(char *path);
+char *defs_meta_dir(const char *name);
 void dopt_finalize();
 
 #endif /* OPTS_H */
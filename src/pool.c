@@ -0,0 +1,233 @@
+/*
+ * pool.c implements batches of jobs on a bounded set of threads as defined in pool.h
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+/* Even on large machines, more than this only fights over the disk */
+#define POOL_MAX_WORKERS 64
+
+typedef struct pool_batch {
+	pool_job_t job;
+	void *arg;
+	int count;
+	int next;                    /* next index to hand out */
+	int done;                    /* indexes whose job returned */
+	int res;                     /* first error */
+	int queued;
+	pthread_cond_t cond;         /* signalled when the last job returns */
+	struct pool_batch *link;     /* in the queue */
+} pool_batch_t;
+
+static struct {
+	pthread_mutex_t lock;        /* the queue and every batch in it */
+	pthread_cond_t cond;         /* a batch was queued, or stop */
+	pthread_t threads[POOL_MAX_WORKERS];
+	int nthreads;
+	int stop;
+	pool_batch_t *head;          /* batches with indexes left to hand out */
+	pool_batch_t *tail;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+
+/*
+ * Hand out the next index of b, taking it off the queue with its last one,
+ * with the lock held
+ * Returns the index, -1 if there are none left
+ */
+static int pool_take(pool_batch_t *b)
+{
+	pool_batch_t **p, *prev = NULL;
+	int i;
+
+	if (b->next == b->count) {
+		return -1;
+	}
+	i = b->next++;
+	if (b->next == b->count && b->queued) {
+		for (p = &pool.head; *p != b; p = &(*p)->link) {
+			prev = *p;
+		}
+		*p = b->link;
+		if (pool.tail == b) {
+			pool.tail = prev;
+		}
+		b->queued = 0;
+	}
+	return i;
+}
+
+/*
+ * Record that the job of an index of b returned r, with the lock held.
+ * b may be gone as soon as the lock is dropped.
+ */
+static void pool_done(pool_batch_t *b, int r)
+{
+	if (r && !b->res) {
+		b->res = r;
+	}
+	if (++b->done == b->count) {
+		pthread_cond_signal(&b->cond);
+	}
+}
+
+/*
+ * Take indexes of the queued batches, oldest first, until stopped
+ */
+static void *pool_worker(void *arg)
+{
+	pool_batch_t *b;
+	int i, r;
+
+	(void) arg;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.head && !pool.stop) {
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		}
+		if (pool.stop) {
+			break;
+		}
+
+		b = pool.head;
+		i = pool_take(b);
+		pthread_mutex_unlock(&pool.lock);
+
+		r = b->job(b->arg, i);
+
+		pthread_mutex_lock(&pool.lock);
+		pool_done(b, r);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+
+int pool_init(int workers)
+{
+	int r = 0;
+
+	if (workers <= 0) {
+		workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (workers < 1) {
+		workers = 1;
+	}
+	if (workers > POOL_MAX_WORKERS) {
+		workers = POOL_MAX_WORKERS;
+	}
+
+	pool_destroy();
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 0;
+	/* The thread running a batch is one of its workers */
+	while (pool.nthreads < workers - 1) {
+		r = pthread_create(&pool.threads[pool.nthreads], NULL, pool_worker, NULL);
+		if (r) {
+			/* Fewer threads is only slower */
+			break;
+		}
+		pool.nthreads++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return -r;
+}
+
+void pool_destroy()
+{
+	int n;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.cond);
+	n = pool.nthreads;
+	pthread_mutex_unlock(&pool.lock);
+
+	while (n > 0) {
+		pthread_join(pool.threads[--n], NULL);
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.nthreads = 0;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+int pool_workers()
+{
+	int n;
+
+	pthread_mutex_lock(&pool.lock);
+	n = pool.nthreads + 1;
+	pthread_mutex_unlock(&pool.lock);
+	return n;
+}
+
+int pool_run(int count, pool_job_t job, void *arg)
+{
+	pool_batch_t b;
+	int i, r;
+
+	if (count <= 0) {
+		return 0;
+	}
+
+	b.job = job;
+	b.arg = arg;
+	b.count = count;
+	b.next = 0;
+	b.done = 0;
+	b.res = 0;
+	b.queued = 0;
+	b.link = NULL;
+	pthread_cond_init(&b.cond, NULL);
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.nthreads && !pool.stop && count > 1) {
+		if (pool.tail) {
+			pool.tail->link = &b;
+		} else {
+			pool.head = &b;
+		}
+		pool.tail = &b;
+		b.queued = 1;
+		pthread_cond_broadcast(&pool.cond);
+	}
+
+	/*
+	 * The caller takes part, so the batch gets done while the workers are
+	 * busy with others, and a job may run a batch of its own
+	 */
+	while ((i = pool_take(&b)) != -1) {
+		pthread_mutex_unlock(&pool.lock);
+		r = job(arg, i);
+		pthread_mutex_lock(&pool.lock);
+		pool_done(&b, r);
+	}
+	while (b.done < b.count) {
+		pthread_cond_wait(&b.cond, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_cond_destroy(&b.cond);
+	return b.res;
+}
@@ -0,0 +1,59 @@
+/*
+ * pool.h defines api for running a batch of jobs on a bounded set of threads
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * A job is called once for every index of the batch and returns 0 on
+ * success, otherwise -errno
+ */
+typedef int (*pool_job_t)(void *arg, int i);
+
+
+/*
+ * Start the threads batches run on, workers counting the thread running
+ * the batch, 0 for one per online CPU.  They stay up, so the per-thread
+ * state of the jobs they run (database connections, parked xdelta
+ * streams) serves the next batch too.  Until this is called batches run
+ * one job at a time on the calling thread.
+ * Must be called after FUSE forked into the background.
+ * Returns 0 on success, otherwise -errno (fewer threads are left running)
+ */
+int pool_init(int workers);
+
+/*
+ * Stop the threads, once no batch is running
+ */
+void pool_destroy();
+
+/*
+ * Returns the number of threads a batch may run on
+ */
+int pool_workers();
+
+/*
+ * Run job(arg, i) for every i in 0..count-1, the caller taking part, and
+ * wait for all of them.  Jobs may run in any order and at the same time,
+ * and may run batches of their own.
+ * Returns 0 if every job succeeded, otherwise the first error
+ */
+int pool_run(int count, pool_job_t job, void *arg);
+
+#endif /* POOL_H */
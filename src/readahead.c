@@ -0,0 +1,205 @@
+/*
+ * readahead.c implements the read-ahead thread as defined in readahead.h
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "readahead.h"
+#include "delta.h"
+
+/* Past this many queued jobs new ones are dropped, readers fall behind anyway */
+#define READAHEAD_MAX_JOBS 64
+
+typedef struct readahead_job {
+	char *file;
+	char *parent;
+	uint64_t gen;
+	int first;
+	int count;
+	struct readahead_job *next;
+} readahead_job_t;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int stop;
+	int depth;
+	readahead_job_t *head;
+	readahead_job_t *tail;
+	int jobs;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t windows;
+} ra = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+
+static void readahead_free_job(readahead_job_t *job)
+{
+	free(job->file);
+	free(job->parent);
+	free(job);
+}
+
+static void *readahead_worker(void *arg)
+{
+	readahead_job_t *job;
+	int n;
+
+	(void) arg;
+
+	pthread_mutex_lock(&ra.lock);
+	for (;;) {
+		while (!ra.head && !ra.stop) {
+			pthread_cond_wait(&ra.cond, &ra.lock);
+		}
+		if (ra.stop) {
+			break;
+		}
+
+		job = ra.head;
+		ra.head = job->next;
+		if (!ra.head) {
+			ra.tail = NULL;
+		}
+		ra.jobs--;
+		pthread_mutex_unlock(&ra.lock);
+
+		n = xdelta_prefetch(job->file, job->parent, job->gen, job->first, job->count);
+		readahead_free_job(job);
+
+		pthread_mutex_lock(&ra.lock);
+		if (n > 0) {
+			ra.windows += n;
+		}
+	}
+	pthread_mutex_unlock(&ra.lock);
+	return NULL;
+}
+
+
+int readahead_init(int depth)
+{
+	int r;
+
+	if (depth <= 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&ra.lock);
+	ra.depth = depth;
+	ra.stop = 0;
+	r = pthread_create(&ra.thread, NULL, readahead_worker, NULL);
+	ra.running = !r;
+	pthread_mutex_unlock(&ra.lock);
+	return -r;
+}
+
+void readahead_destroy()
+{
+	readahead_job_t *job;
+
+	pthread_mutex_lock(&ra.lock);
+	if (!ra.running) {
+		pthread_mutex_unlock(&ra.lock);
+		return;
+	}
+	ra.stop = 1;
+	pthread_cond_signal(&ra.cond);
+	pthread_mutex_unlock(&ra.lock);
+
+	pthread_join(ra.thread, NULL);
+
+	pthread_mutex_lock(&ra.lock);
+	while ((job = ra.head) != NULL) {
+		ra.head = job->next;
+		readahead_free_job(job);
+	}
+	ra.tail = NULL;
+	ra.jobs = 0;
+	ra.running = 0;
+	pthread_mutex_unlock(&ra.lock);
+}
+
+int readahead_depth()
+{
+	int depth;
+
+	pthread_mutex_lock(&ra.lock);
+	depth = ra.running ? ra.depth : 0;
+	pthread_mutex_unlock(&ra.lock);
+	return depth;
+}
+
+void readahead_queue(const char *file, const char *parent, uint64_t gen, int first, int count)
+{
+	readahead_job_t *job;
+
+	job = calloc(1, sizeof(readahead_job_t));
+	if (!job) {
+		return;
+	}
+	job->file = strdup(file);
+	job->parent = strdup(parent);
+	job->gen = gen;
+	job->first = first;
+	job->count = count;
+	if (!job->file || !job->parent) {
+		readahead_free_job(job);
+		return;
+	}
+
+	pthread_mutex_lock(&ra.lock);
+	if (!ra.running || ra.jobs >= READAHEAD_MAX_JOBS) {
+		pthread_mutex_unlock(&ra.lock);
+		readahead_free_job(job);
+		return;
+	}
+	if (ra.tail) {
+		ra.tail->next = job;
+	} else {
+		ra.head = job;
+	}
+	ra.tail = job;
+	ra.jobs++;
+	pthread_cond_signal(&ra.cond);
+	pthread_mutex_unlock(&ra.lock);
+}
+
+void readahead_account(int hit)
+{
+	pthread_mutex_lock(&ra.lock);
+	if (hit) {
+		ra.hits++;
+	} else {
+		ra.misses++;
+	}
+	pthread_mutex_unlock(&ra.lock);
+}
+
+void readahead_stats(uint64_t *hits, uint64_t *misses, uint64_t *windows)
+{
+	pthread_mutex_lock(&ra.lock);
+	*hits = ra.hits;
+	*misses = ra.misses;
+	*windows = ra.windows;
+	pthread_mutex_unlock(&ra.lock);
+}
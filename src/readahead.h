@@ -0,0 +1,61 @@
+/*
+ * readahead.h defines api for decoding windows ahead of sequential readers
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+
+/*
+ * Start the background thread decoding windows into the window cache.
+ * depth is how many windows to keep decoded ahead of a sequential reader.
+ * Must be called after FUSE forked into the background.
+ */
+int readahead_init(int depth);
+
+/*
+ * Stop the thread, dropping any queued work
+ */
+void readahead_destroy();
+
+/*
+ * Returns the read-ahead depth, 0 when read-ahead isn't running
+ */
+int readahead_depth();
+
+/*
+ * Queue windows first..first+count-1 of the delta file decoded against
+ * parent.  gen is the generation of the delta the windows were looked up
+ * in, the work is dropped if the delta changed since.
+ */
+void readahead_queue(const char *file, const char *parent, uint64_t gen, int first, int count);
+
+/*
+ * Count a window a sequential reader found in the cache (hit) or had to
+ * decode itself (miss)
+ */
+void readahead_account(int hit);
+
+/*
+ * Returns the sequential read hits and misses, and the number of windows
+ * decoded ahead
+ */
+void readahead_stats(uint64_t *hits, uint64_t *misses, uint64_t *windows);
+
+#endif /* READAHEAD_H */
@@ -0,0 +1,486 @@
+/*
+ * splice.c implements crash safe rewrites of delta ends as defined in splice.h
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE  /* fallocate */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "splice.h"
+
+#define SPLICE_MAGIC "DEFSSPL1"
+#define SPLICE_CHUNK (1 << 20)
+
+/*
+ * A record starts with this header and the path of the file (without
+ * terminator), followed by the new end
+ */
+typedef struct {
+	char magic[8];
+	uint64_t off;                /* where the new end goes in the file */
+	uint64_t len;                /* length of the new end */
+	uint32_t path_len;
+	uint32_t sum;                /* of off, len, the path and the new end */
+} splice_hdr_t;
+
+struct splice {
+	FILE *f;                     /* the record */
+	char *rpath;                 /* NULL for an anonymous record */
+	char *path;                  /* the file being spliced */
+	off_t off;
+	off_t start;                 /* of the new end in the record */
+	struct splice *next;         /* spare records */
+};
+
+static struct {
+	pthread_mutex_t lock;        /* the spare records */
+	char *dir;                   /* NULL without records on disk */
+	splice_t *spare;
+} sp = { PTHREAD_MUTEX_INITIALIZER };
+
+
+/*
+ * FNV-1a over 64 bit words, enough to spot a record torn by a crash
+ */
+static uint64_t splice_sum(uint64_t h, const char *data, size_t len)
+{
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, data + i, sizeof(w));
+		h = (h ^ w) * 1099511628211ULL;
+	}
+	for (; i < len; ++i) {
+		h = (h ^ (unsigned char) data[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+
+/*
+ * Checksum of the record open at fd whose header is hdr, reading the
+ * path and new end back from it
+ * Returns 0 on success, otherwise -errno
+ */
+static int splice_record_sum(int fd, const splice_hdr_t *hdr, char *buf, uint32_t *sum)
+{
+	uint64_t h = 14695981039346656037ULL;
+	off_t pos, end;
+	ssize_t n;
+
+	h = splice_sum(h, (const char *) &hdr->off, sizeof(hdr->off));
+	h = splice_sum(h, (const char *) &hdr->len, sizeof(hdr->len));
+	pos = sizeof(splice_hdr_t);
+	end = pos + hdr->path_len + hdr->len;
+	while (pos < end) {
+		n = pread(fd, buf, end - pos < SPLICE_CHUNK ? end - pos : SPLICE_CHUNK, pos);
+		if (n <= 0) {
+			return n ? -errno : -EIO;
+		}
+		h = splice_sum(h, buf, n);
+		pos += n;
+	}
+	*sum = (uint32_t) (h ^ (h >> 32));
+	return 0;
+}
+
+/*
+ * Copy the new end of the record open at fd, whose header is hdr, over
+ * the file open at tfd, cut the file after it and sync it
+ * Returns 0 on success, otherwise -errno
+ */
+static int splice_apply(int fd, const splice_hdr_t *hdr, int tfd, char *buf)
+{
+	off_t pos = sizeof(splice_hdr_t) + hdr->path_len;
+	off_t end = pos + hdr->len;
+	off_t to = hdr->off;
+	ssize_t n;
+
+	while (pos < end) {
+		n = pread(fd, buf, end - pos < SPLICE_CHUNK ? end - pos : SPLICE_CHUNK, pos);
+		if (n <= 0) {
+			return n ? -errno : -EIO;
+		}
+		if (pwrite(tfd, buf, n, to) != n) {
+			return -EIO;
+		}
+		pos += n;
+		to += n;
+	}
+	if (ftruncate(tfd, to) || fdatasync(tfd)) {
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Finish the splice a crash interrupted, if the record at path holds one,
+ * and remove the record
+ */
+static void splice_replay(const char *path)
+{
+	splice_hdr_t hdr;
+	char *target = NULL;
+	char *buf = NULL;
+	uint32_t sum;
+	int fd, tfd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return;
+	}
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, SPLICE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.path_len >= PATH_MAX) {
+		/* Spent, or torn before it was synced and the file touched */
+		goto out;
+	}
+	target = calloc(1, hdr.path_len + 1);
+	buf = malloc(SPLICE_CHUNK);
+	if (!target || !buf ||
+	    read(fd, target, hdr.path_len) != (ssize_t) hdr.path_len ||
+	    splice_record_sum(fd, &hdr, buf, &sum) || sum != hdr.sum) {
+		goto out;
+	}
+
+	tfd = open(target, O_WRONLY);
+	if (tfd == -1 || splice_apply(fd, &hdr, tfd, buf)) {
+		fprintf(stderr, "could not replay splice %s of %s\n", path, target);
+	} else {
+		fprintf(stderr, "replayed splice %s of %s\n", path, target);
+	}
+	if (tfd != -1) {
+		close(tfd);
+	}
+
+ out:
+	close(fd);
+	unlink(path);
+	free(target);
+	free(buf);
+}
+
+int splice_init(const char *dir)
+{
+	struct dirent *ent;
+	DIR *dp;
+	char *path;
+
+	if (!dir) {
+		return 0;
+	}
+	dp = opendir(dir);
+	if (!dp) {
+		return -errno;
+	}
+	while ((ent = readdir(dp)) != NULL) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		path = malloc(strlen(dir) + strlen(ent->d_name) + 2);
+		if (path) {
+			sprintf(path, "%s/%s", dir, ent->d_name);
+			splice_replay(path);
+			free(path);
+		}
+	}
+	closedir(dp);
+
+	pthread_mutex_lock(&sp.lock);
+	free(sp.dir);
+	sp.dir = strdup(dir);
+	pthread_mutex_unlock(&sp.lock);
+	return sp.dir ? 0 : -ENOMEM;
+}
+
+static void splice_free(splice_t *s)
+{
+	if (s->f) {
+		fclose(s->f);
+	}
+	free(s->rpath);
+	free(s->path);
+	free(s);
+}
+
+void splice_destroy()
+{
+	splice_t *s;
+
+	pthread_mutex_lock(&sp.lock);
+	while ((s = sp.spare) != NULL) {
+		sp.spare = s->next;
+		unlink(s->rpath);
+		splice_free(s);
+	}
+	free(sp.dir);
+	sp.dir = NULL;
+	pthread_mutex_unlock(&sp.lock);
+}
+
+/*
+ * Returns a new, empty record, NULL on error setting errno
+ */
+static splice_t *splice_create()
+{
+	splice_t *s;
+	int fd, dfd;
+
+	s = calloc(1, sizeof(splice_t));
+	if (!s) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&sp.lock);
+	if (!sp.dir) {
+		pthread_mutex_unlock(&sp.lock);
+		s->f = tmpfile();
+		if (!s->f) {
+			free(s);
+			return NULL;
+		}
+		return s;
+	}
+	s->rpath = malloc(strlen(sp.dir) + 8);
+	if (s->rpath) {
+		sprintf(s->rpath, "%s/XXXXXX", sp.dir);
+	}
+	pthread_mutex_unlock(&sp.lock);
+	if (!s->rpath) {
+		free(s);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	fd = mkstemp(s->rpath);
+	if (fd == -1) {
+		splice_free(s);
+		return NULL;
+	}
+	s->f = fdopen(fd, "w+b");
+	if (!s->f) {
+		close(fd);
+		unlink(s->rpath);
+		splice_free(s);
+		return NULL;
+	}
+
+	/* The record is reused, so its name only has to reach the disk once */
+	*strrchr(s->rpath, '/') = '\0';
+	dfd = open(s->rpath, O_RDONLY);
+	if (dfd != -1) {
+		fsync(dfd);
+		close(dfd);
+	}
+	s->rpath[strlen(s->rpath)] = '/';
+	return s;
+}
+
+/*
+ * Return a record that holds nothing to replay to the spares
+ */
+static void splice_release(splice_t *s)
+{
+	free(s->path);
+	s->path = NULL;
+	if (!s->rpath) {
+		splice_free(s);
+		return;
+	}
+	pthread_mutex_lock(&sp.lock);
+	s->next = sp.spare;
+	sp.spare = s;
+	pthread_mutex_unlock(&sp.lock);
+}
+
+splice_t *splice_begin(const char *path, off_t off)
+{
+	splice_hdr_t hdr;
+	splice_t *s;
+
+	pthread_mutex_lock(&sp.lock);
+	s = sp.spare;
+	if (s) {
+		sp.spare = s->next;
+	}
+	pthread_mutex_unlock(&sp.lock);
+	if (!s) {
+		s = splice_create();
+		if (!s) {
+			return NULL;
+		}
+	}
+
+	s->next = NULL;
+	s->off = off;
+	s->path = strdup(path);
+	if (!s->path) {
+		splice_release(s);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* Not valid until the commit writes the real header */
+	memset(&hdr, 0, sizeof(hdr));
+	rewind(s->f);
+	if (fwrite(&hdr, sizeof(hdr), 1, s->f) != 1 ||
+	    fwrite(path, 1, strlen(path), s->f) != strlen(path)) {
+		splice_release(s);
+		errno = EIO;
+		return NULL;
+	}
+	s->start = sizeof(hdr) + strlen(path);
+	return s;
+}
+
+FILE *splice_file(splice_t *s)
+{
+	return s->f;
+}
+
+int splice_copy(splice_t *s, int fd, off_t start, off_t end)
+{
+	char *buf;
+	ssize_t n;
+	int r = 0;
+
+	if (start >= end) {
+		return 0;
+	}
+	buf = malloc(SPLICE_CHUNK);
+	if (!buf) {
+		return -ENOMEM;
+	}
+	while (start < end) {
+		n = pread(fd, buf, end - start < SPLICE_CHUNK ? end - start : SPLICE_CHUNK, start);
+		if (n <= 0) {
+			r = n ? -errno : -EIO;
+			break;
+		}
+		if (fwrite(buf, 1, n, s->f) != (size_t) n) {
+			r = -EIO;
+			break;
+		}
+		start += n;
+	}
+	free(buf);
+	return r;
+}
+
+int splice_commit(splice_t *s, int fd)
+{
+	splice_hdr_t hdr;
+	char *buf = NULL;
+	int rfd = fileno(s->f);
+	int tfd = fd;
+	off_t end;
+	int r;
+
+	if (fflush(s->f) || (end = ftello(s->f)) == -1) {
+		r = -errno;
+		goto out;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SPLICE_MAGIC, sizeof(hdr.magic));
+	hdr.off = s->off;
+	hdr.len = end - s->start;
+	hdr.path_len = strlen(s->path);
+
+	buf = malloc(SPLICE_CHUNK);
+	if (!buf) {
+		r = -ENOMEM;
+		goto out;
+	}
+	if (tfd == -1) {
+		tfd = open(s->path, O_WRONLY);
+		if (tfd == -1) {
+			r = -errno;
+			goto out;
+		}
+	}
+
+	/* Reserve room for the new end, running out of space halfway would tear the file */
+	if (fallocate(tfd, FALLOC_FL_KEEP_SIZE, hdr.off, hdr.len ? hdr.len : 1) &&
+	    errno != EOPNOTSUPP) {
+		r = -errno;
+		goto out;
+	}
+
+	if (s->rpath) {
+		r = splice_record_sum(rfd, &hdr, buf, &hdr.sum);
+		if (r) {
+			goto out;
+		}
+		if (pwrite(rfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(rfd)) {
+			r = -EIO;
+			goto out;
+		}
+	}
+
+	r = splice_apply(rfd, &hdr, tfd, buf);
+	if (r) {
+		/* The record is valid, leave it for the next mount to replay */
+		fprintf(stderr, "splice of %s failed, the next mount repairs it\n", s->path);
+		if (tfd != fd) {
+			close(tfd);
+		}
+		free(buf);
+		splice_free(s);
+		return r;
+	}
+
+	/* Spent, which has to reach the disk before anything else writes the file */
+	if (s->rpath && (ftruncate(rfd, 0) || fdatasync(rfd))) {
+		r = -errno;
+	}
+
+ out:
+	if (tfd != -1 && tfd != fd) {
+		close(tfd);
+	}
+	free(buf);
+	if (s->rpath && (r || ftruncate(rfd, 0))) {
+		/* Whatever the record holds must not be replayed */
+		unlink(s->rpath);
+		splice_free(s);
+		return r;
+	}
+	splice_release(s);
+	return r;
+}
+
+void splice_abort(splice_t *s)
+{
+	if (s->rpath && (fflush(s->f) || ftruncate(fileno(s->f), 0))) {
+		unlink(s->rpath);
+		splice_free(s);
+		return;
+	}
+	splice_release(s);
+}
@@ -0,0 +1,83 @@
+/*
+ * splice.h defines api for rewriting the end of a delta crash safely
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPLICE_H
+#define SPLICE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * A splice replaces everything of a file from some offset on.  The new
+ * end is written to a record in the splice directory first, which is
+ * synced before the file is touched, so a crash while the file is being
+ * overwritten is repaired by replaying the record at the next mount.
+ * Deltas are pinned by inode, so a new copy can't simply be renamed over
+ * them.  Records are kept and reused, a spent one is marked as such (and
+ * synced) before the splice returns, so it can never be replayed over
+ * later writes.  Without a splice directory records are anonymous
+ * temporary files and a crash may leave the file torn.
+ */
+typedef struct splice splice_t;
+
+
+/*
+ * Replay the records a crash left in dir, and keep records there from
+ * now on.  dir may be NULL.
+ * Returns 0 on success, otherwise -errno
+ */
+int splice_init(const char *dir);
+
+/*
+ * Remove the spare records
+ */
+void splice_destroy();
+
+/*
+ * Start replacing the file at path from off on.  The new end is written
+ * to the stream splice_file returns.
+ * Returns the splice, NULL on error setting errno
+ */
+splice_t *splice_begin(const char *path, off_t off);
+
+/*
+ * Returns the stream the new end is written to
+ */
+FILE *splice_file(splice_t *s);
+
+/*
+ * Append bytes start..end of the file open at fd to the new end
+ * Returns 0 on success, otherwise -errno
+ */
+int splice_copy(splice_t *s, int fd, off_t start, off_t end);
+
+/*
+ * Sync the record, write the new end over the file open for writing at
+ * fd (or the file at its path if fd is -1), cut the file after it and
+ * sync it.  Frees s whatever happens.
+ * Returns 0 on success, otherwise -errno
+ */
+int splice_commit(splice_t *s, int fd);
+
+/*
+ * Give up on a splice, leaving the file as it is
+ */
+void splice_abort(splice_t *s);
+
+#endif /* SPLICE_H */
@@ -0,0 +1,199 @@
+/*
+ * sql-bench.c times loading the link table into memory and lookups with
+ * and without the cache, and walking a parent with many children
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "sql.h"
+
+#define BENCH_DB "/tmp/defs-bench.db"
+#define BENCH_CHILDREN 100   /* per parent */
+#define BENCH_LOOKUPS 100000
+#define BENCH_WIDE 10000     /* children of the golden image everything derives from */
+#define BENCH_WIDE_PARENT "/srv/images/golden.img"
+#define BENCH_WALKS 20
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long max_rss()
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+/*
+ * Fill the table with rows children, BENCH_CHILDREN to a parent, and
+ * BENCH_WIDE more of one parent, in one transaction
+ */
+static int populate(const char *path, int rows)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	char parent[64], child[64];
+	int i;
+
+	if (sqlite3_open(path, &db) != SQLITE_OK) {
+		return -1;
+	}
+	sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+	sqlite3_prepare_v2(db, "INSERT INTO MAP (Parent, Child, Size) VALUES (?1, ?2, ?3)", -1, &stmt, NULL);
+	for (i = 0; i < rows; ++i) {
+		snprintf(parent, sizeof parent, "/srv/images/golden-%d.img", i / BENCH_CHILDREN);
+		snprintf(child, sizeof child, "/srv/vms/vm-%d/disk.img", i);
+		sqlite3_bind_text(stmt, 1, parent, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, child, -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, 3, i);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	for (i = 0; i < BENCH_WIDE; ++i) {
+		snprintf(child, sizeof child, "/srv/vms/wide-%d/disk.img", i);
+		sqlite3_bind_text(stmt, 1, BENCH_WIDE_PARENT, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, child, -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, 3, i);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+	return sqlite3_close(db);
+}
+
+/*
+ * Time lookups of random children and of the children of random parents
+ */
+static void lookups(const char *what, int rows)
+{
+	char path[64];
+	char *parent;
+	sql_children_t *it;
+	char **childv;
+	int childc, i, j, bad = 0;
+	int64_t size;
+	double start;
+
+	srand(1);
+	start = now();
+	for (i = 0; i < BENCH_LOOKUPS; ++i) {
+		j = rand() % rows;
+		snprintf(path, sizeof path, "/srv/vms/vm-%d/disk.img", j);
+		parent = NULL;
+		size = -1;
+		sql_get_parent_size(path, &parent, &size);
+		bad += !parent || size != j;
+		free(parent);
+	}
+	printf("%-6s %7d parent+size lookups: %.3fs\n", what, BENCH_LOOKUPS, now() - start);
+
+	start = now();
+	for (i = 0; i < BENCH_LOOKUPS / 100; ++i) {
+		snprintf(path, sizeof path, "/srv/images/golden-%d.img", rand() % (rows / BENCH_CHILDREN));
+		sql_get_children(path, &childc, &childv);
+		bad += childc != BENCH_CHILDREN;
+		for (j = 0; j < childc; ++j) {
+			free(childv[j]);
+		}
+		free(childv);
+	}
+	printf("%-6s %7d children lookups:    %.3fs\n", what, BENCH_LOOKUPS / 100, now() - start);
+
+	/* All of the wide parent's children at once, then a page at a time */
+	start = now();
+	for (i = 0; i < BENCH_WALKS; ++i) {
+		sql_get_children(BENCH_WIDE_PARENT, &childc, &childv);
+		bad += childc != BENCH_WIDE;
+		for (j = 0; j < childc; ++j) {
+			free(childv[j]);
+		}
+		free(childv);
+	}
+	printf("%-6s %7d lists of %d children: %.3fs\n", what, BENCH_WALKS, BENCH_WIDE, now() - start);
+
+	start = now();
+	for (i = 0; i < BENCH_WALKS; ++i) {
+		it = sql_children_open(BENCH_WIDE_PARENT);
+		childc = 0;
+		while (it && (j = sql_children_next(it, &childv)) > 0) {
+			childc += j;
+		}
+		sql_children_close(it);
+		bad += childc != BENCH_WIDE;
+	}
+	printf("%-6s %7d walks of %d children: %.3fs\n", what, BENCH_WALKS, BENCH_WIDE, now() - start);
+	if (bad) {
+		printf("%-6s %7d wrong answers\n", what, bad);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 2 ? argv[2] : BENCH_DB;
+	int rows = argc > 1 ? atoi(argv[1]) : 1000000;
+	long rss;
+	double start;
+
+	if (argc > 3 || rows < BENCH_CHILDREN) {
+		printf("Usage %s [rows (at least %d)] [database]\n", argv[0], BENCH_CHILDREN);
+		return -1;
+	}
+
+	unlink(path);
+	sql_set_path(path);
+	if (sql_open() || sql_init_db()) {
+		sql_close();
+		return -1;
+	}
+
+	start = now();
+	if (populate(path, rows)) {
+		printf("Could not fill %s\n", path);
+		return -1;
+	}
+	printf("fill   %7d rows:                %.3fs\n", rows + BENCH_WIDE, now() - start);
+
+	lookups("sqlite", rows);
+
+	rss = max_rss();
+	start = now();
+	if (sql_cache_init()) {
+		printf("Could not load the cache\n");
+		return -1;
+	}
+	printf("load   %7d rows into memory:    %.3fs, %ld KiB\n", rows + BENCH_WIDE,
+	       now() - start, max_rss() - rss);
+
+	lookups("cache", rows);
+
+	sql_cache_destroy();
+	sql_close();
+	unlink(path);
+	return 0;
+}
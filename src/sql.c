@@ -22,8 +22,11 @@
 #include <sqlite3.h>
 #include <dirent.h>  /* PATH_MAX */
 #include <stdlib.h>  /* malloc */
-#include <unistd.h>  /* sleep */
 #include <string.h>  /* strcpy, strlen*/
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "sql.h"
 
@@ -31,12 +34,76 @@
 #define DEFS_DB "/var/lib/defs/defs.db"
 #define DEFS_TBL "MAP"
 
+/* How long a statement waits for another connection's lock, in ms */
+#define DEFS_BUSY_TIMEOUT 10000
 
-sqlite3 *db;
+/* How long changes gather before the cache writes them back, in ms */
+#define DEFS_GROUP_COMMIT 5
+
+/* Keys sql_get_links looks up in one query */
+#define SQL_BATCH 256
+
+
+/*
+ * Statements every connection prepares once and keeps, in the order of
+ * sql_stmt_text.  Paths are bound as parameters, never pasted in.
+ */
+enum {
+	SQL_UPDATE_SIZE,
+	SQL_ADD,
+	SQL_REMOVE_CHILD,
+	SQL_GET_LINK,
+	SQL_GET_CHILDREN,
+	SQL_CHILDREN_PAGE,
+	SQL_SET_PARENT,
+	SQL_LOAD,
+	SQL_GET_LINKS,
+	SQL_STMTS
+};
+
+/*
+ * Children among keys ?1..?SQL_BATCH with their size, then those keys that
+ * are parents, each once.  Made by sql_setup, unused keys are bound NULL.
+ */
+static char sql_links_text[256 + 12 * SQL_BATCH];
+
+static const char *sql_stmt_text[SQL_STMTS] = {
+	"UPDATE " DEFS_TBL " SET Size=?2 WHERE Child=?1",
+	"INSERT OR REPLACE INTO " DEFS_TBL " (Parent, Child, Size) VALUES (?1, ?2, ?3)",
+	"DELETE FROM " DEFS_TBL " WHERE Child=?1",
+	"SELECT Parent, Size FROM " DEFS_TBL " WHERE Child=?1",
+	"SELECT Child FROM " DEFS_TBL " WHERE Parent=?1",
+	"SELECT Child FROM " DEFS_TBL " WHERE Parent=?1 AND Child>?2 ORDER BY Child LIMIT ?3",
+	"UPDATE " DEFS_TBL " SET Parent=?2 WHERE Child=?1",
+	"SELECT Parent, Child, Size FROM " DEFS_TBL,
+	sql_links_text
+};
+
+
+/*
+ * SQLite connections are not to be shared between threads, so every
+ * thread gets its own, opened on first use.  When a thread exits its
+ * connection goes back to an idle list for the next new thread, as FUSE
+ * and the re-encode pool start and stop threads all the time.
+ */
+typedef struct sql_conn {
+	sqlite3 *db;
+	sqlite3_stmt *stmt[SQL_STMTS];  /* prepared on first use */
+	struct sql_conn *next;   /* on the idle list */
+	struct sql_conn *all;    /* every connection, for sql_close */
+	int txn;                 /* sql_begin nesting */
+} sql_conn_t;
+
+static pthread_key_t sql_key;
+static pthread_once_t sql_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sql_lock = PTHREAD_MUTEX_INITIALIZER;
+static sql_conn_t *sql_idle;
+static sql_conn_t *sql_all;
+static const char *sql_path = DEFS_DB;
 
 int sqlite_open(sqlite3 **database)
 {
-	return sqlite3_open(DEFS_DB, database);
+	return sqlite3_open(sql_path, database);
 }
 
 int sqlite_close(sqlite3 *database)
@@ -44,22 +111,6 @@ int sqlite_close(sqlite3 *database)
 	return sqlite3_close(database);
 }
 
-int sqlite_sanatize(const char* input, char* output)
-{
-	/* In SQL, we must translate single quotes (') into the escaped form ('') */
-	int i, j;
-	j = 0;
-	for (i = 0; i < strlen(input); ++i, ++j) {
-		output[j] = input[i];
-		if (input[i] ==  '\'') {
-			++j;
-			output[j] = '\'';
-		}
-	}
-	output[j] = '\0';
-	return 0;
-}
-
 static int sqlite_callback(void *NotUsed, int argc, char **argv, char **azColName)
 {
 	int i;
@@ -70,262 +121,1654 @@ static int sqlite_callback(void *NotUsed, int argc, char **argv, char **azColNam
 	return 0;
 }
 
-int sqlite_init_db(sqlite3 *database)
+/*
+ * Returns statement which of conn, prepared on first use, NULL on error
+ */
+static sqlite3_stmt *sqlite_stmt(sql_conn_t *conn, int which)
 {
 	int rc;
-	char cmd[50+2*PATH_MAX];
-	char *zErrMsg = 0;
-	snprintf(cmd, 50+2*PATH_MAX, "CREATE TABLE %s (Parent varchar(%d), Child varchar(%d), Size integer)", DEFS_TBL, PATH_MAX, PATH_MAX);
-	rc = sqlite3_exec(database, cmd, sqlite_callback, 0, &zErrMsg);
-	return 0;
+
+	if (!conn) {
+		return NULL;
+	}
+	if (!conn->stmt[which]) {
+		rc = sqlite3_prepare_v2(conn->db, sql_stmt_text[which], -1, &conn->stmt[which], NULL);
+		if (rc != SQLITE_OK) {
+			fprintf(stderr, "sql error #%d: %s\n", rc, sqlite3_errmsg(conn->db));
+			conn->stmt[which] = NULL;
+			return NULL;
+		}
+	}
+	return conn->stmt[which];
 }
 
+/*
+ * Step a statement returning no rows to the end and reset it for reuse
+ */
+static int sqlite_run(sql_conn_t *conn, sqlite3_stmt *stmt)
+{
+	int rc;
+
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "step error: %s\n", sqlite3_errmsg(conn->db));
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/*
+ * Reset a statement that returned rows for reuse
+ */
+static void sqlite_done(sqlite3_stmt *stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
 
-int sqlite_update_size(sqlite3 *database, const char* child, int size)
+int sqlite_init_db(sqlite3 *database)
 {
 	int rc;
 	char cmd[50+2*PATH_MAX];
 	char *zErrMsg = 0;
+	snprintf(cmd, 50+2*PATH_MAX, "CREATE TABLE %s (Parent varchar(%d), Child varchar(%d), Size integer)", DEFS_TBL, PATH_MAX, PATH_MAX);
+	rc = sqlite3_exec(database, cmd, sqlite_callback, 0, &zErrMsg);
+	sqlite3_free(zErrMsg);
 
-	char* child_s = malloc(2*PATH_MAX*sizeof(char));
-  
-	rc = sqlite_sanatize(child, child_s);
+	/* Readers don't block the writer, and a commit is one append and sync */
+	rc = sqlite3_exec(database, "PRAGMA journal_mode=WAL", NULL, 0, &zErrMsg);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "sql error #%d: %s\n", rc, zErrMsg);
+	}
+	sqlite3_free(zErrMsg);
 
-	snprintf(cmd, 50+2*PATH_MAX, "UPDATE %s SET Size='%d' WHERE Child='%s'", DEFS_TBL, size, child_s);
-	rc = sqlite3_exec(database, cmd, sqlite_callback, 0, &zErrMsg);
-	if (rc!=SQLITE_OK) {
-		printf("SQL error: %s\n", zErrMsg);
-		fflush(NULL);
+	/* Lookups go by Child, and by Parent in Child order to page through children */
+	rc = sqlite3_exec(database,
+			  "CREATE UNIQUE INDEX IF NOT EXISTS " DEFS_TBL "_Child ON " DEFS_TBL " (Child);"
+			  "DROP INDEX IF EXISTS " DEFS_TBL "_Parent;"
+			  "CREATE INDEX IF NOT EXISTS " DEFS_TBL "_Parent_Child ON " DEFS_TBL " (Parent, Child);",
+			  NULL, 0, &zErrMsg);
+	if (rc == SQLITE_CONSTRAINT) {
+		/* Older databases could hold a child twice, the last one added counts */
+		sqlite3_free(zErrMsg);
+		rc = sqlite3_exec(database,
+				  "DELETE FROM " DEFS_TBL " WHERE rowid NOT IN "
+				  "(SELECT MAX(rowid) FROM " DEFS_TBL " GROUP BY Child);"
+				  "CREATE UNIQUE INDEX IF NOT EXISTS " DEFS_TBL "_Child ON " DEFS_TBL " (Child);"
+				  "DROP INDEX IF EXISTS " DEFS_TBL "_Parent;"
+				  "CREATE INDEX IF NOT EXISTS " DEFS_TBL "_Parent_Child ON " DEFS_TBL " (Parent, Child);",
+				  NULL, 0, &zErrMsg);
+	}
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "sql error #%d: %s\n", rc, zErrMsg);
 		sqlite3_free(zErrMsg);
+		return -1;
 	}
-  
-	free(child_s);
 	return 0;
 }
 
 
+int sqlite_update_size(sql_conn_t *conn, const char* child, int64_t size)
+{
+	sqlite3_stmt *stmt = sqlite_stmt(conn, SQL_UPDATE_SIZE);
+
+	if (!stmt) {
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, child, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, size);
+	return sqlite_run(conn, stmt);
+}
+
+
 /*
  * adds an entry linking parent to child
  */
-int sqlite_add(sqlite3 *database, const char* parent, const char* child, const int size)
+int sqlite_add(sql_conn_t *conn, const char* parent, const char* child, const int64_t size)
 {
-	int rc;
-	char cmd[50+2*PATH_MAX];
-	char *zErrMsg = 0;
+	sqlite3_stmt *stmt = sqlite_stmt(conn, SQL_ADD);
+
+	if (!stmt) {
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, parent, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, child, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 3, size);
+	return sqlite_run(conn, stmt);
+}
 
-	char* parent_s = malloc(2*PATH_MAX*sizeof(char));
-	char* child_s = malloc(2*PATH_MAX*sizeof(char));
+/*
+ * removes the entry linking the parent to this child 
+ */
+int sqlite_remove_child(sql_conn_t *conn, const char* child)
+{
+	sqlite3_stmt *stmt = sqlite_stmt(conn, SQL_REMOVE_CHILD);
 
-	rc = sqlite_sanatize(parent, parent_s);
-	rc = sqlite_sanatize(child, child_s);
-  
-	snprintf(cmd, 50+2*PATH_MAX, "INSERT INTO %s VALUES (\'%s\',\'%s\', '%d')", DEFS_TBL, parent_s, child_s, size);
-	rc = sqlite3_exec(database, cmd, sqlite_callback, 0, &zErrMsg);
-	if (rc!=SQLITE_OK) {
-		printf("SQL error: %s\n", zErrMsg);
-		fflush(NULL);
-		sqlite3_free(zErrMsg);
+	if (!stmt) {
+		return -1;
 	}
+	sqlite3_bind_text(stmt, 1, child, -1, SQLITE_STATIC);
+	return sqlite_run(conn, stmt);
+}
 
-	free(parent_s);
-	free(child_s);
-	return 0;
+/*
+ * moves a child to another parent
+ */
+int sqlite_set_parent(sql_conn_t *conn, const char* child, const char* parent)
+{
+	sqlite3_stmt *stmt = sqlite_stmt(conn, SQL_SET_PARENT);
+
+	if (!stmt) {
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, child, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, parent, -1, SQLITE_STATIC);
+	return sqlite_run(conn, stmt);
 }
 
 /*
- * removes the entry linking the parent to this child 
+ * returns the parent (malloc'ed, NULL if it isn't a child) and size of a
+ * given child in one lookup
  */
-int sqlite_remove_child(sqlite3 *database, const char* child)
+int sqlite_get_parent_size(sql_conn_t *conn, const char* child, char** parent, int64_t* size)
 {
+	sqlite3_stmt *stmt = sqlite_stmt(conn, SQL_GET_LINK);
 	int rc;
-	char cmd[50+2*PATH_MAX];
-	char *zErrMsg = 0;
 
-	char* child_s = malloc(2*PATH_MAX*sizeof(char));
-  
-	rc = sqlite_sanatize(child, child_s);
-
-	snprintf(cmd, 50+2*PATH_MAX, "DELETE FROM %s WHERE Child='%s'", DEFS_TBL, child_s);
-	rc = sqlite3_exec(database, cmd, sqlite_callback, 0, &zErrMsg);
-	if (rc!=SQLITE_OK) {
-		printf("SQL error: %s\n", zErrMsg);
-		fflush(NULL);
-		sqlite3_free(zErrMsg);
+	if (!stmt) {
+		return -1;
 	}
-  
-	free(child_s);
-	return 0;
+	sqlite3_bind_text(stmt, 1, child, -1, SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW) {
+		if (parent) {
+			*parent = strdup((const char *) sqlite3_column_text(stmt, 0));
+		}
+		if (size) {
+			*size = sqlite3_column_int64(stmt, 1);
+		}
+	} else if (rc != SQLITE_DONE) {
+		fprintf(stderr, "step error: %s\n", sqlite3_errmsg(conn->db));
+	}
+	sqlite_done(stmt);
+	return rc == SQLITE_ROW || rc == SQLITE_DONE ? 0 : -1;
 }
 
-int sqlite_get_size(sqlite3 *database, const char* child)
+int sqlite_get_children(sql_conn_t *conn, const char* parent, int *childc, char** *childv)
 {
-	int rc, retval;
-	char cmd[50+2*PATH_MAX];
-	sqlite3_stmt *stmt;
+	sqlite3_stmt *stmt = sqlite_stmt(conn, SQL_GET_CHILDREN);
+	char **v;
+	int rc, room = 0;
 
-	char* child_s = malloc(2*PATH_MAX*sizeof(char));
-
-	rc = sqlite_sanatize(child, child_s);
-
-	snprintf(cmd, 50+2*PATH_MAX, "SELECT Size FROM %s WHERE Child='%s'", DEFS_TBL, child_s);
-	rc = sqlite3_prepare(database, cmd, (50+2*PATH_MAX)*sizeof(char), &stmt, 0);
-	if (rc!=SQLITE_OK) {
-		fprintf(stderr, "sql error #%d: %s\n", rc, sqlite3_errmsg(database));
-	} 
-	else {
-		while ((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
-			switch (rc) {
-			case SQLITE_BUSY:
-				fprintf(stderr, "busy, wait 1 seconds\n");
-				sleep(1);
-				break;
-			case SQLITE_ERROR:
-				fprintf(stderr, "step error: %s\n", sqlite3_errmsg(database));
-				break;
-			case SQLITE_ROW:
-				retval = sqlite3_column_int(stmt,0);
+	*childc = 0;
+	(*childv) = NULL;
+
+	if (!stmt) {
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, parent, -1, SQLITE_STATIC);
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (*childc == room) {
+			room = room ? 2 * room : 16;
+			v = realloc((*childv), room * sizeof(char*));
+			if (!v) {
 				break;
 			}
+			(*childv) = v;
+		}
+		(*childv)[*childc] = strdup((const char *) sqlite3_column_text(stmt, 0));
+		if (!(*childv)[*childc]) {
+			break;
 		}
+		*childc = *childc + 1;
 	}
-	sqlite3_finalize(stmt);
-  
-	free(child_s);
-	return retval;
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "step error: %s\n", sqlite3_errmsg(conn->db));
+	}
+	sqlite_done(stmt);
+	return rc == SQLITE_DONE ? 0 : -1;
 }
 
-int sqlite_get_children(sqlite3 *database, const char* parent, int *childc, char** *childv)
+/*
+ * Fill childv with up to max children of parent named after after, in
+ * name order
+ * Returns how many, -1 on error
+ */
+static int sqlite_children_page(sql_conn_t *conn, const char *parent, const char *after, int max, char **childv)
 {
-	int rc;
-	char cmd[50+2*PATH_MAX];
-	sqlite3_stmt *stmt;
-	char temp[PATH_MAX];
+	sqlite3_stmt *stmt = sqlite_stmt(conn, SQL_CHILDREN_PAGE);
+	int rc, n = 0;
+
+	if (!stmt) {
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, parent, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, after, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 3, max);
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		childv[n] = strdup((const char *) sqlite3_column_text(stmt, 0));
+		if (!childv[n]) {
+			break;
+		}
+		++n;
+	}
+	if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+		fprintf(stderr, "step error: %s\n", sqlite3_errmsg(conn->db));
+	}
+	sqlite_done(stmt);
+	if (rc != SQLITE_DONE) {
+		while (n) {
+			free(childv[--n]);
+		}
+		return -1;
+	}
+	return n;
+}
 
-	char* parent_s = malloc(2*PATH_MAX*sizeof(char));
+/*
+ * A key of a sql_get_links batch, sorted to match rows back to it
+ */
+typedef struct {
+	const char *key;
+	int i;
+} sql_batch_key_t;
 
-	*childc = 0;
-	(*childv) = NULL;
+static int sql_batch_cmp(const void *a, const void *b)
+{
+	return strcmp(((const sql_batch_key_t *) a)->key, ((const sql_batch_key_t *) b)->key);
+}
 
-	rc = sqlite_sanatize(parent, parent_s);
+int sqlite_get_links(sql_conn_t *conn, int keyc, char **keyv, int64_t *sizev)
+{
+	sqlite3_stmt *stmt = sqlite_stmt(conn, SQL_GET_LINKS);
+	sql_batch_key_t batch[SQL_BATCH];
+	sql_batch_key_t want, *found;
+	int start, n, i, rc = SQLITE_DONE;
 
-	snprintf(cmd, 50+2*PATH_MAX, "SELECT Child FROM %s WHERE Parent='%s'", DEFS_TBL, parent_s);
-	rc = sqlite3_prepare(database, cmd, (50+2*PATH_MAX)*sizeof(char), &stmt, 0);
-	if (rc!=SQLITE_OK) {
-		printf("sql error #%d: %s\n", rc, sqlite3_errmsg(database)); 
+	for (i = 0; i < keyc; ++i) {
+		sizev[i] = SQL_LINK_NONE;
+	}
+	if (!stmt) {
 		return -1;
 	}
-	else {
-		while ((*childc < 255) && (rc != SQLITE_DONE)) {
-			rc = sqlite3_step(stmt);
-			switch(rc) {
-			case SQLITE_BUSY:  /* in the future, make sure we don't wait forever if it's locked */
-				printf("busy, wait 1 seconds\n");
-				sleep(1);
-				break;
-			case SQLITE_ERROR:
-				printf("step error: %s\n", sqlite3_errmsg(database));
-				break;
-			case SQLITE_ROW:
-				sprintf(temp,"%s",sqlite3_column_text(stmt,0));
-				(*childv) = realloc((*childv), (*childc+1)*sizeof(char*));
-				(*childv)[*childc] = strdup(temp);
-				*childc = *childc + 1;
-				break;
+	for (start = 0; start < keyc && rc == SQLITE_DONE; start += n) {
+		n = keyc - start < SQL_BATCH ? keyc - start : SQL_BATCH;
+		for (i = 0; i < n; ++i) {
+			batch[i].key = keyv[start + i];
+			batch[i].i = start + i;
+			sqlite3_bind_text(stmt, i + 1, keyv[start + i], -1, SQLITE_STATIC);
+		}
+		qsort(batch, n, sizeof(sql_batch_key_t), sql_batch_cmp);
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+			want.key = (const char *) sqlite3_column_text(stmt, 0);
+			found = bsearch(&want, batch, n, sizeof(sql_batch_key_t), sql_batch_cmp);
+			if (found && sizev[found->i] == SQL_LINK_NONE) {
+				sizev[found->i] = sqlite3_column_int64(stmt, 1);
 			}
 		}
+		if (rc != SQLITE_DONE) {
+			fprintf(stderr, "step error: %s\n", sqlite3_errmsg(conn->db));
+		}
+		sqlite_done(stmt);
 	}
+	return rc == SQLITE_DONE ? 0 : -1;
+}
 
-	sqlite3_finalize(stmt);
-  
-	free(parent_s);
-	return 0;
+
+/*
+ * Thread exit, keep the connection for another thread
+ */
+static void sql_conn_release(void *arg)
+{
+	sql_conn_t *conn = (sql_conn_t *) arg;
+
+	pthread_mutex_lock(&sql_lock);
+	conn->next = sql_idle;
+	sql_idle = conn;
+	pthread_mutex_unlock(&sql_lock);
+}
+
+static void sql_setup()
+{
+	char list[6 * SQL_BATCH];
+	int i, len = 0;
+
+	for (i = 1; i <= SQL_BATCH; ++i) {
+		len += sprintf(list + len, i > 1 ? ",?%d" : "?%d", i);
+	}
+	sprintf(sql_links_text,
+		"SELECT Child, Size FROM " DEFS_TBL " WHERE Child IN (%s) UNION ALL "
+		"SELECT Parent, %d FROM " DEFS_TBL " WHERE Parent IN (%s) GROUP BY Parent",
+		list, SQL_LINK_PARENT, list);
+	pthread_key_create(&sql_key, sql_conn_release);
 }
 
 /*
- * returns the parent of a given child
+ * Returns the connection of the calling thread, opening one if needed,
+ * NULL on error
  */
-int sqlite_get_parent(sqlite3 *database, const char* child, char** parent)
+static sql_conn_t *sql_conn()
 {
+	sql_conn_t *conn;
 	int rc;
-	char cmd[50+2*PATH_MAX];
-	sqlite3_stmt *stmt;
-	char temp[PATH_MAX];
-
-	char* child_s = malloc(2*PATH_MAX*sizeof(char));
-
-	rc = sqlite_sanatize(child, child_s);
-
-	snprintf(cmd, 50+2*PATH_MAX, "SELECT Parent FROM %s WHERE Child='%s'", DEFS_TBL, child_s);
-	rc = sqlite3_prepare(database, cmd, (50+2*PATH_MAX)*sizeof(char), &stmt, 0);
-	if (rc!=SQLITE_OK) {
-		fprintf(stderr, "sql error #%d: %s\n", rc, sqlite3_errmsg(database));
-	} 
-	else {
-		while ((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
-			switch (rc) {
-			case SQLITE_BUSY:
-				fprintf(stderr, "busy, wait 1 seconds\n");
-				sleep(1);
-				break;
-			case SQLITE_ERROR:
-				fprintf(stderr, "step error: %s\n", sqlite3_errmsg(database));
-				break;
-			case SQLITE_ROW:
-				*parent = malloc(PATH_MAX*sizeof(char));
-				sprintf(temp, "%s", sqlite3_column_text(stmt,0));
-				strcpy(*parent, temp);
-				break;
-			}
+
+	pthread_once(&sql_once, sql_setup);
+	conn = (sql_conn_t *) pthread_getspecific(sql_key);
+	if (conn) {
+		return conn;
+	}
+
+	pthread_mutex_lock(&sql_lock);
+	conn = sql_idle;
+	if (conn) {
+		sql_idle = conn->next;
+	}
+	pthread_mutex_unlock(&sql_lock);
+
+	if (!conn) {
+		conn = calloc(1, sizeof(sql_conn_t));
+		if (!conn) {
+			return NULL;
+		}
+		rc = sqlite_open(&conn->db);
+		if (rc != SQLITE_OK) {
+			fprintf(stderr, "sql error #%d: %s\n", rc, sqlite3_errmsg(conn->db));
+			sqlite_close(conn->db);
+			free(conn);
+			return NULL;
 		}
+		sqlite3_busy_timeout(conn->db, DEFS_BUSY_TIMEOUT);
+
+		pthread_mutex_lock(&sql_lock);
+		conn->all = sql_all;
+		sql_all = conn;
+		pthread_mutex_unlock(&sql_lock);
 	}
-	sqlite3_finalize(stmt);
-  
-	free(child_s);
-	return 0;
+
+	pthread_setspecific(sql_key, conn);
+	return conn;
 }
 
 
-int sql_open()
+/*
+ * With the cache on, the whole table lives in memory: a hash of the
+ * children, each pointing at its parent, and a hash of the parents, each
+ * with its children in the order they were added.  Lookups never touch
+ * SQLite.  Changes are made in memory and queued, in the same order, for
+ * a writer thread that applies them to the database on its own connection.
+ * Since that thread is the only writer in the process, a change of
+ * PRAGMA data_version on its connection means another process (dln) wrote
+ * to the table, and the table is loaded again.
+ */
+typedef struct sql_parent sql_parent_t;
+
+typedef struct sql_link {
+	char *child;
+	sql_parent_t *parent;
+	int64_t size;
+	struct sql_link *hnext;      /* hash chain */
+	struct sql_link *prev;       /* siblings, oldest first */
+	struct sql_link *next;
+} sql_link_t;
+
+struct sql_parent {
+	char *path;
+	sql_link_t *head;
+	sql_link_t *tail;
+	int childc;
+	struct sql_parent *hnext;    /* hash chain */
+};
+
+typedef struct {
+	sql_link_t **links;
+	size_t linkc;
+	size_t linkb;                /* buckets, a power of two */
+	sql_parent_t **parents;
+	size_t parentc;
+	size_t parentb;
+} sql_map_t;
+
+typedef struct sql_op {
+	int which;                   /* statement to run */
+	char *child;
+	char *parent;
+	int64_t size;
+	struct sql_op *next;
+} sql_op_t;
+
+static struct {
+	int on;
+	pthread_rwlock_t lock;       /* map, taken before qlock */
+	sql_map_t map;
+	pthread_mutex_t qlock;       /* everything below */
+	pthread_cond_t cond;         /* wakes the writer */
+	pthread_cond_t done;         /* wakes sql_sync and sql_cache_init */
+	pthread_t thread;
+	int running;
+	int loaded;                  /* 1 once loaded, -1 if that failed */
+	int stop;
+	sql_op_t *head;
+	sql_op_t *tail;
+	uint64_t queued;             /* ops ever queued */
+	uint64_t written;            /* ops ever applied */
+	uint64_t failures;           /* batches that failed to commit */
+	uint64_t reported;           /* failures some sql_sync returned */
+	uint64_t commits;
+	int txns;                    /* open sql_begin, their ops must commit together */
+	int syncers;                 /* threads in sql_sync, commit right away */
+} sql_cache = { 0, PTHREAD_RWLOCK_INITIALIZER, { NULL },
+		PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+		PTHREAD_COND_INITIALIZER };
+
+#define SQL_MAP_MIN_BUCKETS 1024
+
+/*
+ * Most files are neither parents nor children.  A Bloom filter over the
+ * children and the parents of the map answers that without the lock:
+ * bits are only ever set, with atomics, and rebuilt (when it fills up, or
+ * after a reload) under the map lock inside a sequence count, which
+ * readers check to tell a torn answer.  Arrays outgrown are kept until
+ * the cache goes, readers may still be looking at them.
+ */
+#define SQL_FILTER_MIN_BITS (1 << 16)
+#define SQL_FILTER_BITS_PER_KEY 16
+#define SQL_FILTER_HASHES 3
+
+enum {
+	SQL_KEY_CHILD,
+	SQL_KEY_PARENT
+};
+
+typedef struct sql_bits {
+	uint64_t mask;               /* bits - 1 */
+	struct sql_bits *retired;    /* outgrown before this one */
+	uint64_t word[1];
+} sql_bits_t;
+
+static struct {
+	unsigned int seq;            /* odd while rebuilding */
+	sql_bits_t *bits;
+	size_t keys;                 /* set since the last rebuild */
+} sql_filter;
+
+/* Bumped whenever a link is added, moved or removed */
+static unsigned int sql_gen;
+
+static size_t sql_hash(const char *path, size_t buckets)
 {
-	return sqlite_open(&db);
+	/* FNV-1a */
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*path) {
+		h ^= (unsigned char) *path++;
+		h *= 1099511628211ULL;
+	}
+	return (size_t) (h ^ (h >> 32)) & (buckets - 1);
 }
 
-int sql_close()
+static sql_link_t *sql_map_find(sql_map_t *map, const char *child)
 {
-	return sqlite_close(db);
+	sql_link_t *l;
+
+	if (!map->linkb) {
+		return NULL;
+	}
+	for (l = map->links[sql_hash(child, map->linkb)]; l; l = l->hnext) {
+		if (!strcmp(l->child, child)) {
+			return l;
+		}
+	}
+	return NULL;
 }
 
-int sql_init_db()
+static sql_parent_t *sql_map_find_parent(sql_map_t *map, const char *path)
+{
+	sql_parent_t *p;
+
+	if (!map->parentb) {
+		return NULL;
+	}
+	for (p = map->parents[sql_hash(path, map->parentb)]; p; p = p->hnext) {
+		if (!strcmp(p->path, path)) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the buckets of the child hash once it holds as many links
+ */
+static int sql_map_grow_links(sql_map_t *map)
+{
+	sql_link_t **links, *l, *next;
+	size_t b = map->linkb ? map->linkb * 2 : SQL_MAP_MIN_BUCKETS;
+	size_t i, h;
+
+	links = calloc(b, sizeof(sql_link_t *));
+	if (!links) {
+		return -1;
+	}
+	for (i = 0; i < map->linkb; ++i) {
+		for (l = map->links[i]; l; l = next) {
+			next = l->hnext;
+			h = sql_hash(l->child, b);
+			l->hnext = links[h];
+			links[h] = l;
+		}
+	}
+	free(map->links);
+	map->links = links;
+	map->linkb = b;
+	return 0;
+}
+
+static int sql_map_grow_parents(sql_map_t *map)
+{
+	sql_parent_t **parents, *p, *next;
+	size_t b = map->parentb ? map->parentb * 2 : SQL_MAP_MIN_BUCKETS;
+	size_t i, h;
+
+	parents = calloc(b, sizeof(sql_parent_t *));
+	if (!parents) {
+		return -1;
+	}
+	for (i = 0; i < map->parentb; ++i) {
+		for (p = map->parents[i]; p; p = next) {
+			next = p->hnext;
+			h = sql_hash(p->path, b);
+			p->hnext = parents[h];
+			parents[h] = p;
+		}
+	}
+	free(map->parents);
+	map->parents = parents;
+	map->parentb = b;
+	return 0;
+}
+
+/*
+ * Take a link out of the map, and its parent with it once it has no
+ * children left
+ */
+static void sql_map_unlink(sql_map_t *map, sql_link_t *l)
 {
-	return sqlite_init_db(db);
+	sql_parent_t *p = l->parent;
+	sql_link_t **lp = &map->links[sql_hash(l->child, map->linkb)];
+	sql_parent_t **pp;
+
+	while (*lp != l) {
+		lp = &(*lp)->hnext;
+	}
+	*lp = l->hnext;
+	map->linkc--;
+
+	if (l->prev) {
+		l->prev->next = l->next;
+	} else {
+		p->head = l->next;
+	}
+	if (l->next) {
+		l->next->prev = l->prev;
+	} else {
+		p->tail = l->prev;
+	}
+	p->childc--;
+
+	if (!p->childc) {
+		pp = &map->parents[sql_hash(p->path, map->parentb)];
+		while (*pp != p) {
+			pp = &(*pp)->hnext;
+		}
+		*pp = p->hnext;
+		map->parentc--;
+		free(p->path);
+		free(p);
+	}
 }
 
-int sql_update_size(const char* child, const int size)
+/*
+ * Append l as the youngest child of parent
+ */
+static int sql_map_attach(sql_map_t *map, sql_link_t *l, const char *parent)
 {
-	return sqlite_update_size(db, child, size);
+	sql_parent_t *p = sql_map_find_parent(map, parent);
+	size_t h;
+
+	if (!p) {
+		if (map->parentc >= map->parentb && sql_map_grow_parents(map)) {
+			return -1;
+		}
+		p = calloc(1, sizeof(sql_parent_t));
+		if (!p || !(p->path = strdup(parent))) {
+			free(p);
+			return -1;
+		}
+		h = sql_hash(parent, map->parentb);
+		p->hnext = map->parents[h];
+		map->parents[h] = p;
+		map->parentc++;
+	}
+
+	l->parent = p;
+	l->prev = p->tail;
+	l->next = NULL;
+	if (p->tail) {
+		p->tail->next = l;
+	} else {
+		p->head = l;
+	}
+	p->tail = l;
+	p->childc++;
+
+	h = sql_hash(l->child, map->linkb);
+	l->hnext = map->links[h];
+	map->links[h] = l;
+	map->linkc++;
+	return 0;
 }
 
-int sql_add(const char* parent, const char* child, const int size)
+/*
+ * Link child to parent, replacing any link the child had
+ */
+static int sql_map_add(sql_map_t *map, const char *parent, const char *child, int64_t size)
 {
-	return sqlite_add(db, parent, child, size);
+	sql_link_t *l = sql_map_find(map, child);
+
+	if (l) {
+		sql_map_unlink(map, l);
+	} else {
+		if (map->linkc >= map->linkb && sql_map_grow_links(map)) {
+			return -1;
+		}
+		l = malloc(sizeof(sql_link_t));
+		if (!l || !(l->child = strdup(child))) {
+			free(l);
+			return -1;
+		}
+	}
+	l->size = size;
+	if (sql_map_attach(map, l, parent)) {
+		free(l->child);
+		free(l);
+		return -1;
+	}
+	return 0;
 }
 
-int sql_get_size(const char* child)
+static void sql_map_free(sql_map_t *map)
 {
-	return sqlite_get_size(db, child);
+	sql_parent_t *p, *pnext;
+	sql_link_t *l, *lnext;
+	size_t i;
+
+	for (i = 0; i < map->parentb; ++i) {
+		for (p = map->parents[i]; p; p = pnext) {
+			pnext = p->hnext;
+			for (l = p->head; l; l = lnext) {
+				lnext = l->next;
+				free(l->child);
+				free(l);
+			}
+			free(p->path);
+			free(p);
+		}
+	}
+	free(map->links);
+	free(map->parents);
+	memset(map, 0, sizeof(sql_map_t));
 }
 
-int sql_get_children(const char* parent, int* childc, char*** childv)
+static uint64_t sql_filter_key(const char *path, int role)
 {
-	return sqlite_get_children(db, parent, childc, childv);
+	/* FNV-1a, mixed so the hashes derived from it are independent */
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*path) {
+		h ^= (unsigned char) *path++;
+		h *= 1099511628211ULL;
+	}
+	h ^= role;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
 }
 
-int sql_get_parent(const char* child, char** parent)
+static void sql_bits_set(sql_bits_t *b, uint64_t h)
 {
-	return sqlite_get_parent(db, child, parent);
+	uint64_t i, bit;
+
+	for (i = 0; i < SQL_FILTER_HASHES; ++i) {
+		bit = (h + i * ((h >> 32) | 1)) & b->mask;
+		__atomic_fetch_or(&b->word[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELAXED);
+	}
 }
 
-int sql_remove_child(const char* child)
+static int sql_bits_test(sql_bits_t *b, uint64_t h)
+{
+	uint64_t i, bit;
+
+	for (i = 0; i < SQL_FILTER_HASHES; ++i) {
+		bit = (h + i * ((h >> 32) | 1)) & b->mask;
+		if (!(__atomic_load_n(&b->word[bit >> 6], __ATOMIC_RELAXED) & (1ULL << (bit & 63)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Fill the filter from the map again, growing it to fit twice the keys
+ * there are now.  Called with the map locked for writing.
+ */
+static void sql_filter_rebuild()
+{
+	sql_bits_t *b = sql_filter.bits;
+	sql_parent_t *p;
+	sql_link_t *l;
+	size_t keys = sql_cache.map.linkc + sql_cache.map.parentc;
+	uint64_t bits = SQL_FILTER_MIN_BITS;
+	size_t i;
+
+	while (bits < 2 * keys * SQL_FILTER_BITS_PER_KEY) {
+		bits *= 2;
+	}
+
+	__atomic_store_n(&sql_filter.seq, sql_filter.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (!b || b->mask + 1 < bits) {
+		b = calloc(1, sizeof(sql_bits_t) + (bits / 64) * sizeof(uint64_t));
+		if (!b) {
+			/* Leave it odd, lookups then always take the lock */
+			return;
+		}
+		b->mask = bits - 1;
+		b->retired = sql_filter.bits;
+		__atomic_store_n(&sql_filter.bits, b, __ATOMIC_RELEASE);
+	} else {
+		for (i = 0; i <= b->mask / 64; ++i) {
+			__atomic_store_n(&b->word[i], 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	for (i = 0; i < sql_cache.map.parentb; ++i) {
+		for (p = sql_cache.map.parents[i]; p; p = p->hnext) {
+			sql_bits_set(b, sql_filter_key(p->path, SQL_KEY_PARENT));
+			for (l = p->head; l; l = l->next) {
+				sql_bits_set(b, sql_filter_key(l->child, SQL_KEY_CHILD));
+			}
+		}
+	}
+	sql_filter.keys = keys;
+
+	__atomic_store_n(&sql_filter.seq, sql_filter.seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Add path in role, called with the map locked for writing
+ */
+static void sql_filter_add(const char *path, int role)
+{
+	if (sql_filter.seq & 1) {
+		return;
+	}
+	sql_bits_set(sql_filter.bits, sql_filter_key(path, role));
+	if (++sql_filter.keys * SQL_FILTER_BITS_PER_KEY > sql_filter.bits->mask + 1) {
+		sql_filter_rebuild();
+	}
+}
+
+/*
+ * Returns 0 if path is for sure not in the map in role, without locking
+ */
+static int sql_filter_test(const char *path, int role)
+{
+	unsigned int seq = __atomic_load_n(&sql_filter.seq, __ATOMIC_ACQUIRE);
+	sql_bits_t *b;
+	int hit;
+
+	if (seq & 1) {
+		return 1;
+	}
+	b = __atomic_load_n(&sql_filter.bits, __ATOMIC_ACQUIRE);
+	if (!b) {
+		return 1;
+	}
+	hit = sql_bits_test(b, sql_filter_key(path, role));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return hit || __atomic_load_n(&sql_filter.seq, __ATOMIC_RELAXED) != seq;
+}
+
+static void sql_filter_free()
+{
+	sql_bits_t *b, *retired;
+
+	for (b = sql_filter.bits; b; b = retired) {
+		retired = b->retired;
+		free(b);
+	}
+	sql_filter.bits = NULL;
+	sql_filter.seq = 0;
+	sql_filter.keys = 0;
+}
+
+static void sql_gen_bump()
+{
+	__atomic_add_fetch(&sql_gen, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Read the whole table into map
+ */
+static int sql_map_load(sql_conn_t *conn, sql_map_t *map)
+{
+	sqlite3_stmt *stmt = sqlite_stmt(conn, SQL_LOAD);
+	int rc;
+
+	memset(map, 0, sizeof(sql_map_t));
+	if (!stmt) {
+		return -1;
+	}
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (sql_map_add(map, (const char *) sqlite3_column_text(stmt, 0),
+				(const char *) sqlite3_column_text(stmt, 1),
+				sqlite3_column_int64(stmt, 2))) {
+			break;
+		}
+	}
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "step error: %s\n", sqlite3_errmsg(conn->db));
+		sql_map_free(map);
+	}
+	sqlite_done(stmt);
+	return rc == SQLITE_DONE ? 0 : -1;
+}
+
+static int sql_data_version(sql_conn_t *conn)
+{
+	sqlite3_stmt *stmt;
+	int v = -1;
+
+	if (sqlite3_prepare_v2(conn->db, "PRAGMA data_version", -1, &stmt, NULL) != SQLITE_OK) {
+		return -1;
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		v = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+	return v;
+}
+
+/*
+ * Queue a change already made to the map for the writer, called with the
+ * map locked so the queue keeps the order of the changes.  op comes from
+ * sql_op_new.
+ */
+static void sql_queue(sql_op_t *op)
+{
+	pthread_mutex_lock(&sql_cache.qlock);
+	op->next = NULL;
+	if (sql_cache.tail) {
+		sql_cache.tail->next = op;
+	} else {
+		sql_cache.head = op;
+	}
+	sql_cache.tail = op;
+	sql_cache.queued++;
+	pthread_cond_signal(&sql_cache.cond);
+	pthread_mutex_unlock(&sql_cache.qlock);
+}
+
+static void sql_op_free(sql_op_t *op)
+{
+	if (op) {
+		free(op->child);
+		free(op->parent);
+		free(op);
+	}
+}
+
+static sql_op_t *sql_op_new(int which, const char *child, const char *parent, int64_t size)
+{
+	sql_op_t *op = calloc(1, sizeof(sql_op_t));
+
+	if (!op) {
+		return NULL;
+	}
+	op->which = which;
+	op->size = size;
+	op->child = strdup(child);
+	op->parent = parent ? strdup(parent) : NULL;
+	if (!op->child || (parent && !op->parent)) {
+		sql_op_free(op);
+		return NULL;
+	}
+	return op;
+}
+
+static int sql_op_apply(sql_conn_t *conn, sql_op_t *op)
+{
+	switch (op->which) {
+	case SQL_UPDATE_SIZE:
+		return sqlite_update_size(conn, op->child, op->size);
+	case SQL_ADD:
+		return sqlite_add(conn, op->parent, op->child, op->size);
+	case SQL_REMOVE_CHILD:
+		return sqlite_remove_child(conn, op->child);
+	case SQL_SET_PARENT:
+		return sqlite_set_parent(conn, op->child, op->parent);
+	}
+	return -1;
+}
+
+/*
+ * Load the table again after another process changed it.  Called with
+ * everything up to queued written; if a change of our own was queued
+ * meanwhile, version is left for the next try.
+ */
+static void sql_cache_reload(sql_conn_t *conn, int *version, uint64_t queued)
+{
+	sql_map_t map, old;
+	int v = sql_data_version(conn);
+	int swapped = 0;
+
+	if (v == *version || sql_map_load(conn, &map)) {
+		return;
+	}
+
+	pthread_rwlock_wrlock(&sql_cache.lock);
+	pthread_mutex_lock(&sql_cache.qlock);
+	if (sql_cache.queued == queued) {
+		old = sql_cache.map;
+		sql_cache.map = map;
+		map = old;
+		swapped = 1;
+		sql_filter_rebuild();
+		sql_gen_bump();
+	}
+	pthread_mutex_unlock(&sql_cache.qlock);
+	pthread_rwlock_unlock(&sql_cache.lock);
+	sql_map_free(&map);
+	if (swapped) {
+		*version = v;
+	}
+}
+
+/*
+ * Apply a batch of changes in one transaction, all of them or none.  If
+ * it fails, the map no longer matches the database, so version is reset
+ * to have it reloaded.  ops are freed either way.
+ * Returns 0 on success, -1 on error
+ */
+static int sql_cache_commit(sql_conn_t *conn, sql_op_t *ops, int *version)
+{
+	sql_op_t *op;
+	int rc, r = 0;
+
+	rc = sqlite3_exec(conn->db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		r = -1;
+	}
+	while ((op = ops) != NULL) {
+		ops = op->next;
+		if (!r && sql_op_apply(conn, op)) {
+			r = -1;
+		}
+		sql_op_free(op);
+	}
+	if (!r) {
+		rc = sqlite3_exec(conn->db, "COMMIT", NULL, NULL, NULL);
+		if (rc != SQLITE_OK) {
+			r = -1;
+		}
+	}
+	if (r) {
+		/* A failed statement reported itself already */
+		if (rc != SQLITE_OK) {
+			fprintf(stderr, "sql error #%d: %s\n", rc, sqlite3_errmsg(conn->db));
+		}
+		sqlite3_exec(conn->db, "ROLLBACK", NULL, NULL, NULL);
+		*version = -1;
+	}
+	return r;
+}
+
+static void *sql_cache_writer(void *arg)
+{
+	struct timespec ts;
+	sql_conn_t *conn = sql_conn();
+	sql_op_t *ops;
+	uint64_t queued;
+	int version = -1;
+	int r;
+
+	(void) arg;
+
+	if (conn) {
+		version = sql_data_version(conn);
+	}
+	pthread_mutex_lock(&sql_cache.qlock);
+	if (!conn || sql_map_load(conn, &sql_cache.map)) {
+		sql_cache.loaded = -1;
+		pthread_cond_broadcast(&sql_cache.done);
+		pthread_mutex_unlock(&sql_cache.qlock);
+		return NULL;
+	}
+	sql_cache.loaded = 1;
+	pthread_cond_broadcast(&sql_cache.done);
+
+	while (!sql_cache.stop || sql_cache.head) {
+		if (!sql_cache.head) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			pthread_cond_timedwait(&sql_cache.cond, &sql_cache.qlock, &ts);
+			if (!sql_cache.head && !sql_cache.stop) {
+				queued = sql_cache.queued;
+				pthread_mutex_unlock(&sql_cache.qlock);
+				sql_cache_reload(conn, &version, queued);
+				pthread_mutex_lock(&sql_cache.qlock);
+			}
+			continue;
+		}
+
+		/* Let changes from other operations gather, unless someone waits */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += DEFS_GROUP_COMMIT * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while (!sql_cache.stop && !sql_cache.syncers &&
+		       pthread_cond_timedwait(&sql_cache.cond, &sql_cache.qlock, &ts) != ETIMEDOUT);
+
+		/* Never split a transaction over two commits */
+		while (sql_cache.txns && !sql_cache.stop) {
+			pthread_cond_wait(&sql_cache.cond, &sql_cache.qlock);
+		}
+
+		ops = sql_cache.head;
+		sql_cache.head = sql_cache.tail = NULL;
+		queued = sql_cache.queued;
+		pthread_mutex_unlock(&sql_cache.qlock);
+
+		r = sql_cache_commit(conn, ops, &version);
+
+		pthread_mutex_lock(&sql_cache.qlock);
+		sql_cache.written = queued;
+		if (r) {
+			sql_cache.failures++;
+		}
+		sql_cache.commits++;
+		pthread_cond_broadcast(&sql_cache.done);
+	}
+	pthread_mutex_unlock(&sql_cache.qlock);
+	return NULL;
+}
+
+int sql_cache_init()
+{
+	int r;
+
+	pthread_mutex_lock(&sql_cache.qlock);
+	sql_cache.stop = 0;
+	sql_cache.loaded = 0;
+	r = pthread_create(&sql_cache.thread, NULL, sql_cache_writer, NULL);
+	sql_cache.running = !r;
+	while (!r && !sql_cache.loaded) {
+		pthread_cond_wait(&sql_cache.done, &sql_cache.qlock);
+	}
+	pthread_mutex_unlock(&sql_cache.qlock);
+
+	if (r) {
+		return -r;
+	}
+	if (sql_cache.loaded < 0) {
+		sql_cache_destroy();
+		return -EIO;
+	}
+	pthread_rwlock_wrlock(&sql_cache.lock);
+	sql_filter_rebuild();
+	sql_cache.on = 1;
+	pthread_rwlock_unlock(&sql_cache.lock);
+	return 0;
+}
+
+void sql_cache_destroy()
+{
+	pthread_mutex_lock(&sql_cache.qlock);
+	if (!sql_cache.running) {
+		pthread_mutex_unlock(&sql_cache.qlock);
+		return;
+	}
+	sql_cache.stop = 1;
+	pthread_cond_signal(&sql_cache.cond);
+	pthread_mutex_unlock(&sql_cache.qlock);
+	pthread_join(sql_cache.thread, NULL);
+
+	pthread_mutex_lock(&sql_cache.qlock);
+	sql_cache.running = 0;
+	pthread_mutex_unlock(&sql_cache.qlock);
+
+	pthread_rwlock_wrlock(&sql_cache.lock);
+	sql_cache.on = 0;
+	sql_map_free(&sql_cache.map);
+	sql_filter_free();
+	pthread_rwlock_unlock(&sql_cache.lock);
+}
+
+int sql_sync()
+{
+	uint64_t target;
+	int r = 0;
+
+	pthread_mutex_lock(&sql_cache.qlock);
+	target = sql_cache.queued;
+	sql_cache.syncers++;
+	pthread_cond_signal(&sql_cache.cond);
+	while (sql_cache.running && sql_cache.written < target) {
+		pthread_cond_wait(&sql_cache.done, &sql_cache.qlock);
+	}
+	sql_cache.syncers--;
+	/* Like fsync, a failed commit is reported once */
+	if (sql_cache.failures != sql_cache.reported) {
+		sql_cache.reported = sql_cache.failures;
+		r = -EIO;
+	}
+	pthread_mutex_unlock(&sql_cache.qlock);
+	return r;
+}
+
+int sql_begin()
+{
+	sql_conn_t *conn = sql_conn();
+	int rc;
+
+	if (!conn) {
+		return -1;
+	}
+	if (conn->txn++) {
+		return 0;
+	}
+	if (sql_cache.on) {
+		pthread_mutex_lock(&sql_cache.qlock);
+		sql_cache.txns++;
+		pthread_mutex_unlock(&sql_cache.qlock);
+		return 0;
+	}
+	rc = sqlite3_exec(conn->db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "sql error #%d: %s\n", rc, sqlite3_errmsg(conn->db));
+		conn->txn--;
+		return -1;
+	}
+	return 0;
+}
+
+int sql_commit()
+{
+	sql_conn_t *conn = sql_conn();
+	int rc;
+
+	if (!conn || !conn->txn) {
+		return -1;
+	}
+	if (--conn->txn) {
+		return 0;
+	}
+	if (sql_cache.on) {
+		pthread_mutex_lock(&sql_cache.qlock);
+		sql_cache.txns--;
+		pthread_cond_signal(&sql_cache.cond);
+		pthread_mutex_unlock(&sql_cache.qlock);
+		return 0;
+	}
+	rc = sqlite3_exec(conn->db, "COMMIT", NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "sql error #%d: %s\n", rc, sqlite3_errmsg(conn->db));
+		sqlite3_exec(conn->db, "ROLLBACK", NULL, NULL, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+void sql_stats(uint64_t *changes, uint64_t *commits)
+{
+	pthread_mutex_lock(&sql_cache.qlock);
+	*changes = sql_cache.written;
+	*commits = sql_cache.commits;
+	pthread_mutex_unlock(&sql_cache.qlock);
+}
+
+void sql_set_path(const char *path)
+{
+	sql_path = path;
+}
+
+
+int sql_open()
+{
+	return sql_conn() ? SQLITE_OK : SQLITE_CANTOPEN;
+}
+
+int sql_close()
+{
+	sql_conn_t *conn;
+	int rc = SQLITE_OK;
+	int i;
+
+	/* Only called once every other thread is done with the database */
+	pthread_once(&sql_once, sql_setup);
+	pthread_setspecific(sql_key, NULL);
+
+	pthread_mutex_lock(&sql_lock);
+	while ((conn = sql_all) != NULL) {
+		sql_all = conn->all;
+		for (i = 0; i < SQL_STMTS; ++i) {
+			sqlite3_finalize(conn->stmt[i]);
+		}
+		if (sqlite_close(conn->db) != SQLITE_OK) {
+			rc = SQLITE_BUSY;
+		}
+		free(conn);
+	}
+	sql_idle = NULL;
+	pthread_mutex_unlock(&sql_lock);
+	return rc;
+}
+
+int sql_init_db()
+{
+	sql_conn_t *conn = sql_conn();
+
+	return conn ? sqlite_init_db(conn->db) : -1;
+}
+
+int sql_update_size(const char* child, const int64_t size)
+{
+	sql_link_t *l;
+	sql_op_t *op;
+	int r;
+
+	if (!sql_cache.on) {
+		r = sqlite_update_size(sql_conn(), child, size);
+		sql_gen_bump();
+		return r;
+	}
+	op = sql_op_new(SQL_UPDATE_SIZE, child, NULL, size);
+	if (!op) {
+		return -1;
+	}
+	pthread_rwlock_wrlock(&sql_cache.lock);
+	l = sql_map_find(&sql_cache.map, child);
+	if (l && l->size != size) {
+		l->size = size;
+		sql_gen_bump();
+		sql_queue(op);
+		op = NULL;
+	}
+	pthread_rwlock_unlock(&sql_cache.lock);
+	sql_op_free(op);
+	return 0;
+}
+
+int sql_add(const char* parent, const char* child, const int64_t size)
+{
+	sql_op_t *op;
+	int r = -1;
+
+	if (!sql_cache.on) {
+		r = sqlite_add(sql_conn(), parent, child, size);
+		sql_gen_bump();
+		return r;
+	}
+	op = sql_op_new(SQL_ADD, child, parent, size);
+	if (!op) {
+		return -1;
+	}
+	pthread_rwlock_wrlock(&sql_cache.lock);
+	if (!sql_map_add(&sql_cache.map, parent, child, size)) {
+		sql_filter_add(child, SQL_KEY_CHILD);
+		sql_filter_add(parent, SQL_KEY_PARENT);
+		sql_gen_bump();
+		sql_queue(op);
+		op = NULL;
+		r = 0;
+	}
+	pthread_rwlock_unlock(&sql_cache.lock);
+	sql_op_free(op);
+	return r;
+}
+
+int64_t sql_get_size(const char* child)
+{
+	int64_t size = 0;
+
+	sql_get_parent_size(child, NULL, &size);
+	return size;
+}
+
+int sql_get_children(const char* parent, int* childc, char*** childv)
+{
+	sql_parent_t *p;
+	sql_link_t *l;
+	int i = 0;
+
+	if (!sql_cache.on) {
+		return sqlite_get_children(sql_conn(), parent, childc, childv);
+	}
+	*childc = 0;
+	*childv = NULL;
+	if (!sql_filter_test(parent, SQL_KEY_PARENT)) {
+		return 0;
+	}
+	pthread_rwlock_rdlock(&sql_cache.lock);
+	p = sql_map_find_parent(&sql_cache.map, parent);
+	if (p) {
+		*childv = malloc(p->childc * sizeof(char *));
+		for (l = p->head; *childv && l; l = l->next) {
+			(*childv)[i] = strdup(l->child);
+			if ((*childv)[i]) {
+				++i;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&sql_cache.lock);
+	*childc = i;
+	return p && !*childv ? -1 : 0;
+}
+
+/*
+ * Fill childv with up to max children of p named after after, in name
+ * order.  The siblings aren't kept sorted, so this takes a pass over all
+ * of them, keeping the max first names in order.
+ * Returns how many, -1 on error
+ */
+static int sql_map_children_page(sql_parent_t *p, const char *after, int max, char **childv)
+{
+	const char *first[max];
+	sql_link_t *l;
+	int n = 0, lo, hi, mid;
+
+	for (l = p->head; l; l = l->next) {
+		if (strcmp(l->child, after) <= 0 ||
+		    (n == max && strcmp(l->child, first[n - 1]) >= 0)) {
+			continue;
+		}
+		lo = 0;
+		hi = n;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (strcmp(first[mid], l->child) < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (n < max) {
+			++n;
+		}
+		memmove(&first[lo + 1], &first[lo], (n - 1 - lo) * sizeof(char *));
+		first[lo] = l->child;
+	}
+
+	for (lo = 0; lo < n; ++lo) {
+		childv[lo] = strdup(first[lo]);
+		if (!childv[lo]) {
+			while (lo) {
+				free(childv[--lo]);
+			}
+			return -1;
+		}
+	}
+	return n;
+}
+
+struct sql_children {
+	char *parent;
+	char *childv[SQL_PAGE];
+	int childc;
+	int done;                    /* the last page was short */
+};
+
+sql_children_t *sql_children_open(const char *parent)
+{
+	sql_children_t *it;
+
+	it = calloc(1, sizeof(sql_children_t));
+	if (!it) {
+		return NULL;
+	}
+	it->parent = strdup(parent);
+	if (!it->parent) {
+		free(it);
+		return NULL;
+	}
+	return it;
+}
+
+int sql_children_next(sql_children_t *it, char ***childv)
+{
+	char *after;
+	sql_parent_t *p;
+	int i, n = 0;
+
+	*childv = it->childv;
+	if (it->done) {
+		return 0;
+	}
+
+	/* Start after the last child handed out, whatever happened to it since */
+	after = it->childc ? it->childv[it->childc - 1] : NULL;
+	for (i = 0; i + 1 < it->childc; ++i) {
+		free(it->childv[i]);
+	}
+	it->childc = 0;
+
+	if (!sql_cache.on) {
+		n = sqlite_children_page(sql_conn(), it->parent, after ? after : "", SQL_PAGE, it->childv);
+	} else if (sql_filter_test(it->parent, SQL_KEY_PARENT)) {
+		pthread_rwlock_rdlock(&sql_cache.lock);
+		p = sql_map_find_parent(&sql_cache.map, it->parent);
+		if (p) {
+			n = sql_map_children_page(p, after ? after : "", SQL_PAGE, it->childv);
+		}
+		pthread_rwlock_unlock(&sql_cache.lock);
+	}
+	free(after);
+
+	it->childc = n < 0 ? 0 : n;
+	it->done = n < SQL_PAGE;
+	return n;
+}
+
+void sql_children_close(sql_children_t *it)
+{
+	if (!it) {
+		return;
+	}
+	while (it->childc) {
+		free(it->childv[--it->childc]);
+	}
+	free(it->parent);
+	free(it);
+}
+
+int sql_has_children(const char *parent)
+{
+	sql_parent_t *p;
+	char *child;
+	int n;
+
+	if (!sql_cache.on) {
+		n = sqlite_children_page(sql_conn(), parent, "", 1, &child);
+		if (n > 0) {
+			free(child);
+		}
+		return n > 0;
+	}
+	if (!sql_filter_test(parent, SQL_KEY_PARENT)) {
+		return 0;
+	}
+	pthread_rwlock_rdlock(&sql_cache.lock);
+	p = sql_map_find_parent(&sql_cache.map, parent);
+	n = p && p->childc;
+	pthread_rwlock_unlock(&sql_cache.lock);
+	return n;
+}
+
+int sql_get_parent(const char* child, char** parent)
+{
+	return sql_get_parent_size(child, parent, NULL);
+}
+
+int sql_get_parent_size(const char* child, char** parent, int64_t* size)
+{
+	sql_link_t *l;
+
+	if (!sql_cache.on) {
+		return sqlite_get_parent_size(sql_conn(), child, parent, size);
+	}
+	if (!sql_filter_test(child, SQL_KEY_CHILD)) {
+		return 0;
+	}
+	pthread_rwlock_rdlock(&sql_cache.lock);
+	l = sql_map_find(&sql_cache.map, child);
+	if (l) {
+		if (parent) {
+			*parent = strdup(l->parent->path);
+		}
+		if (size) {
+			*size = l->size;
+		}
+	}
+	pthread_rwlock_unlock(&sql_cache.lock);
+	return 0;
+}
+
+int sql_get_links(int keyc, char **keyv, int64_t *sizev)
+{
+	sql_link_t *l;
+	int i;
+
+	if (!sql_cache.on) {
+		return sqlite_get_links(sql_conn(), keyc, keyv, sizev);
+	}
+	pthread_rwlock_rdlock(&sql_cache.lock);
+	for (i = 0; i < keyc; ++i) {
+		sizev[i] = SQL_LINK_NONE;
+		if (sql_filter_test(keyv[i], SQL_KEY_CHILD) &&
+		    (l = sql_map_find(&sql_cache.map, keyv[i])) != NULL) {
+			sizev[i] = l->size;
+		} else if (sql_filter_test(keyv[i], SQL_KEY_PARENT) &&
+			   sql_map_find_parent(&sql_cache.map, keyv[i])) {
+			sizev[i] = SQL_LINK_PARENT;
+		}
+	}
+	pthread_rwlock_unlock(&sql_cache.lock);
+	return 0;
+}
+
+int sql_set_parent(const char* child, const char* parent)
+{
+	sql_link_t *l;
+	sql_op_t *op;
+	int r = 0;
+
+	if (!sql_cache.on) {
+		r = sqlite_set_parent(sql_conn(), child, parent);
+		sql_gen_bump();
+		return r;
+	}
+	op = sql_op_new(SQL_SET_PARENT, child, parent, 0);
+	if (!op) {
+		return -1;
+	}
+	pthread_rwlock_wrlock(&sql_cache.lock);
+	l = sql_map_find(&sql_cache.map, child);
+	if (l) {
+		r = sql_map_add(&sql_cache.map, parent, child, l->size);
+		if (!r) {
+			sql_filter_add(parent, SQL_KEY_PARENT);
+			sql_gen_bump();
+			sql_queue(op);
+			op = NULL;
+		}
+	}
+	pthread_rwlock_unlock(&sql_cache.lock);
+	sql_op_free(op);
+	return r;
+}
+
+int sql_remove_child(const char* child)
+{
+	sql_link_t *l;
+	sql_op_t *op;
+	int r;
+
+	if (!sql_cache.on) {
+		r = sqlite_remove_child(sql_conn(), child);
+		sql_gen_bump();
+		return r;
+	}
+	op = sql_op_new(SQL_REMOVE_CHILD, child, NULL, 0);
+	if (!op) {
+		return -1;
+	}
+	pthread_rwlock_wrlock(&sql_cache.lock);
+	l = sql_map_find(&sql_cache.map, child);
+	if (l) {
+		sql_map_unlink(&sql_cache.map, l);
+		free(l->child);
+		free(l);
+		sql_gen_bump();
+		sql_queue(op);
+		op = NULL;
+	}
+	pthread_rwlock_unlock(&sql_cache.lock);
+	sql_op_free(op);
+	return 0;
+}
+
+int sql_foreach(int (*fn)(const char *parent, const char *child, int64_t size, void *arg), void *arg)
+{
+	sql_conn_t *conn;
+	sqlite3_stmt *stmt;
+	sql_parent_t *p;
+	sql_link_t *l;
+	size_t i;
+	int rc, r = 0;
+
+	if (sql_cache.on) {
+		pthread_rwlock_rdlock(&sql_cache.lock);
+		for (i = 0; !r && i < sql_cache.map.parentb; ++i) {
+			for (p = sql_cache.map.parents[i]; !r && p; p = p->hnext) {
+				for (l = p->head; !r && l; l = l->next) {
+					r = fn(p->path, l->child, l->size, arg);
+				}
+			}
+		}
+		pthread_rwlock_unlock(&sql_cache.lock);
+		return r;
+	}
+
+	conn = sql_conn();
+	stmt = sqlite_stmt(conn, SQL_LOAD);
+	if (!stmt) {
+		return -1;
+	}
+	while (!r && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		r = fn((const char *) sqlite3_column_text(stmt, 0),
+		       (const char *) sqlite3_column_text(stmt, 1),
+		       sqlite3_column_int64(stmt, 2), arg);
+	}
+	sqlite_done(stmt);
+	return r;
+}
+
+unsigned int sql_generation()
 {
-	return sqlite_remove_child(db, child);
+	return __atomic_load_n(&sql_gen, __ATOMIC_ACQUIRE);
 }
@@ -20,6 +20,7 @@
 #ifndef SQL_H
 #define SQL_H
 
+#include <stdint.h>
 #include <sqlite3.h>
 
 
@@ -38,27 +39,132 @@ int sql_close();
  */
 int sql_init_db();
 
+/*
+ * Use the database at path instead of the default, before sql_open
+ */
+void sql_set_path(const char *path);
+
+/*
+ * Load the whole table into memory and answer every lookup from there,
+ * writing changes back to the database from a background thread.  Changes
+ * other processes (dln) make are picked up within a second.
+ * Must be called after FUSE forked into the background.
+ * Returns 0 on success, otherwise -errno
+ */
+int sql_cache_init();
+
+/*
+ * Write back everything queued, stop the thread and drop the cache
+ */
+void sql_cache_destroy();
+
+/*
+ * Wait until every change made so far is in the database
+ * Returns 0 on success, -EIO if a batch of changes failed to commit
+ * since the last sql_sync
+ */
+int sql_sync();
+
+/*
+ * Make the changes this thread makes up to the matching sql_commit one
+ * transaction.  Nests; don't call sql_sync in between.
+ */
+int sql_begin();
+int sql_commit();
+
+/*
+ * Returns a number that changes whenever a link is added, moved, resized
+ * or removed, by this process or, with the cache on, by another
+ */
+unsigned int sql_generation();
+
+/*
+ * Returns the number of changes the cache wrote back and of the commits
+ * it took
+ */
+void sql_stats(uint64_t *changes, uint64_t *commits);
+
 /*
  * Updates the size of a child
  */
 
-int sql_update_size(const char* child, const int);
+int sql_update_size(const char* child, const int64_t);
 
 /*
  * adds an entry linking parent to child
  */
-int sql_add(const char* parent, const char* child, const int);
+int sql_add(const char* parent, const char* child, const int64_t);
 
 /*
- * returns the count of children in childc and a vector of child paths of any given parent
+ * returns the count of children in childc and a vector of child paths of
+ * any given parent, all at once: walk parents that may have many with
+ * sql_children_open instead
  */
 int sql_get_children(const char* parent, int* childc, char*** childv);
 
+/*
+ * Walks the children of a parent SQL_PAGE at a time in name order, so no
+ * one has to hold all of them.  Each page starts after the last child of
+ * the one before: children moved away or removed in between are not
+ * missed, nor seen twice.
+ */
+#define SQL_PAGE 256
+
+typedef struct sql_children sql_children_t;
+
+/*
+ * Start walking the children of parent
+ * Returns the iterator, NULL on error
+ */
+sql_children_t *sql_children_open(const char *parent);
+
+/*
+ * Sets childv to the next page of children, which stays valid until the
+ * next call
+ * Returns how many it holds, 0 at the end, -1 on error
+ */
+int sql_children_next(sql_children_t *it, char ***childv);
+
+/*
+ * Stop walking and free the iterator
+ */
+void sql_children_close(sql_children_t *it);
+
+/*
+ * Returns 1 if parent has any children, 0 if not
+ */
+int sql_has_children(const char *parent);
+
 /*
  * returns the parent of a given child
  */
 int sql_get_parent(const char* child, char** parent);
 
+/*
+ * returns the parent and size of a given child in one lookup, parent is
+ * left alone if it isn't a child
+ */
+int sql_get_parent_size(const char* child, char** parent, int64_t* size);
+
+/*
+ * What sql_get_links reports for keys that aren't children
+ */
+#define SQL_LINK_NONE -1     /* in no link */
+#define SQL_LINK_PARENT -2   /* a parent */
+
+/*
+ * Looks up keyc keys at once, for all the entries of a directory: sets
+ * sizev[i] to the size of keyv[i] if it is a child, SQL_LINK_PARENT or
+ * SQL_LINK_NONE otherwise.  Takes one query per few hundred keys, none
+ * with the cache on.
+ */
+int sql_get_links(int keyc, char **keyv, int64_t *sizev);
+
+/*
+ * moves a child to another parent, keeping its size
+ */
+int sql_set_parent(const char* child, const char* parent);
+
 /*
  * removes the entry linking the parent to this child
  */
@@ -67,6 +173,12 @@ int sql_remove_child(const char* child);
 /*
  * returns the size of a given child
  */
-int sql_get_size(const char* child);
+int64_t sql_get_size(const char* child);
+
+/*
+ * Calls fn for every link until it returns non-zero, which is returned.
+ * fn must not call any sql_ function.
+ */
+int sql_foreach(int (*fn)(const char *parent, const char *child, int64_t size, void *arg), void *arg);
 
 #endif /* SQL_H */
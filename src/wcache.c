@@ -0,0 +1,238 @@
+/*
+ * wcache.c implements the decoded window cache as defined in wcache.h
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "wcache.h"
+#include "arena.h"
+
+#define WCACHE_BUCKETS 4096
+
+typedef struct wcache_entry {
+	wcache_key_t key;
+	char *data;
+	size_t len;
+	struct wcache_entry *hnext;  /* hash chain */
+	struct wcache_entry *prev;   /* LRU list, most recently used first */
+	struct wcache_entry *next;
+} wcache_entry_t;
+
+static struct {
+	pthread_mutex_t lock;
+	wcache_entry_t *table[WCACHE_BUCKETS];
+	wcache_entry_t *head;
+	wcache_entry_t *tail;
+	size_t bytes;
+	size_t limit;
+	uint64_t hits;
+	uint64_t misses;
+} wcache = { PTHREAD_MUTEX_INITIALIZER };
+
+
+static unsigned int wcache_hash(const wcache_key_t *key)
+{
+	uint64_t h = (uint64_t) key->ino * 2654435761U;
+
+	h ^= (uint64_t) key->dev * 40503U;
+	h ^= (uint64_t) key->window * 2246822519U;
+	return (unsigned int) (h ^ (h >> 32)) % WCACHE_BUCKETS;
+}
+
+static int wcache_key_eq(const wcache_key_t *a, const wcache_key_t *b)
+{
+	return a->dev == b->dev && a->ino == b->ino &&
+		a->gen == b->gen && a->window == b->window;
+}
+
+static void wcache_unlink(wcache_entry_t *e)
+{
+	wcache_entry_t **p = &wcache.table[wcache_hash(&e->key)];
+
+	while (*p != e) {
+		p = &(*p)->hnext;
+	}
+	*p = e->hnext;
+
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		wcache.head = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		wcache.tail = e->prev;
+	}
+	wcache.bytes -= e->len;
+}
+
+static void wcache_push_front(wcache_entry_t *e)
+{
+	e->prev = NULL;
+	e->next = wcache.head;
+	if (wcache.head) {
+		wcache.head->prev = e;
+	}
+	wcache.head = e;
+	if (!wcache.tail) {
+		wcache.tail = e;
+	}
+}
+
+static void wcache_free_entry(wcache_entry_t *e)
+{
+	arena_free(e->data);
+	arena_free(e);
+}
+
+
+void wcache_init(size_t limit)
+{
+	pthread_mutex_lock(&wcache.lock);
+	wcache.limit = limit;
+	pthread_mutex_unlock(&wcache.lock);
+}
+
+void wcache_destroy()
+{
+	wcache_entry_t *e;
+
+	pthread_mutex_lock(&wcache.lock);
+	while ((e = wcache.head) != NULL) {
+		wcache_unlink(e);
+		wcache_free_entry(e);
+	}
+	wcache.limit = 0;
+	pthread_mutex_unlock(&wcache.lock);
+}
+
+int wcache_get(const wcache_key_t *key, size_t off, size_t len, char *dst)
+{
+	wcache_entry_t *e;
+	int res = -1;
+
+	pthread_mutex_lock(&wcache.lock);
+	for (e = wcache.table[wcache_hash(key)]; e; e = e->hnext) {
+		if (wcache_key_eq(&e->key, key)) {
+			break;
+		}
+	}
+
+	if (e && off + len <= e->len) {
+		memcpy(dst, e->data + off, len);
+		/* Move to the front of the LRU list */
+		if (e != wcache.head) {
+			if (e->next) {
+				e->next->prev = e->prev;
+			} else {
+				wcache.tail = e->prev;
+			}
+			e->prev->next = e->next;
+			wcache_push_front(e);
+		}
+		wcache.hits++;
+		res = len;
+	} else {
+		wcache.misses++;
+	}
+	pthread_mutex_unlock(&wcache.lock);
+	return res;
+}
+
+int wcache_contains(const wcache_key_t *key)
+{
+	wcache_entry_t *e;
+
+	pthread_mutex_lock(&wcache.lock);
+	for (e = wcache.table[wcache_hash(key)]; e; e = e->hnext) {
+		if (wcache_key_eq(&e->key, key)) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&wcache.lock);
+	return e != NULL;
+}
+
+int wcache_put(const wcache_key_t *key, char *data, size_t len)
+{
+	wcache_entry_t *e;
+	unsigned int h;
+
+	pthread_mutex_lock(&wcache.lock);
+	if (len > wcache.limit) {
+		pthread_mutex_unlock(&wcache.lock);
+		return 0;
+	}
+
+	h = wcache_hash(key);
+	for (e = wcache.table[h]; e; e = e->hnext) {
+		if (wcache_key_eq(&e->key, key)) {
+			/* Someone else decoded it first */
+			pthread_mutex_unlock(&wcache.lock);
+			return 0;
+		}
+	}
+
+	/* Evict least recently used windows until the new one fits */
+	while (wcache.tail && wcache.bytes + len > wcache.limit) {
+		e = wcache.tail;
+		wcache_unlink(e);
+		wcache_free_entry(e);
+	}
+
+	e = arena_alloc(sizeof(wcache_entry_t));
+	if (!e) {
+		pthread_mutex_unlock(&wcache.lock);
+		return 0;
+	}
+	e->key = *key;
+	e->data = data;
+	e->len = len;
+	e->hnext = wcache.table[h];
+	wcache.table[h] = e;
+	wcache_push_front(e);
+	wcache.bytes += len;
+	pthread_mutex_unlock(&wcache.lock);
+	return 1;
+}
+
+void wcache_invalidate(dev_t dev, ino_t ino)
+{
+	wcache_entry_t *e, *next;
+
+	pthread_mutex_lock(&wcache.lock);
+	for (e = wcache.head; e; e = next) {
+		next = e->next;
+		if (e->key.dev == dev && e->key.ino == ino) {
+			wcache_unlink(e);
+			wcache_free_entry(e);
+		}
+	}
+	pthread_mutex_unlock(&wcache.lock);
+}
+
+void wcache_stats(uint64_t *hits, uint64_t *misses)
+{
+	pthread_mutex_lock(&wcache.lock);
+	*hits = wcache.hits;
+	*misses = wcache.misses;
+	pthread_mutex_unlock(&wcache.lock);
+}
@@ -0,0 +1,78 @@
+/*
+ * wcache.h defines api for the shared cache of decoded delta windows
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WCACHE_H
+#define WCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Windows are keyed by the delta file they were decoded from (device and
+ * inode), the window number and the generation of the delta, so a delta
+ * rewritten behind our back never serves stale data.
+ */
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	uint64_t gen;
+	uint32_t window;
+} wcache_key_t;
+
+
+/*
+ * Initialize the cache, holding at most limit bytes of decoded data.
+ * A limit of 0 disables the cache.
+ */
+void wcache_init(size_t limit);
+
+/*
+ * Drop every cached window
+ */
+void wcache_destroy();
+
+/*
+ * Copy len bytes at off of a cached window into dst
+ * Returns len on a hit, -1 on a miss
+ */
+int wcache_get(const wcache_key_t *key, size_t off, size_t len, char *dst);
+
+/*
+ * Returns 1 if the window is cached, 0 otherwise, without counting a lookup
+ */
+int wcache_contains(const wcache_key_t *key);
+
+/*
+ * Add a decoded window of len bytes to the cache, taking ownership of data,
+ * which comes from arena_alloc and goes back to the arena when evicted.
+ * Returns 1 if the cache took it, 0 if it didn't and the caller keeps it
+ */
+int wcache_put(const wcache_key_t *key, char *data, size_t len);
+
+/*
+ * Drop all windows decoded from the delta file dev/ino
+ */
+void wcache_invalidate(dev_t dev, ino_t ino);
+
+/*
+ * Returns the number of lookups that hit and missed the cache
+ */
+void wcache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif /* WCACHE_H */
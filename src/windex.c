@@ -0,0 +1,325 @@
+/*
+ * windex.c implements the delta window index as defined in windex.h
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "windex.h"
+
+/*
+ * Index entries and trailer as written before the trailer described the
+ * file on its own
+ */
+typedef struct {
+	uint64_t tgt_off;
+	uint64_t delta_off;
+	uint64_t src_off;
+	uint32_t tgt_len;
+	uint32_t delta_len;
+	uint32_t src_len;
+	uint32_t flags;
+} windex_entry_v1_t;
+
+typedef struct {
+	char magic[8];
+	uint64_t hdr_len;
+	uint64_t delta_len;
+	uint32_t count;
+	uint32_t reserved;
+} windex_footer_v1_t;
+
+
+void windex_init(windex_t *idx)
+{
+	memset(idx, 0, sizeof(windex_t));
+}
+
+void windex_free(windex_t *idx)
+{
+	free(idx->entries);
+	windex_init(idx);
+}
+
+int windex_add(windex_t *idx, uint64_t tgt_off, uint32_t tgt_len, uint64_t delta_off,
+	       uint32_t delta_len, uint64_t src_off, uint32_t src_len, uint32_t cksum)
+{
+	windex_entry_t *e;
+
+	if (idx->count == idx->alloc) {
+		idx->alloc = idx->alloc ? 2 * idx->alloc : 64;
+		e = realloc(idx->entries, idx->alloc * sizeof(windex_entry_t));
+		if (!e) {
+			return -ENOMEM;
+		}
+		idx->entries = e;
+	}
+
+	e = &idx->entries[idx->count++];
+	memset(e, 0, sizeof(windex_entry_t));
+	e->tgt_off = tgt_off;
+	e->tgt_len = tgt_len;
+	e->delta_off = delta_off;
+	e->delta_len = delta_len;
+	e->src_off = src_off;
+	e->src_len = src_len;
+	e->cksum = cksum;
+	return 0;
+}
+
+int windex_add_copy(windex_t *idx, uint64_t tgt_off, uint32_t tgt_len, uint64_t delta_off, uint64_t src_off)
+{
+	int r;
+
+	r = windex_add(idx, tgt_off, tgt_len, delta_off, 0, src_off, tgt_len, 0);
+	if (!r) {
+		idx->entries[idx->count - 1].flags = WINDEX_COPY;
+	}
+	return r;
+}
+
+uint32_t windex_wsum(const windex_t *idx)
+{
+	/* FNV-1a over the window checksums */
+	uint32_t h = 2166136261u;
+	uint32_t i;
+	int j;
+
+	for (i = 0; i < idx->count; ++i) {
+		for (j = 0; j < 32; j += 8) {
+			h ^= (idx->entries[i].cksum >> j) & 0xff;
+			h *= 16777619u;
+		}
+	}
+	return h;
+}
+
+/*
+ * Fill in the trailer describing idx
+ */
+static void windex_footer(const windex_t *idx, windex_footer_t *footer)
+{
+	memset(footer, 0, sizeof(windex_footer_t));
+	memcpy(footer->magic, WINDEX_MAGIC, sizeof(footer->magic));
+	footer->hdr_len = idx->hdr_len;
+	footer->delta_len = idx->delta_len;
+	footer->size = windex_size(idx);
+	footer->parent_ino = idx->parent_ino;
+	footer->count = idx->count;
+	footer->winsize = idx->winsize;
+	footer->wsum = windex_wsum(idx);
+}
+
+int windex_write(windex_t *idx, FILE *OutFile)
+{
+	windex_footer_t footer;
+	size_t r;
+
+	r = fwrite(idx->entries, sizeof(windex_entry_t), idx->count, OutFile);
+	if (r != idx->count) {
+		return -errno;
+	}
+
+	windex_footer(idx, &footer);
+
+	r = fwrite(&footer, sizeof(footer), 1, OutFile);
+	if (r != 1) {
+		return -errno;
+	}
+	return 0;
+}
+
+int windex_store(windex_t *idx, int fd)
+{
+	windex_footer_t footer;
+	size_t len = (size_t) idx->count * sizeof(windex_entry_t);
+	off_t off = idx->delta_len;
+	ssize_t r;
+
+	r = pwrite(fd, idx->entries, len, off);
+	if (r != (ssize_t) len) {
+		return r == -1 ? -errno : -EIO;
+	}
+	off += len;
+
+	windex_footer(idx, &footer);
+
+	r = pwrite(fd, &footer, sizeof(footer), off);
+	if (r != sizeof(footer)) {
+		return r == -1 ? -errno : -EIO;
+	}
+	off += sizeof(footer);
+
+	if (ftruncate(fd, off)) {
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Load an index written before the trailer described the file
+ */
+static int windex_load_v1(windex_t *idx, int fd, off_t file_size)
+{
+	windex_footer_v1_t footer;
+	windex_entry_v1_t *old;
+	off_t entries_off;
+	size_t len;
+	ssize_t r;
+	uint32_t i;
+
+	if (file_size < (off_t) sizeof(footer)) {
+		return -ENOENT;
+	}
+	r = pread(fd, &footer, sizeof(footer), file_size - sizeof(footer));
+	if (r != sizeof(footer)) {
+		return r == -1 ? -errno : -ENOENT;
+	}
+	if (memcmp(footer.magic, WINDEX_MAGIC_V1, sizeof(footer.magic))) {
+		return -ENOENT; /* written before the index existed */
+	}
+
+	len = (size_t) footer.count * sizeof(windex_entry_v1_t);
+	entries_off = file_size - sizeof(footer) - len;
+	if (entries_off < (off_t) footer.delta_len) {
+		return -EINVAL;
+	}
+
+	old = malloc(len ? len : 1);
+	idx->entries = calloc(footer.count ? footer.count : 1, sizeof(windex_entry_t));
+	if (!old || !idx->entries) {
+		free(old);
+		windex_free(idx);
+		return -ENOMEM;
+	}
+	r = pread(fd, old, len, entries_off);
+	if (r != (ssize_t) len) {
+		free(old);
+		windex_free(idx);
+		return r == -1 ? -errno : -EINVAL;
+	}
+	for (i = 0; i < footer.count; ++i) {
+		idx->entries[i].tgt_off = old[i].tgt_off;
+		idx->entries[i].delta_off = old[i].delta_off;
+		idx->entries[i].src_off = old[i].src_off;
+		idx->entries[i].tgt_len = old[i].tgt_len;
+		idx->entries[i].delta_len = old[i].delta_len;
+		idx->entries[i].src_len = old[i].src_len;
+		idx->entries[i].flags = old[i].flags;
+	}
+	free(old);
+
+	idx->count = footer.count;
+	idx->alloc = footer.count;
+	idx->hdr_len = footer.hdr_len;
+	idx->delta_len = footer.delta_len;
+	return 0;
+}
+
+int windex_load(windex_t *idx, int fd)
+{
+	struct stat statbuf;
+	windex_footer_t footer;
+	off_t entries_off;
+	size_t len;
+	ssize_t r;
+
+	windex_init(idx);
+
+	if (fstat(fd, &statbuf)) {
+		return -errno;
+	}
+	if (statbuf.st_size < (off_t) sizeof(footer)) {
+		return windex_load_v1(idx, fd, statbuf.st_size);
+	}
+
+	r = pread(fd, &footer, sizeof(footer), statbuf.st_size - sizeof(footer));
+	if (r != sizeof(footer)) {
+		return r == -1 ? -errno : -ENOENT;
+	}
+	if (memcmp(footer.magic, WINDEX_MAGIC, sizeof(footer.magic))) {
+		return windex_load_v1(idx, fd, statbuf.st_size);
+	}
+
+	len = (size_t) footer.count * sizeof(windex_entry_t);
+	entries_off = statbuf.st_size - sizeof(footer) - len;
+	if (entries_off < (off_t) footer.delta_len) {
+		return -EINVAL;
+	}
+
+	idx->entries = malloc(len ? len : 1);
+	if (!idx->entries) {
+		return -ENOMEM;
+	}
+	r = pread(fd, idx->entries, len, entries_off);
+	if (r != (ssize_t) len) {
+		windex_free(idx);
+		return r == -1 ? -errno : -EINVAL;
+	}
+
+	idx->count = footer.count;
+	idx->alloc = footer.count;
+	idx->hdr_len = footer.hdr_len;
+	idx->delta_len = footer.delta_len;
+	idx->parent_ino = footer.parent_ino;
+	idx->winsize = footer.winsize;
+	if (windex_size(idx) != footer.size || windex_wsum(idx) != footer.wsum) {
+		windex_free(idx);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+int windex_find(const windex_t *idx, off_t offset)
+{
+	/* Windows are stored in target order, so binary search on tgt_off */
+	int lo = 0;
+	int hi = (int) idx->count - 1;
+	int mid;
+
+	if (offset < 0 || (uint64_t) offset >= windex_size(idx)) {
+		return -1;
+	}
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (idx->entries[mid].tgt_off <= (uint64_t) offset) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+uint64_t windex_size(const windex_t *idx)
+{
+	const windex_entry_t *last;
+
+	if (!idx->count) {
+		return 0;
+	}
+	last = &idx->entries[idx->count - 1];
+	return last->tgt_off + last->tgt_len;
+}
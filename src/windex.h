@@ -0,0 +1,152 @@
+/*
+ * windex.h defines the window index stored in defs delta files
+ * Copyright (C) 2009 Patrick Stetter <chipmaster32@gmail.com>
+ * Copyright (C) 2009 Corey McClymonds <galeru@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WINDEX_H
+#define WINDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * A delta file is laid out as
+ *
+ *   [VCDIFF header][window 0][window 1]...[window n-1][index entries][trailer]
+ *
+ * Each index entry maps a range of the decoded file to the bytes of the
+ * VCDIFF window that produces it, so a read can seek straight to the
+ * window(s) it needs instead of walking the whole delta.  The trailer
+ * describes the file on its own: the inode of the parent it decodes
+ * against, the decoded size, the window size and a sum of the window
+ * checksums that catches a torn or stale index, so the link table can be
+ * checked against, or rebuilt from, the deltas.  The sum does not verify
+ * the decoded content: copy windows and new links have no checksum.  It sits at the end because windows are spliced in place
+ * and the index behind them is rewritten anyway.  Everything is stored in
+ * host byte order.
+ *
+ * A window flagged WINDEX_COPY is the parent segment at src_off as is, and
+ * reads pread it from the parent instead of decoding it.  The encoder
+ * flags the windows that come out as one copy of the parent, keeping
+ * their VCDIFF data.  A new link is nothing but such windows with no
+ * VCDIFF data (no header either, delta_len 0 and delta_off where the data
+ * would sit) until writes to it encode the windows they touch.
+ */
+
+#define WINDEX_MAGIC "DEFSIDX2"
+#define WINDEX_MAGIC_V1 "DEFSIDX1"   /* no checksums or parent, still read */
+
+#define WINDEX_COPY 1                /* entry flag, see above */
+
+typedef struct {
+	uint64_t tgt_off;    /* offset of the window in the decoded file */
+	uint64_t delta_off;  /* offset of the window in the delta file */
+	uint64_t src_off;    /* start of the parent segment the window copies from */
+	uint32_t tgt_len;    /* decoded length of the window */
+	uint32_t delta_len;  /* encoded length of the window */
+	uint32_t src_len;    /* length of the parent segment, 0 if none */
+	uint32_t flags;
+	uint32_t cksum;      /* Adler-32 of the decoded window, as in the VCDIFF window, 0 in a new link */
+	uint32_t reserved;
+} windex_entry_t;
+
+typedef struct {
+	char magic[8];
+	uint64_t hdr_len;    /* length of the VCDIFF file header */
+	uint64_t delta_len;  /* length of the VCDIFF data, header included */
+	uint64_t size;       /* decoded size */
+	uint64_t parent_ino; /* inode of the parent, 0 if unknown */
+	uint32_t count;      /* number of index entries */
+	uint32_t winsize;    /* window size the delta was encoded with */
+	uint32_t wsum;       /* of the window checksums, see windex_wsum */
+	uint32_t reserved;
+} windex_footer_t;
+
+typedef struct {
+	windex_entry_t *entries;
+	uint32_t count;
+	uint32_t alloc;
+	uint64_t hdr_len;
+	uint64_t delta_len;
+	uint64_t parent_ino;
+	uint32_t winsize;
+} windex_t;
+
+
+/*
+ * Initialize an empty index
+ */
+void windex_init(windex_t *idx);
+
+/*
+ * Free the entries of an index
+ */
+void windex_free(windex_t *idx);
+
+/*
+ * Append the next window to the index
+ * Returns 0 on success, otherwise -errno
+ */
+int windex_add(windex_t *idx, uint64_t tgt_off, uint32_t tgt_len, uint64_t delta_off,
+	       uint32_t delta_len, uint64_t src_off, uint32_t src_len, uint32_t cksum);
+
+/*
+ * Append a window that is tgt_len bytes of the parent at src_off as is
+ * Returns 0 on success, otherwise -errno
+ */
+int windex_add_copy(windex_t *idx, uint64_t tgt_off, uint32_t tgt_len, uint64_t delta_off, uint64_t src_off);
+
+/*
+ * Append the index entries and trailer to OutFile, which must be positioned
+ * right after the VCDIFF data
+ * Returns 0 on success, otherwise -errno
+ */
+int windex_write(windex_t *idx, FILE *OutFile);
+
+/*
+ * Write the index entries and trailer after the first idx->delta_len bytes
+ * of the delta file open at fd, truncating whatever followed
+ * Returns 0 on success, otherwise -errno
+ */
+int windex_store(windex_t *idx, int fd);
+
+/*
+ * Load the index of the delta file open at fd
+ * Returns 0 on success, -ENOENT if the file carries no index, otherwise -errno
+ */
+int windex_load(windex_t *idx, int fd);
+
+/*
+ * Returns the sum of the window checksums of idx, which the trailer keeps
+ * to check the entries it is loaded with.  Windows without a checksum
+ * count as 0, so this is no checksum of the decoded content.
+ */
+uint32_t windex_wsum(const windex_t *idx);
+
+/*
+ * Returns the entry holding the decoded byte at offset, or -1 if offset is
+ * past the end of the file
+ */
+int windex_find(const windex_t *idx, off_t offset);
+
+/*
+ * Returns the decoded size described by the index
+ */
+uint64_t windex_size(const windex_t *idx);
+
+#endif /* WINDEX_H */